@@ -0,0 +1,355 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <disk.h>
+#include <fs.h>
+
+/* Default number of rows of the heatmap */
+#define HEATMAP_ROWS 32
+/* Width of the heatmap bars */
+#define BAR_WIDTH 40
+/* Number of blocks listed as the hottest */
+#define HOT_BLOCKS 10
+/* Number of buckets of the run length histogram, by powers of 2 */
+#define RUN_BUCKETS 16
+
+#define TAG_COUNT 256
+
+/* Names of the tags set by the file system, see enum fs_stats_blk */
+static const char *tag_names[FS_STATS_BLK_COUNT] = {
+	"super", "fat", "csum", "dir", "map", "data"
+};
+
+static struct block_trace_header header;
+static struct block_trace_event *events;
+static size_t event_count;
+/* One past the last block transferred, and number of threads */
+static size_t block_count, thread_count;
+
+static const char *tag_name(int tag)
+{
+	static char name[8];
+
+	if (tag < FS_STATS_BLK_COUNT)
+		return tag_names[tag];
+	if (tag == BLOCK_TRACE_UNTAGGED)
+		return "-";
+	snprintf(name, sizeof(name), "tag%d", tag);
+	return name;
+}
+
+static void load(const char *path)
+{
+	FILE *f = fopen(path, "rb");
+	size_t size = 0;
+
+	if (!f) {
+		perror(path);
+		exit(1);
+	}
+
+	if (fread(&header, sizeof(header), 1, f) != 1 ||
+	    memcmp(header.signature, BLOCK_TRACE_SIGNATURE,
+		   sizeof(header.signature)) ||
+	    header.version != BLOCK_TRACE_VERSION ||
+	    header.event_size != sizeof(struct block_trace_event)) {
+		fprintf(stderr, "%s: not a block trace\n", path);
+		exit(1);
+	}
+
+	for (;;) {
+		struct block_trace_event e;
+
+		if (fread(&e, sizeof(e), 1, f) != 1)
+			break;
+		if (event_count == size) {
+			size = size ? 2 * size : 4096;
+			events = realloc(events, size * sizeof(*events));
+			if (!events) {
+				perror("realloc");
+				exit(1);
+			}
+		}
+		events[event_count++] = e;
+
+		if (e.block + e.count > block_count)
+			block_count = e.block + e.count;
+		if (e.thread >= thread_count)
+			thread_count = e.thread + 1;
+	}
+	fclose(f);
+}
+
+static void summary(const char *path)
+{
+	size_t reads = 0, writes = 0, errors = 0;
+	uint64_t span = 0;
+
+	for (size_t i = 0; i < event_count; i++) {
+		struct block_trace_event *e = &events[i];
+
+		if (e->write)
+			writes += e->count;
+		else
+			reads += e->count;
+		if (e->ret == -1)
+			errors++;
+		if (e->time + e->duration > span)
+			span = e->time + e->duration;
+	}
+
+	printf("%s: %zu transfers (%llu dropped, %zu failed), %zu threads, "
+	       "%.3f s\n", path, event_count,
+	       (unsigned long long)header.dropped, errors, thread_count,
+	       span / 1e9);
+	printf("%zu blocks read, %zu blocks written, highest block %zu\n\n",
+	       reads, writes, block_count ? block_count - 1 : 0);
+}
+
+/* Blocks read and written by block, with the tag of their last transfer */
+static void count_blocks(uint32_t *reads, uint32_t *writes, uint8_t *tags)
+{
+	for (size_t i = 0; i < event_count; i++) {
+		struct block_trace_event *e = &events[i];
+
+		for (size_t b = e->block; b < e->block + e->count; b++) {
+			if (e->write)
+				writes[b]++;
+			else
+				reads[b]++;
+			tags[b] = e->tag;
+		}
+	}
+}
+
+static void heatmap(size_t rows)
+{
+	uint32_t *reads = calloc(block_count, sizeof(*reads));
+	uint32_t *writes = calloc(block_count, sizeof(*writes));
+	uint8_t *tags = calloc(block_count, sizeof(*tags));
+	size_t span, max = 0;
+
+	if (!reads || !writes || !tags) {
+		perror("calloc");
+		exit(1);
+	}
+	count_blocks(reads, writes, tags);
+
+	if (rows > block_count)
+		rows = block_count;
+	span = (block_count + rows - 1) / rows;
+	rows = (block_count + span - 1) / span;
+
+	/* Busiest row first, to scale the bars */
+	for (size_t r = 0; r < rows; r++) {
+		size_t total = 0;
+
+		for (size_t b = r * span; b < (r + 1) * span && b < block_count;
+		     b++)
+			total += reads[b] + writes[b];
+		if (total > max)
+			max = total;
+	}
+
+	printf("%-17s %10s %10s %-6s  (= read, # written)\n",
+	       "blocks", "reads", "writes", "tag");
+	for (size_t r = 0; r < rows; r++) {
+		size_t first = r * span, last = first + span - 1;
+		size_t rd = 0, wr = 0, by_tag[TAG_COUNT] = { 0 };
+		int tag = BLOCK_TRACE_UNTAGGED, len_rd, len_wr;
+
+		if (last >= block_count)
+			last = block_count - 1;
+		for (size_t b = first; b <= last; b++) {
+			rd += reads[b];
+			wr += writes[b];
+			by_tag[tags[b]] += reads[b] + writes[b];
+		}
+		/* Tag of most transfers in the row */
+		for (int t = 0; t < TAG_COUNT; t++)
+			if (by_tag[t] > by_tag[tag])
+				tag = t;
+
+		len_rd = max ? (rd * BAR_WIDTH + max - 1) / max : 0;
+		len_wr = max ? (wr * BAR_WIDTH + max - 1) / max : 0;
+		printf("%7zu-%-9zu %10zu %10zu %-6s |%.*s%.*s\n",
+		       first, last, rd, wr, rd + wr ? tag_name(tag) : "",
+		       len_rd, "========================================",
+		       len_wr, "########################################");
+	}
+
+	printf("\n%-10s %10s %10s %-6s\n", "hot block", "reads", "writes",
+	       "tag");
+	for (int n = 0; n < HOT_BLOCKS; n++) {
+		size_t hot = 0, total = 0;
+
+		for (size_t b = 0; b < block_count; b++) {
+			if (reads[b] + writes[b] > total) {
+				total = reads[b] + writes[b];
+				hot = b;
+			}
+		}
+		if (!total)
+			break;
+		printf("%-10zu %10u %10u %-6s\n", hot, reads[hot], writes[hot],
+		       tag_name(tags[hot]));
+		reads[hot] = writes[hot] = 0;
+	}
+
+	free(reads);
+	free(writes);
+	free(tags);
+}
+
+struct run_stats {
+	size_t transfers;
+	size_t blocks;
+	size_t runs;
+	size_t longest;
+	/* Transfers that follow the previous one of their thread */
+	size_t sequential;
+	uint64_t ns;
+	/* Blocks read that had already been read */
+	size_t rereads;
+};
+
+static int run_bucket(size_t len)
+{
+	int bucket = 63 - __builtin_clzll(len);
+
+	return bucket < RUN_BUCKETS ? bucket : RUN_BUCKETS - 1;
+}
+
+static void runs(void)
+{
+	/* Per tag, reads then writes */
+	static struct run_stats st[TAG_COUNT][2];
+	size_t hist[RUN_BUCKETS] = { 0 };
+	struct block_trace_event **prev = calloc(thread_count, sizeof(*prev));
+	/* Length and stats of the run each thread is in */
+	size_t *run_len = calloc(thread_count, sizeof(*run_len));
+	struct run_stats **run_st = calloc(thread_count, sizeof(*run_st));
+	uint8_t *read = calloc(block_count, 1);
+
+	if (!prev || !run_len || !run_st || !read) {
+		perror("calloc");
+		exit(1);
+	}
+
+	for (size_t i = 0; i < event_count; i++) {
+		struct block_trace_event *e = &events[i], *p = prev[e->thread];
+		struct run_stats *s = &st[e->tag][e->write];
+
+		s->transfers++;
+		s->blocks += e->count;
+		s->ns += e->duration;
+		if (!e->write) {
+			for (size_t b = e->block; b < e->block + e->count; b++) {
+				s->rereads += read[b];
+				read[b] = 1;
+			}
+		}
+
+		if (p && p->write == e->write && p->block + p->count == e->block) {
+			/* The run goes on, and belongs to its first transfer */
+			s->sequential++;
+			run_len[e->thread] += e->count;
+		} else {
+			if (p) {
+				hist[run_bucket(run_len[e->thread])]++;
+				if (run_len[e->thread] > run_st[e->thread]->longest)
+					run_st[e->thread]->longest =
+						run_len[e->thread];
+			}
+			s->runs++;
+			run_len[e->thread] = e->count;
+			run_st[e->thread] = s;
+		}
+		prev[e->thread] = e;
+	}
+
+	/* Runs still going at the end of the trace */
+	for (size_t t = 0; t < thread_count; t++) {
+		if (!prev[t])
+			continue;
+		hist[run_bucket(run_len[t])]++;
+		if (run_len[t] > run_st[t]->longest)
+			run_st[t]->longest = run_len[t];
+	}
+
+	printf("%-6s %-5s %10s %10s %8s %9s %8s %6s %9s %8s\n",
+	       "tag", "op", "transfers", "blocks", "runs", "blk/run", "longest",
+	       "seq%", "us/blk", "rereads");
+	for (int t = 0; t < TAG_COUNT; t++) {
+		for (int w = 0; w < 2; w++) {
+			struct run_stats *s = &st[t][w];
+
+			if (!s->transfers)
+				continue;
+			printf("%-6s %-5s %10zu %10zu %8zu %9.1f %8zu %5.1f%% "
+			       "%9.2f %8zu\n", tag_name(t),
+			       w ? "write" : "read", s->transfers, s->blocks,
+			       s->runs, (double)s->blocks / s->runs,
+			       s->longest,
+			       100.0 * s->sequential / s->transfers,
+			       s->ns / 1e3 / s->blocks, s->rereads);
+		}
+	}
+
+	printf("\n%-14s %10s\n", "run length", "runs");
+	for (int b = 0; b < RUN_BUCKETS; b++) {
+		char range[32];
+
+		if (!hist[b])
+			continue;
+		if (b == RUN_BUCKETS - 1)
+			snprintf(range, sizeof(range), "%zu+",
+				 (size_t)1 << b);
+		else if (b == 0)
+			snprintf(range, sizeof(range), "1");
+		else
+			snprintf(range, sizeof(range), "%zu-%zu",
+				 (size_t)1 << b, ((size_t)2 << b) - 1);
+		printf("%-14s %10zu\n", range, hist[b]);
+	}
+
+	free(prev);
+	free(run_len);
+	free(run_st);
+	free(read);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *report = "heatmap";
+	int rows = HEATMAP_ROWS;
+
+	if (argc < 2 || argc > 4)
+		goto usage;
+	if (argc > 2)
+		report = argv[2];
+	if (argc > 3)
+		rows = atoi(argv[3]);
+	if (strcmp(report, "heatmap") && strcmp(report, "runs"))
+		goto usage;
+	if (rows <= 0 || (argc > 3 && strcmp(report, "heatmap")))
+		goto usage;
+
+	load(argv[1]);
+	summary(argv[1]);
+	if (!event_count)
+		return 0;
+
+	if (!strcmp(report, "heatmap"))
+		heatmap(rows);
+	else
+		runs();
+	return 0;
+
+usage:
+	printf("Usage: %s <trace> [heatmap [<rows>]|runs]\n", argv[0]);
+	printf("Traces are recorded with BLOCK_TRACE=<trace>\n");
+	exit(1);
+}
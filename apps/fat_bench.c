@@ -0,0 +1,113 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include <fat_scan.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/* Number of entries of a maximal ECS150FS FAT */
+#define FAT_ENTRIES 65536
+
+/* Keep the optimizer from dropping the results */
+static volatile size_t sink;
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/* Fill @fat according to @pattern, with entry 0 always reserved */
+static void fill_fat(uint16_t *fat, size_t n, const char *pattern)
+{
+	srand(150);
+	for (size_t i = 0; i < n; i++) {
+		if (pattern[0] == 'e')		/* empty */
+			fat[i] = 0;
+		else if (pattern[0] == 'f')	/* full, last entry free */
+			fat[i] = i == n - 1 ? 0 : 0xFFFF;
+		else				/* random, 1 in 4 free */
+			fat[i] = rand() % 4 ? (uint16_t)(i + 1) : 0;
+	}
+	fat[0] = 0xFFFF;
+}
+
+static size_t run_kernel(int kernel, const uint16_t *fat, size_t n)
+{
+	switch (kernel) {
+	case 0:
+		return fat_count_free(fat, n);
+	case 1:
+		return fat_find_free(fat, n, 0);
+	default:
+		return fat_find_free_run(fat, n, 0, 8);
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	static const char *patterns[] = { "empty", "full", "random" };
+	static const char *kernels[] = { "count_free", "find_free",
+					 "find_free_run8" };
+	static const enum fat_scan_isa isas[] = {
+		FAT_SCAN_SCALAR, FAT_SCAN_SSE2, FAT_SCAN_AVX2
+	};
+	static uint16_t fat[FAT_ENTRIES];
+	int iters = 2000;
+
+	if (argc > 1)
+		iters = atoi(argv[1]);
+	if (iters <= 0) {
+		printf("Usage: %s [<iterations>]\n", argv[0]);
+		exit(1);
+	}
+
+	printf("%-8s %-16s %-8s %12s %12s\n",
+	       "pattern", "kernel", "isa", "ns/call", "entries/ns");
+
+	for (size_t p = 0; p < ARRAY_SIZE(patterns); p++) {
+		fill_fat(fat, FAT_ENTRIES, patterns[p]);
+
+		for (size_t k = 0; k < ARRAY_SIZE(kernels); k++) {
+			size_t expected, scanned;
+
+			fat_scan_select(FAT_SCAN_SCALAR);
+			expected = run_kernel(k, fat, FAT_ENTRIES);
+
+			/* Searches stop at the entry they are looking for */
+			scanned = FAT_ENTRIES;
+			if (k > 0 && expected < FAT_ENTRIES)
+				scanned = expected + (k == 1 ? 1 : 8);
+
+			for (size_t a = 0; a < ARRAY_SIZE(isas); a++) {
+				double start, ns;
+
+				if (fat_scan_select(isas[a]))
+					continue;
+
+				/* Every implementation must agree with the scalar one */
+				if (run_kernel(k, fat, FAT_ENTRIES) != expected) {
+					fprintf(stderr, "%s: %s mismatch on '%s'\n",
+						fat_scan_isa_name(), kernels[k],
+						patterns[p]);
+					exit(1);
+				}
+
+				start = now_ns();
+				for (int i = 0; i < iters; i++)
+					sink = run_kernel(k, fat, FAT_ENTRIES);
+				ns = (now_ns() - start) / iters;
+
+				printf("%-8s %-16s %-8s %12.0f %12.2f\n",
+				       patterns[p], kernels[k],
+				       fat_scan_isa_name(), ns, scanned / ns);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -0,0 +1,454 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <disk.h>
+#include <fs.h>
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
+
+/*
+ * Every workload runs on a new file system of this many data blocks, the most
+ * that a version 1 file system (the format of fs_make.x and fs_ref.x) can
+ * have, so that all formats are benchmarked on the same workloads.
+ */
+#define DATA_BLK_COUNT 8192
+
+/* Seed of the random workloads, which are the same from one run to the next */
+#define SEED 150
+
+/* Size of the file of the sequential and random workloads */
+#define FILE_SIZE (16 << 20)
+/* Number of random reads or writes */
+#define RAND_OPS 8192
+
+/* Files of the small-file churn, their size range, and number of operations */
+#define CHURN_FILES 64
+#define CHURN_MIN 1024
+#define CHURN_MAX 8192
+#define CHURN_OPS 4096
+
+/* Logs of the append workload, size of the records appended to them */
+#define LOG_COUNT 4
+#define LOG_RECORD 100
+#define APPEND_OPS 16384
+
+/* Files filling the disk up to FULL_PERCENT, and number of files replaced */
+#define FULL_FILES 96
+#define FULL_PERCENT 95
+#define FULL_OPS 256
+
+static const char *diskname = "ram:bench";
+static struct fs_mkfs_options opts = { .version = 1 };
+
+static char buf[FILE_SIZE / 16];
+
+/* Timed part of a workload */
+struct run {
+	size_t io_size;
+	/* Latency of each operation, in ns */
+	double *lat;
+	size_t ops;
+	size_t bytes;
+	double start;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void die(const char *what, const char *name)
+{
+	fprintf(stderr, "fs_bench: %s '%s' failed\n", what, name);
+	exit(1);
+}
+
+static void op_begin(struct run *r)
+{
+	r->start = now_ns();
+}
+
+static void op_end(struct run *r, size_t bytes)
+{
+	r->lat[r->ops++] = now_ns() - r->start;
+	r->bytes += bytes;
+}
+
+static int open_file(const char *name)
+{
+	int fd = fs_open(name);
+
+	if (fd < 0)
+		die("fs_open", name);
+	return fd;
+}
+
+/* Write @len bytes to @fd, in chunks of at most sizeof(buf) */
+static void write_file(int fd, size_t len)
+{
+	while (len) {
+		size_t n = len < sizeof(buf) ? len : sizeof(buf);
+
+		if (fs_write(fd, buf, n) != (int)n)
+			die("fs_write", diskname);
+		len -= n;
+	}
+}
+
+/* Create file @name, of @len bytes */
+static void make_file(const char *name, size_t len)
+{
+	int fd;
+
+	if (fs_create(name))
+		die("fs_create", name);
+	fd = open_file(name);
+	write_file(fd, len);
+	fs_close(fd);
+}
+
+static void prep_file(struct run *r)
+{
+	(void)r;
+	make_file("file", FILE_SIZE);
+}
+
+static void seq_write(struct run *r)
+{
+	int fd;
+
+	if (fs_create("file"))
+		die("fs_create", "file");
+	fd = open_file("file");
+	for (size_t off = 0; off < FILE_SIZE; off += r->io_size) {
+		op_begin(r);
+		if (fs_write(fd, buf, r->io_size) != (int)r->io_size)
+			die("fs_write", "file");
+		op_end(r, r->io_size);
+	}
+	fs_close(fd);
+}
+
+static void seq_read(struct run *r)
+{
+	int fd = open_file("file");
+
+	for (size_t off = 0; off < FILE_SIZE; off += r->io_size) {
+		op_begin(r);
+		if (fs_read(fd, buf, r->io_size) != (int)r->io_size)
+			die("fs_read", "file");
+		op_end(r, r->io_size);
+	}
+	fs_close(fd);
+}
+
+static void rand_io(struct run *r, int write)
+{
+	int fd = open_file("file");
+
+	for (size_t i = 0; i < RAND_OPS; i++) {
+		size_t off = (size_t)rand() % (FILE_SIZE / r->io_size) *
+			r->io_size;
+		int ret;
+
+		op_begin(r);
+		fs_lseek(fd, off);
+		if (write)
+			ret = fs_write(fd, buf, r->io_size);
+		else
+			ret = fs_read(fd, buf, r->io_size);
+		if (ret != (int)r->io_size)
+			die(write ? "fs_write" : "fs_read", "file");
+		op_end(r, r->io_size);
+	}
+	fs_close(fd);
+}
+
+static void rand_read(struct run *r)
+{
+	rand_io(r, 0);
+}
+
+static void rand_write(struct run *r)
+{
+	rand_io(r, 1);
+}
+
+/* Create a missing file, or delete an existing one, at random */
+static void churn(struct run *r)
+{
+	char exists[CHURN_FILES] = { 0 };
+	char name[FS_FILENAME_LEN];
+
+	for (size_t i = 0; i < CHURN_OPS; i++) {
+		int f = rand() % CHURN_FILES;
+		size_t len = CHURN_MIN + rand() % (CHURN_MAX - CHURN_MIN + 1);
+
+		snprintf(name, sizeof(name), "churn%d", f);
+		op_begin(r);
+		if (exists[f]) {
+			if (fs_delete(name))
+				die("fs_delete", name);
+			len = 0;
+		} else {
+			make_file(name, len);
+		}
+		op_end(r, len);
+		exists[f] = !exists[f];
+	}
+}
+
+/* Append a record to a log, reopening it every time as a logger would */
+static void append(struct run *r)
+{
+	char name[FS_FILENAME_LEN];
+
+	for (int l = 0; l < LOG_COUNT; l++) {
+		snprintf(name, sizeof(name), "log%d", l);
+		if (fs_create(name))
+			die("fs_create", name);
+	}
+
+	for (size_t i = 0; i < APPEND_OPS; i++) {
+		int fd;
+
+		snprintf(name, sizeof(name), "log%zu", i % LOG_COUNT);
+		op_begin(r);
+		fd = open_file(name);
+		fs_lseek(fd, fs_stat(fd));
+		if (fs_write(fd, buf, LOG_RECORD) != LOG_RECORD)
+			die("fs_write", name);
+		fs_close(fd);
+		op_end(r, LOG_RECORD);
+	}
+}
+
+/* Blocks of each of the files filling the disk */
+static size_t full_blocks(void)
+{
+	struct fs_statfs st;
+
+	if (fs_statfs(&st))
+		die("fs_statfs", diskname);
+	return st.data_blk_count * FULL_PERCENT / 100 / FULL_FILES;
+}
+
+/*
+ * Fill the disk with files written a block at a time in turn, so that the
+ * blocks of the files are interleaved and freeing a file leaves holes all over
+ * the disk.
+ */
+static void prep_full(struct run *r)
+{
+	size_t blocks = full_blocks();
+	char name[FS_FILENAME_LEN];
+
+	(void)r;
+	for (int f = 0; f < FULL_FILES; f++) {
+		snprintf(name, sizeof(name), "full%d", f);
+		if (fs_create(name))
+			die("fs_create", name);
+	}
+
+	for (size_t b = 0; b < blocks; b++) {
+		for (int f = 0; f < FULL_FILES; f++) {
+			int fd;
+
+			snprintf(name, sizeof(name), "full%d", f);
+			fd = open_file(name);
+			fs_lseek(fd, b * BLOCK_SIZE);
+			write_file(fd, BLOCK_SIZE);
+			fs_close(fd);
+		}
+	}
+}
+
+/* Replace files of the full disk by files of the same size */
+static void near_full(struct run *r)
+{
+	size_t len = full_blocks() * BLOCK_SIZE;
+	char name[FS_FILENAME_LEN];
+
+	for (size_t i = 0; i < FULL_OPS; i++) {
+		snprintf(name, sizeof(name), "full%d", rand() % FULL_FILES);
+		op_begin(r);
+		if (fs_delete(name))
+			die("fs_delete", name);
+		make_file(name, len);
+		op_end(r, len);
+	}
+}
+
+static const struct workload {
+	const char *name;
+	size_t io_size;
+	size_t ops;
+	/* Untimed preparation, and timed part */
+	void (*prep)(struct run *r);
+	void (*run)(struct run *r);
+} workloads[] = {
+	{ "seq_write",	512,	FILE_SIZE / 512,	NULL,	seq_write },
+	{ "seq_write",	4096,	FILE_SIZE / 4096,	NULL,	seq_write },
+	{ "seq_write",	65536,	FILE_SIZE / 65536,	NULL,	seq_write },
+	{ "seq_read",	512,	FILE_SIZE / 512,	prep_file, seq_read },
+	{ "seq_read",	4096,	FILE_SIZE / 4096,	prep_file, seq_read },
+	{ "seq_read",	65536,	FILE_SIZE / 65536,	prep_file, seq_read },
+	{ "rand_read",	512,	RAND_OPS,		prep_file, rand_read },
+	{ "rand_read",	4096,	RAND_OPS,		prep_file, rand_read },
+	{ "rand_write",	512,	RAND_OPS,		prep_file, rand_write },
+	{ "rand_write",	4096,	RAND_OPS,		prep_file, rand_write },
+	{ "churn",	0,	CHURN_OPS,		NULL,	churn },
+	{ "append",	LOG_RECORD, APPEND_OPS,		NULL,	append },
+	{ "near_full",	0,	FULL_OPS,		prep_full, near_full },
+};
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Latency below which a fraction @q of the operations completed */
+static double percentile(const struct run *r, double q)
+{
+	size_t i = (size_t)(q * r->ops);
+
+	return r->lat[i < r->ops ? i : r->ops - 1];
+}
+
+static void bench(const struct workload *w, int first)
+{
+	struct run r = { .io_size = w->io_size };
+	struct fs_statfs before, after;
+	double start, ns;
+
+	if (!(r.lat = malloc(w->ops * sizeof(*r.lat)))) {
+		perror("malloc");
+		exit(1);
+	}
+
+	/* Every workload starts from a new file system, and the same seed */
+	if (fs_mkfs(diskname, DATA_BLK_COUNT, &opts))
+		die("fs_mkfs", diskname);
+	if (fs_mount(diskname))
+		die("fs_mount", diskname);
+	srand(SEED);
+	if (w->prep) {
+		w->prep(&r);
+		if (fs_umount() || fs_mount(diskname))
+			die("remounting", diskname);
+	}
+
+	fs_statfs(&before);
+	start = now_ns();
+	w->run(&r);
+	ns = now_ns() - start;
+	fs_statfs(&after);
+	if (fs_umount())
+		die("fs_umount", diskname);
+
+	qsort(r.lat, r.ops, sizeof(*r.lat), cmp_double);
+
+	printf("%s\n    {\n", first ? "" : ",");
+	printf("      \"name\": \"%s\",\n", w->name);
+	printf("      \"io_size\": %zu,\n", w->io_size);
+	printf("      \"ops\": %zu,\n", r.ops);
+	printf("      \"bytes\": %zu,\n", r.bytes);
+	printf("      \"seconds\": %.6f,\n", ns / 1e9);
+	printf("      \"ops_per_sec\": %.1f,\n", r.ops / (ns / 1e9));
+	printf("      \"mb_per_sec\": %.2f,\n", r.bytes / 1e6 / (ns / 1e9));
+	printf("      \"latency_ns\": { \"p50\": %.0f, \"p99\": %.0f, "
+	       "\"p999\": %.0f, \"max\": %.0f },\n",
+	       percentile(&r, 0.5), percentile(&r, 0.99),
+	       percentile(&r, 0.999), r.lat[r.ops - 1]);
+	printf("      \"block_reads\": %zu,\n",
+	       after.blk_read_count - before.blk_read_count);
+	printf("      \"block_writes\": %zu\n",
+	       after.blk_write_count - before.blk_write_count);
+	printf("    }");
+	fflush(stdout);
+
+	free(r.lat);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *format = "v1";
+	char version[16];
+	size_t len;
+	int first = 1;
+
+	if (argc > 1)
+		diskname = argv[1];
+	if (argc > 2)
+		format = argv[2];
+
+	len = strlen(format);
+	if (len >= sizeof(version))
+		goto usage;
+	strcpy(version, format);
+	if (len > 5 && !strcmp(version + len - 5, "-csum")) {
+		version[len - 5] = '\0';
+		opts.checksums = 1;
+	}
+	if (!strcmp(version, "v2")) {
+		opts.version = 2;
+	} else if (!strcmp(version, "v2-hashed")) {
+		opts.version = 2;
+		opts.hashed_dir = 1;
+	} else if (strcmp(version, "v1")) {
+		goto usage;
+	}
+
+	/* Workloads given by name must exist */
+	for (int i = 3; i < argc; i++) {
+		size_t w;
+
+		for (w = 0; w < ARRAY_SIZE(workloads); w++)
+			if (!strcmp(argv[i], workloads[w].name))
+				break;
+		if (w == ARRAY_SIZE(workloads))
+			goto usage;
+	}
+
+	memset(buf, 0xA5, sizeof(buf));
+
+	printf("{\n");
+	printf("  \"disk\": \"%s\",\n", diskname);
+	printf("  \"format\": \"%s\",\n", format);
+	printf("  \"data_blk_count\": %d,\n", DATA_BLK_COUNT);
+	printf("  \"seed\": %d,\n", SEED);
+	printf("  \"workloads\": [");
+
+	for (size_t w = 0; w < ARRAY_SIZE(workloads); w++) {
+		int selected = argc <= 3;
+
+		for (int i = 3; i < argc; i++)
+			if (!strcmp(argv[i], workloads[w].name))
+				selected = 1;
+		if (!selected)
+			continue;
+
+		bench(&workloads[w], first);
+		first = 0;
+	}
+
+	printf("\n  ]\n}\n");
+
+	if (!strncmp(diskname, "ram:", 4))
+		block_disk_drop(diskname);
+	return 0;
+
+usage:
+	printf("Usage: %s [<diskname> [v1|v2|v2-hashed][-csum] "
+	       "[<workload>...]]\n", argv[0]);
+	printf("Workloads: seq_write seq_read rand_read rand_write churn "
+	       "append near_full\n");
+	exit(1);
+}
@@ -1,15 +1,19 @@
 #include <assert.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
+#include <disk.h>
 #include <fs.h>
+#include <fs_trace.h>
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof((x)[0]))
 
@@ -152,6 +156,31 @@ void thread_fs_script(void *arg)
 				printf("SEEK successful.\n");
 			}
 
+		} else if (strcmp(command, "ADVISE") == 0) {
+			static const char *advice_names[] = {
+				"NORMAL", "SEQUENTIAL", "RANDOM", "WILLNEED",
+				"DONTNEED", "NOREUSE"
+			};
+			size_t adv_offset = 0, adv_len = 0;
+			int advice = -1;
+
+			for (size_t i = 0; i < ARRAY_SIZE(advice_names); i++)
+				if (command_args[1] &&
+				    !strcmp(command_args[1], advice_names[i]))
+					advice = i;
+			if (command_args[1] && command_args[2]) {
+				adv_offset = atoi(command_args[2]);
+				if (command_args[3])
+					adv_len = atoi(command_args[3]);
+			}
+
+			if (fs_advise(fs_fd, adv_offset, adv_len, advice)) {
+				fs_umount();
+				die("Cannot advise");
+			}
+
+			printf("ADVISE successful.\n");
+
 		} else if (strcmp(command, "WRITE") == 0) {
 			data_source = command_args[1];
 			data_description = command_args[2];
@@ -398,6 +427,32 @@ void thread_fs_rm(void *arg)
 	printf("Removed file '%s'\n", filename);
 }
 
+void thread_fs_clone(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *src, *dst;
+
+	if (t_arg->argc < 3)
+		die("need <diskname> <filename> <new filename>");
+
+	diskname = t_arg->argv[0];
+	src = t_arg->argv[1];
+	dst = t_arg->argv[2];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_clone(src, dst)) {
+		fs_umount();
+		die("Cannot clone file");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Cloned file '%s' to '%s'\n", src, dst);
+}
+
 void thread_fs_add(void *arg)
 {
 	struct thread_arg *t_arg = arg;
@@ -405,12 +460,21 @@ void thread_fs_add(void *arg)
 	int fd, fs_fd;
 	struct stat st;
 	int written;
+	int attrs = 0;
 
 	if (t_arg->argc < 2)
-		die("Usage: <diskname> <host filename>");
+		die("Usage: <diskname> <host filename> [compress|dedup]");
 
 	diskname = t_arg->argv[0];
 	filename = t_arg->argv[1];
+	if (t_arg->argc > 2) {
+		if (!strcmp(t_arg->argv[2], "compress"))
+			attrs = FS_ATTR_COMPRESS;
+		else if (!strcmp(t_arg->argv[2], "dedup"))
+			attrs = FS_ATTR_DEDUP;
+		else
+			die("Invalid attribute '%s'", t_arg->argv[2]);
+	}
 
 	/* Open file on host computer */
 	fd = open(filename, O_RDONLY);
@@ -438,6 +502,11 @@ void thread_fs_add(void *arg)
 		die("Cannot create file");
 	}
 
+	if (attrs && fs_setattr(filename, attrs)) {
+		fs_umount();
+		die("Cannot set file attributes");
+	}
+
 	fs_fd = fs_open(filename);
 	if (fs_fd < 0) {
 		fs_umount();
@@ -467,17 +536,74 @@ void thread_fs_ls(void *arg)
 	char *diskname;
 
 	if (t_arg->argc < 1)
-		die("Usage: <diskname>");
+		die("Usage: <diskname> [<directory>]");
+
+	diskname = t_arg->argv[0];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (t_arg->argc > 1) {
+		if (fs_lsdir(t_arg->argv[1])) {
+			fs_umount();
+			die("Cannot list directory");
+		}
+	} else {
+		fs_ls();
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+}
+
+void thread_fs_mkdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *path;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <directory>");
 
 	diskname = t_arg->argv[0];
+	path = t_arg->argv[1];
 
 	if (fs_mount(diskname))
 		die("Cannot mount diskname");
 
-	fs_ls();
+	if (fs_mkdir(path)) {
+		fs_umount();
+		die("Cannot create directory");
+	}
 
 	if (fs_umount())
 		die("Cannot unmount diskname");
+
+	printf("Created directory '%s'\n", path);
+}
+
+void thread_fs_rmdir(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char *diskname, *path;
+
+	if (t_arg->argc < 2)
+		die("need <diskname> <directory>");
+
+	diskname = t_arg->argv[0];
+	path = t_arg->argv[1];
+
+	if (fs_mount(diskname))
+		die("Cannot mount diskname");
+
+	if (fs_rmdir(path)) {
+		fs_umount();
+		die("Cannot delete directory");
+	}
+
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	printf("Removed directory '%s'\n", path);
 }
 
 void thread_fs_info(void *arg)
@@ -507,6 +633,652 @@ size_t get_argv(char *argv)
 	return (size_t)ret;
 }
 
+void thread_fs_mkfs(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct fs_mkfs_options opts = { 0 };
+	char *diskname;
+	size_t data_blk_count;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <data block count> [v1|v2|v2-hashed]"
+		    "[-csum] [<root entry count>]");
+
+	diskname = t_arg->argv[0];
+	data_blk_count = get_argv(t_arg->argv[1]);
+
+	opts.version = 1;
+	if (t_arg->argc > 2) {
+		char version[16];
+		size_t len = strlen(t_arg->argv[2]);
+
+		if (len >= sizeof(version))
+			die("Invalid version '%s'", t_arg->argv[2]);
+		strcpy(version, t_arg->argv[2]);
+		if (len > 5 && !strcmp(version + len - 5, "-csum")) {
+			version[len - 5] = '\0';
+			opts.checksums = 1;
+		}
+
+		if (!strcmp(version, "v1"))
+			opts.version = 1;
+		else if (!strcmp(version, "v2"))
+			opts.version = 2;
+		else if (!strcmp(version, "v2-hashed")) {
+			opts.version = 2;
+			opts.hashed_dir = 1;
+		}
+		else
+			die("Invalid version '%s'", t_arg->argv[2]);
+	}
+	if (t_arg->argc > 3)
+		opts.rdir_entry_count = get_argv(t_arg->argv[3]);
+
+	if (fs_mkfs(diskname, data_blk_count, &opts))
+		die("Cannot create file system");
+
+	printf("Created v%d file system '%s' with %zu data blocks\n",
+	       opts.version, diskname, data_blk_count);
+}
+
+/* Time before a replayed call that is waited for without sleeping, in ns */
+#define REPLAY_SPIN_NS 200000
+
+/* Latencies of the replayed calls of one kind */
+struct replay_op {
+	size_t count;
+	/* Calls whose return value differs from the recorded one */
+	size_t diverged;
+	double *lat;
+	size_t lat_max;
+	/* Sum of the recorded latencies */
+	double recorded;
+};
+
+static double now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static int cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *)a, y = *(const double *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+/* Replayed file descriptor of recorded file descriptor @fd */
+static int replay_fd(const int *fds, int fd)
+{
+	if (fd < 0 || fd >= FS_OPEN_MAX_COUNT)
+		return fd;
+	return fds[fd];
+}
+
+void thread_fs_replay(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct replay_op ops[FS_TRACE_OP_COUNT] = { 0 };
+	struct fs_trace_header h;
+	struct fs_trace_record r;
+	char *diskname, *names = NULL, *data = NULL;
+	size_t data_len = 0, total = 0, diverged = 0;
+	int fds[FS_OPEN_MAX_COUNT];
+	int timed = 0, first = 1;
+	double start = 0, end;
+	uint64_t trace_base = 0, trace_end = 0;
+	FILE *trace;
+
+	if (t_arg->argc < 2)
+		die("Usage: <diskname> <trace file> [fast|timed]");
+
+	diskname = t_arg->argv[0];
+	if (t_arg->argc > 2) {
+		if (!strcmp(t_arg->argv[2], "timed"))
+			timed = 1;
+		else if (strcmp(t_arg->argv[2], "fast"))
+			die("Invalid speed '%s'", t_arg->argv[2]);
+	}
+
+	trace = fopen(t_arg->argv[1], "rb");
+	if (!trace)
+		die_perror("fopen");
+	if (fread(&h, sizeof(h), 1, trace) != 1 ||
+	    memcmp(h.signature, FS_TRACE_SIGNATURE, sizeof(h.signature)) ||
+	    h.version != FS_TRACE_VERSION || h.record_size != sizeof(r))
+		die("'%s' is not a trace file", t_arg->argv[1]);
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i++)
+		fds[i] = -1;
+
+	while (fread(&r, sizeof(r), 1, trace) == 1) {
+		struct fs_mkfs_options mkfs_opts = { 0 };
+		struct fs_mount_options mount_opts = { 0 };
+		struct fs_statfs st;
+		struct replay_op *op;
+		char *name2;
+		double call_start, t;
+		int ret, fd;
+
+		if (r.op == 0 || r.op >= FS_TRACE_OP_COUNT)
+			die("Invalid call %d in trace", r.op);
+		op = &ops[r.op];
+
+		names = realloc(names, r.name_len + 1);
+		if (!names)
+			die_perror("realloc");
+		if (fread(names, 1, r.name_len, trace) != r.name_len)
+			die("Truncated trace");
+		names[r.name_len] = '\0';
+		name2 = names + strlen(names);
+		if (name2 < names + r.name_len)
+			name2++;
+
+		if ((r.op == FS_TRACE_WRITE || r.op == FS_TRACE_READ) &&
+		    r.size > data_len) {
+			data = realloc(data, r.size);
+			if (!data)
+				die_perror("realloc");
+			memset(data + data_len, 0x5A, r.size - data_len);
+			data_len = r.size;
+		}
+
+		/* Calls start at their recorded time, relative to the first */
+		if (first) {
+			start = now_ns();
+			trace_base = r.time;
+			first = 0;
+		} else if (timed) {
+			double at = start + (r.time - trace_base);
+			double wake = at - REPLAY_SPIN_NS;
+			struct timespec ts = {
+				.tv_sec = wake / 1e9,
+				.tv_nsec = wake - (long long)(wake / 1e9) * 1e9,
+			};
+
+			/* Sleeps overshoot, so the end of the wait spins */
+			if (wake > now_ns())
+				clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME,
+						&ts, NULL);
+			while (now_ns() < at)
+				;
+		}
+		if (r.time + r.latency > trace_end)
+			trace_end = r.time + r.latency;
+
+		fd = replay_fd(fds, r.fd);
+		call_start = now_ns();
+		switch (r.op) {
+		case FS_TRACE_MKFS:
+			mkfs_opts.version = r.fd & 0xFF;
+			mkfs_opts.hashed_dir = !!(r.fd & 0x100);
+			mkfs_opts.checksums = !!(r.fd & 0x200);
+			mkfs_opts.rdir_entry_count = r.size;
+			ret = fs_mkfs(diskname, r.offset, &mkfs_opts);
+			break;
+		case FS_TRACE_MOUNT:
+			mount_opts.lazy = r.fd;
+			mount_opts.fat_cache_max = r.offset;
+			ret = fs_mount_ex(diskname, &mount_opts);
+			break;
+		case FS_TRACE_UMOUNT:
+			ret = fs_umount();
+			break;
+		case FS_TRACE_INFO:
+			ret = fs_info();
+			break;
+		case FS_TRACE_STATFS:
+			ret = fs_statfs(&st);
+			break;
+		case FS_TRACE_CREATE:
+			ret = fs_create(names);
+			break;
+		case FS_TRACE_DELETE:
+			ret = fs_delete(names);
+			break;
+		case FS_TRACE_LS:
+			ret = fs_ls();
+			break;
+		case FS_TRACE_MKDIR:
+			ret = fs_mkdir(names);
+			break;
+		case FS_TRACE_RMDIR:
+			ret = fs_rmdir(names);
+			break;
+		case FS_TRACE_LSDIR:
+			ret = fs_lsdir(names);
+			break;
+		case FS_TRACE_OPEN:
+			ret = fs_open(names);
+			break;
+		case FS_TRACE_CLOSE:
+			ret = fs_close(fd);
+			break;
+		case FS_TRACE_STAT:
+			ret = fs_stat(fd);
+			break;
+		case FS_TRACE_LSEEK:
+			ret = fs_lseek(fd, r.offset);
+			break;
+		case FS_TRACE_SETATTR:
+			ret = fs_setattr(names, r.size);
+			break;
+		case FS_TRACE_GETATTR:
+			ret = fs_getattr(names);
+			break;
+		case FS_TRACE_CLONE:
+			ret = fs_clone(names, name2);
+			break;
+		case FS_TRACE_WRITE:
+			ret = fs_write(fd, data, r.size);
+			break;
+		case FS_TRACE_ADVISE:
+			ret = fs_advise(replay_fd(fds, r.fd & 0xFFFF), r.offset,
+					r.size, r.fd >> 16 & 0xFFFF);
+			break;
+		default:
+			ret = fs_read(fd, data, r.size);
+			break;
+		}
+		t = now_ns() - call_start;
+
+		/* Replayed descriptors need not be the recorded ones */
+		if (r.op == FS_TRACE_OPEN && r.ret >= 0 &&
+		    r.ret < FS_OPEN_MAX_COUNT)
+			fds[r.ret] = ret;
+		if (r.op == FS_TRACE_CLOSE && r.fd >= 0 &&
+		    r.fd < FS_OPEN_MAX_COUNT)
+			fds[r.fd] = -1;
+
+		if (r.op == FS_TRACE_OPEN ? (ret < 0) != (r.ret < 0) :
+		    ret != r.ret) {
+			op->diverged++;
+			diverged++;
+		}
+
+		if (op->count == op->lat_max) {
+			op->lat_max = op->lat_max ? 2 * op->lat_max : 64;
+			op->lat = realloc(op->lat,
+					  op->lat_max * sizeof(*op->lat));
+			if (!op->lat)
+				die_perror("realloc");
+		}
+		op->lat[op->count++] = t;
+		op->recorded += r.latency;
+		total++;
+	}
+	end = now_ns();
+	fclose(trace);
+	free(names);
+	free(data);
+
+	printf("Replayed %zu calls in %.3f s, recorded in %.3f s\n", total,
+	       total ? (end - start) / 1e9 : 0,
+	       (trace_end - trace_base) / 1e9);
+	printf("%-8s %8s %8s %10s %10s %10s %10s %10s\n", "call", "count",
+	       "diverged", "mean_us", "p50_us", "p99_us", "max_us",
+	       "rec_us");
+	for (int i = 1; i < FS_TRACE_OP_COUNT; i++) {
+		struct replay_op *op = &ops[i];
+		double sum = 0;
+
+		if (!op->count)
+			continue;
+
+		qsort(op->lat, op->count, sizeof(*op->lat), cmp_double);
+		for (size_t j = 0; j < op->count; j++)
+			sum += op->lat[j];
+		printf("%-8s %8zu %8zu %10.1f %10.1f %10.1f %10.1f %10.1f\n",
+		       fs_trace_op_name(i), op->count, op->diverged,
+		       sum / op->count / 1e3,
+		       op->lat[op->count / 2] / 1e3,
+		       op->lat[op->count * 99 / 100] / 1e3,
+		       op->lat[op->count - 1] / 1e3,
+		       op->recorded / op->count / 1e3);
+		free(op->lat);
+	}
+
+	/* Calls are recorded in the order they ran, replays must not diverge */
+	if (diverged)
+		die("%zu calls diverged", diverged);
+}
+
+/* Files shared by the stress threads, and their largest size */
+#define STRESS_SHARED 4
+#define STRESS_FILE_MAX (256 * 1024)
+/* Largest read or write */
+#define STRESS_IO_MAX (16 * 1024)
+/* Largest number of threads, which each keep two files open */
+#define STRESS_THREADS_MAX (FS_OPEN_MAX_COUNT / 2)
+/* Data blocks needed by the largest files, map blocks included */
+#define STRESS_BLOCKS ((STRESS_SHARED + STRESS_THREADS_MAX) * \
+		       (STRESS_FILE_MAX / BLOCK_SIZE + 2))
+
+enum stress_op {
+	STRESS_CREATE,
+	STRESS_OPEN,
+	STRESS_READ,
+	STRESS_WRITE,
+	STRESS_SEEK,
+	STRESS_DELETE,
+	STRESS_OP_COUNT
+};
+
+static const char *stress_op_names[STRESS_OP_COUNT] = {
+	"create", "open", "read", "write", "seek", "delete"
+};
+
+/* Weights of the operations, as given on the command line */
+static int stress_mix[STRESS_OP_COUNT];
+static int stress_mix_total;
+static int stress_stop;
+
+struct stress_thread {
+	pthread_t thread;
+	int id;
+	unsigned int seed;
+	/* Private file, which may not exist, and descriptors, or -1 */
+	char priv[32];
+	int priv_exists;
+	int priv_fd;
+	int shared_fd, shared_id;
+	/* Results */
+	size_t ops, bytes, errors, corrupt;
+	char buf[STRESS_IO_MAX];
+};
+
+/*
+ * Byte at offset @off of file @file: every write of a range of a file writes
+ * the same bytes, so the data read back is known whatever the interleaving of
+ * the threads.
+ */
+static unsigned char stress_byte(int file, size_t off)
+{
+	return file * 151 + off + (off >> 9) * 7 + (off >> 12) * 31;
+}
+
+static void stress_error(struct stress_thread *t, const char *what)
+{
+	if (t->errors++ == 0)
+		test_fs_error("thread %d: %s failed", t->id, what);
+}
+
+static void stress_open_shared(struct stress_thread *t)
+{
+	char name[FS_FILENAME_LEN];
+
+	if (t->shared_fd != -1 && fs_close(t->shared_fd))
+		stress_error(t, "close");
+	t->shared_id = rand_r(&t->seed) % STRESS_SHARED;
+	snprintf(name, sizeof(name), "stress_s%d", t->shared_id);
+	if ((t->shared_fd = fs_open(name)) < 0)
+		stress_error(t, "open");
+}
+
+static void stress_io(struct stress_thread *t, enum stress_op op)
+{
+	int use_priv = t->priv_fd != -1 &&
+		(t->shared_fd == -1 || rand_r(&t->seed) % 2);
+	int fd = use_priv ? t->priv_fd : t->shared_fd;
+	int file = use_priv ? STRESS_SHARED + t->id : t->shared_id;
+	size_t len = 1 + rand_r(&t->seed) % STRESS_IO_MAX;
+	size_t size, off;
+	int size_ret, ret;
+
+	if (fd == -1)
+		return;
+	if ((size_ret = fs_stat(fd)) < 0) {
+		stress_error(t, "stat");
+		return;
+	}
+	size = size_ret;
+
+	switch (op) {
+	case STRESS_SEEK:
+		if (fs_lseek(fd, rand_r(&t->seed) % (size + 1)))
+			stress_error(t, "lseek");
+		return;
+
+	case STRESS_WRITE:
+		/* Files only grow, so the offset stays within the file */
+		if (size > STRESS_FILE_MAX - len)
+			size = STRESS_FILE_MAX - len;
+		off = rand_r(&t->seed) % (size + 1);
+		for (size_t i = 0; i < len; i++)
+			t->buf[i] = stress_byte(file, off + i);
+		if (fs_lseek(fd, off)) {
+			stress_error(t, "lseek");
+			return;
+		}
+		if ((ret = fs_write(fd, t->buf, len)) != (int)len) {
+			stress_error(t, "write");
+			return;
+		}
+		t->bytes += len;
+		return;
+
+	default:
+		if (size == 0)
+			return;
+		off = rand_r(&t->seed) % size;
+		if (len > size - off)
+			len = size - off;
+		if (fs_lseek(fd, off)) {
+			stress_error(t, "lseek");
+			return;
+		}
+		if ((ret = fs_read(fd, t->buf, len)) != (int)len) {
+			stress_error(t, "read");
+			return;
+		}
+		t->bytes += len;
+		for (size_t i = 0; i < len; i++) {
+			if ((unsigned char)t->buf[i] != stress_byte(file, off + i)) {
+				if (t->corrupt++ == 0)
+					test_fs_error("thread %d: bad data in "
+						      "file %d at offset %zu",
+						      t->id, file, off + i);
+				break;
+			}
+		}
+		return;
+	}
+}
+
+static void stress_one(struct stress_thread *t, enum stress_op op)
+{
+	switch (op) {
+	case STRESS_CREATE:
+		/* Creating an existing file must fail */
+		if (fs_create(t->priv) != (t->priv_exists ? -1 : 0)) {
+			stress_error(t, "create");
+			break;
+		}
+		t->priv_exists = 1;
+		if (t->priv_fd == -1 && (t->priv_fd = fs_open(t->priv)) < 0)
+			stress_error(t, "open");
+		break;
+
+	case STRESS_OPEN:
+		stress_open_shared(t);
+		break;
+
+	case STRESS_DELETE:
+		if (t->priv_fd != -1 && fs_close(t->priv_fd))
+			stress_error(t, "close");
+		t->priv_fd = -1;
+		if (fs_delete(t->priv) != (t->priv_exists ? 0 : -1))
+			stress_error(t, "delete");
+		t->priv_exists = 0;
+		break;
+
+	default:
+		stress_io(t, op);
+		break;
+	}
+}
+
+static void *stress_thread(void *arg)
+{
+	struct stress_thread *t = arg;
+
+	stress_open_shared(t);
+	while (!__atomic_load_n(&stress_stop, __ATOMIC_RELAXED)) {
+		int pick = rand_r(&t->seed) % stress_mix_total;
+		int op = 0;
+
+		while (pick >= stress_mix[op])
+			pick -= stress_mix[op++];
+		stress_one(t, op);
+		t->ops++;
+	}
+
+	if (t->shared_fd != -1)
+		fs_close(t->shared_fd);
+	if (t->priv_fd != -1)
+		fs_close(t->priv_fd);
+	if (t->priv_exists)
+		fs_delete(t->priv);
+	return NULL;
+}
+
+/* Parse "<op>:<weight>,..." into stress_mix[] */
+static void stress_parse_mix(char *mix)
+{
+	char *tok, *save;
+
+	memset(stress_mix, 0, sizeof(stress_mix));
+	stress_mix_total = 0;
+	for (tok = strtok_r(mix, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		char *colon = strchr(tok, ':');
+		int op;
+
+		if (!colon)
+			die("Invalid mix entry '%s'", tok);
+		*colon = '\0';
+		for (op = 0; op < STRESS_OP_COUNT; op++)
+			if (!strcmp(tok, stress_op_names[op]))
+				break;
+		if (op == STRESS_OP_COUNT || atoi(colon + 1) < 0)
+			die("Invalid mix entry '%s'", tok);
+		stress_mix[op] = atoi(colon + 1);
+	}
+
+	for (int op = 0; op < STRESS_OP_COUNT; op++)
+		stress_mix_total += stress_mix[op];
+	if (stress_mix_total == 0)
+		die("Empty operation mix");
+}
+
+void thread_fs_stress(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	char default_counts[] = "1,2,4,8";
+	char default_mix[] = "create:5,open:10,read:40,write:30,seek:10,"
+			     "delete:5";
+	char *counts = default_counts, *tok, *save;
+	char name[FS_FILENAME_LEN];
+	double seconds = 2, base_rate = 0;
+	size_t total_corrupt = 0, total_errors = 0;
+	struct fs_statfs st;
+
+	if (t_arg->argc < 1)
+		die("Usage: <diskname> [<thread counts> [<seconds> [<mix>]]]");
+	if (t_arg->argc > 1)
+		counts = t_arg->argv[1];
+	if (t_arg->argc > 2 && (seconds = atof(t_arg->argv[2])) <= 0)
+		die("Invalid duration '%s'", t_arg->argv[2]);
+	stress_parse_mix(t_arg->argc > 3 ? t_arg->argv[3] : default_mix);
+
+	if (fs_mount(t_arg->argv[0]))
+		die("Cannot mount diskname");
+
+	/* Every file may reach its largest size */
+	if (fs_statfs(&st))
+		die("Cannot get file system information");
+	if (st.fat_free_count < STRESS_BLOCKS ||
+	    st.rdir_free_count < STRESS_SHARED + STRESS_THREADS_MAX)
+		die("Not enough free space, %d blocks and %d files needed",
+		    STRESS_BLOCKS, STRESS_SHARED + STRESS_THREADS_MAX);
+
+	for (int i = 0; i < STRESS_SHARED; i++) {
+		snprintf(name, sizeof(name), "stress_s%d", i);
+		if (fs_create(name))
+			die("Cannot create '%s'", name);
+	}
+
+	printf("%8s %12s %10s %8s %8s %8s\n", "threads", "ops/s", "MB/s",
+	       "speedup", "errors", "corrupt");
+	for (tok = strtok_r(counts, ",", &save); tok;
+	     tok = strtok_r(NULL, ",", &save)) {
+		struct stress_thread *threads;
+		int n = atoi(tok);
+		size_t ops = 0, bytes = 0, errors = 0, corrupt = 0;
+		struct timespec ts = {
+			.tv_sec = seconds,
+			.tv_nsec = (seconds - (long)seconds) * 1e9,
+		};
+		double start, elapsed;
+
+		if (n < 1 || n > STRESS_THREADS_MAX)
+			die("Invalid thread count '%s', at most %d", tok,
+			    STRESS_THREADS_MAX);
+		threads = calloc(n, sizeof(*threads));
+		if (!threads)
+			die_perror("calloc");
+
+		__atomic_store_n(&stress_stop, 0, __ATOMIC_RELAXED);
+		start = now_ns();
+		for (int i = 0; i < n; i++) {
+			struct stress_thread *t = &threads[i];
+
+			t->id = i;
+			t->seed = 150 + i;
+			t->priv_fd = t->shared_fd = -1;
+			snprintf(t->priv, sizeof(t->priv), "stress_p%d", i);
+			if (pthread_create(&t->thread, NULL, stress_thread, t))
+				die("Cannot create thread");
+		}
+		nanosleep(&ts, NULL);
+		__atomic_store_n(&stress_stop, 1, __ATOMIC_RELAXED);
+		for (int i = 0; i < n; i++) {
+			pthread_join(threads[i].thread, NULL);
+			ops += threads[i].ops;
+			bytes += threads[i].bytes;
+			errors += threads[i].errors;
+			corrupt += threads[i].corrupt;
+		}
+		elapsed = (now_ns() - start) / 1e9;
+		free(threads);
+
+		if (base_rate == 0)
+			base_rate = ops / elapsed;
+		printf("%8d %12.0f %10.2f %8.2f %8zu %8zu\n", n, ops / elapsed,
+		       bytes / 1e6 / elapsed, ops / elapsed / base_rate,
+		       errors, corrupt);
+		fflush(stdout);
+		total_errors += errors;
+		total_corrupt += corrupt;
+	}
+
+	for (int i = 0; i < STRESS_SHARED; i++) {
+		snprintf(name, sizeof(name), "stress_s%d", i);
+		fs_delete(name);
+	}
+	if (fs_umount())
+		die("Cannot unmount diskname");
+
+	if (total_errors || total_corrupt)
+		die("%zu errors, %zu integrity failures", total_errors,
+		    total_corrupt);
+}
+
+void thread_fs_stats(void *arg);
+
 static struct {
 	const char *name;
 	void(*func)(void *);
@@ -515,11 +1287,83 @@ static struct {
 	{ "ls",		thread_fs_ls },
 	{ "add",	thread_fs_add },
 	{ "rm",		thread_fs_rm },
+	{ "clone",	thread_fs_clone },
+	{ "mkdir",	thread_fs_mkdir },
+	{ "rmdir",	thread_fs_rmdir },
 	{ "cat",	thread_fs_cat },
 	{ "stat",	thread_fs_stat },
-	{ "script",	thread_fs_script }
+	{ "script",	thread_fs_script },
+	{ "mkfs",	thread_fs_mkfs },
+	{ "replay",	thread_fs_replay },
+	{ "stress",	thread_fs_stress },
+	{ "stats",	thread_fs_stats }
+};
+
+static const char *stats_call_names[FS_STATS_CALL_COUNT] = {
+	"mkfs", "mount", "umount", "info", "statfs", "create", "delete", "ls",
+	"mkdir", "rmdir", "lsdir", "open", "close", "stat", "lseek", "setattr",
+	"getattr", "clone", "write", "read", "advise", "alloc"
+};
+
+static const char *stats_blk_names[FS_STATS_BLK_COUNT] = {
+	"super", "fat", "csum", "dir", "map", "data"
 };
 
+/* Upper bound of the latency below which a fraction @q of the calls ran */
+static double stats_percentile(const struct fs_call_stats *c, double q)
+{
+	size_t seen = 0;
+	int i;
+
+	for (i = 0; i < FS_STATS_BUCKETS - 1; i++) {
+		seen += c->hist[i];
+		if (seen >= q * c->count)
+			break;
+	}
+	return (double)(1ULL << i);
+}
+
+void thread_fs_stats(void *arg)
+{
+	struct thread_arg *t_arg = arg;
+	struct thread_arg sub = { t_arg->argc - 1, t_arg->argv + 1 };
+	struct fs_stats st;
+	size_t i;
+
+	if (t_arg->argc < 1)
+		die("Usage: <command> [<arg>...]");
+
+	for (i = 0; i < ARRAY_SIZE(commands); i++)
+		if (!strcmp(t_arg->argv[0], commands[i].name))
+			break;
+	if (i == ARRAY_SIZE(commands))
+		die("Invalid command '%s'", t_arg->argv[0]);
+
+	fs_reset_stats();
+	commands[i].func(&sub);
+	fs_get_stats(&st);
+
+	printf("\n%-8s %8s %8s %12s %10s %10s %10s %10s\n", "call", "count",
+	       "errors", "bytes", "mean_us", "p50_us", "p99_us", "p999_us");
+	for (int c = 0; c < FS_STATS_CALL_COUNT; c++) {
+		const struct fs_call_stats *cs = &st.calls[c];
+
+		if (!cs->count)
+			continue;
+		printf("%-8s %8zu %8zu %12zu %10.2f %10.2f %10.2f %10.2f\n",
+		       stats_call_names[c], cs->count, cs->errors, cs->bytes,
+		       (double)cs->ns / cs->count / 1e3,
+		       stats_percentile(cs, 0.5) / 1e3,
+		       stats_percentile(cs, 0.99) / 1e3,
+		       stats_percentile(cs, 0.999) / 1e3);
+	}
+
+	printf("\n%-8s %12s %12s\n", "blocks", "read", "written");
+	for (int k = 0; k < FS_STATS_BLK_COUNT; k++)
+		printf("%-8s %12zu %12zu\n", stats_blk_names[k],
+		       st.blk_reads[k], st.blk_writes[k]);
+}
+
 void usage(char *program)
 {
 	size_t i;
@@ -0,0 +1,283 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#define CRC32C_X86 1
+#endif
+
+#include "crc32c.h"
+
+/* CRC32C polynomial, bit-reversed */
+#define POLY 0x82F63B78
+
+/* Slicing-by-8 tables, built on first use */
+static uint32_t table[8][256];
+
+/*
+ * Interleaved streams of the SSE4.2 kernel cover SHORT bytes each. Their
+ * checksums are combined by shifting over SHORT zero bytes, through tables
+ * built on first use. SHORT must be a power of 2.
+ */
+#define SHORT 256
+static uint32_t zeros_short[4][256];
+
+static void build_table(void)
+{
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t crc = n;
+
+		for (int k = 0; k < 8; k++)
+			crc = crc & 1 ? (crc >> 1) ^ POLY : crc >> 1;
+		table[0][n] = crc;
+	}
+
+	for (uint32_t n = 0; n < 256; n++) {
+		uint32_t crc = table[0][n];
+
+		for (int k = 1; k < 8; k++) {
+			crc = table[0][crc & 0xFF] ^ (crc >> 8);
+			table[k][n] = crc;
+		}
+	}
+}
+
+/* Multiply the 32x32 bit matrix @mat by the vector @vec, over GF(2) */
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec)
+{
+	uint32_t sum = 0;
+
+	while (vec) {
+		if (vec & 1)
+			sum ^= *mat;
+		vec >>= 1;
+		mat++;
+	}
+
+	return sum;
+}
+
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat)
+{
+	for (int n = 0; n < 32; n++)
+		square[n] = gf2_matrix_times(mat, mat[n]);
+}
+
+/* Build in @even the operator that appends @len zero bytes to a checksum */
+static void zeros_op(uint32_t *even, size_t len)
+{
+	uint32_t odd[32], row = 1;
+
+	/* Operator for one zero bit */
+	odd[0] = POLY;
+	for (int n = 1; n < 32; n++) {
+		odd[n] = row;
+		row <<= 1;
+	}
+
+	/* Two, then four zero bits */
+	gf2_matrix_square(even, odd);
+	gf2_matrix_square(odd, even);
+
+	/* Keep squaring, from one zero byte up to @len zero bytes */
+	do {
+		gf2_matrix_square(even, odd);
+		len >>= 1;
+		if (len == 0)
+			return;
+		gf2_matrix_square(odd, even);
+		len >>= 1;
+	} while (len);
+
+	memcpy(even, odd, sizeof(odd));
+}
+
+static void build_zeros(uint32_t zeros[4][256], size_t len)
+{
+	uint32_t op[32];
+
+	zeros_op(op, len);
+	for (uint32_t n = 0; n < 256; n++) {
+		zeros[0][n] = gf2_matrix_times(op, n);
+		zeros[1][n] = gf2_matrix_times(op, n << 8);
+		zeros[2][n] = gf2_matrix_times(op, n << 16);
+		zeros[3][n] = gf2_matrix_times(op, n << 24);
+	}
+}
+
+static uint32_t shift(uint32_t zeros[4][256], uint32_t crc)
+{
+	return zeros[0][crc & 0xFF] ^ zeros[1][(crc >> 8) & 0xFF] ^
+	       zeros[2][(crc >> 16) & 0xFF] ^ zeros[3][crc >> 24];
+}
+
+/* Scalar implementation, slicing by 8 bytes */
+
+static uint32_t crc32c_scalar(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *next = buf;
+
+	crc = ~crc;
+	while (len && ((uintptr_t)next & 7)) {
+		crc = table[0][(crc ^ *next++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+
+	while (len >= 8) {
+		uint64_t word;
+
+		memcpy(&word, next, sizeof(word));
+		word ^= crc;
+		crc = table[7][word & 0xFF] ^
+		      table[6][(word >> 8) & 0xFF] ^
+		      table[5][(word >> 16) & 0xFF] ^
+		      table[4][(word >> 24) & 0xFF] ^
+		      table[3][(word >> 32) & 0xFF] ^
+		      table[2][(word >> 40) & 0xFF] ^
+		      table[1][(word >> 48) & 0xFF] ^
+		      table[0][word >> 56];
+		next += 8;
+		len -= 8;
+	}
+
+	while (len) {
+		crc = table[0][(crc ^ *next++) & 0xFF] ^ (crc >> 8);
+		len--;
+	}
+
+	return ~crc;
+}
+
+#ifdef CRC32C_X86
+
+/*
+ * SSE4.2 implementation. The crc32 instruction has a latency of 3 cycles but
+ * a throughput of 1 per cycle, so three independent streams are run at once.
+ */
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const void *buf, size_t len)
+{
+	const unsigned char *next = buf;
+	uint64_t crc0 = ~crc;
+
+	while (len && ((uintptr_t)next & 7)) {
+		crc0 = _mm_crc32_u8(crc0, *next++);
+		len--;
+	}
+
+	while (len >= 3 * SHORT) {
+		const unsigned char *end = next + SHORT;
+		uint64_t crc1 = 0, crc2 = 0;
+
+		do {
+			uint64_t w0, w1, w2;
+
+			memcpy(&w0, next, sizeof(w0));
+			memcpy(&w1, next + SHORT, sizeof(w1));
+			memcpy(&w2, next + 2 * SHORT, sizeof(w2));
+			crc0 = _mm_crc32_u64(crc0, w0);
+			crc1 = _mm_crc32_u64(crc1, w1);
+			crc2 = _mm_crc32_u64(crc2, w2);
+			next += 8;
+		} while (next < end);
+
+		crc0 = shift(zeros_short, crc0) ^ crc1;
+		crc0 = shift(zeros_short, crc0) ^ crc2;
+		next += 2 * SHORT;
+		len -= 3 * SHORT;
+	}
+
+	while (len >= 8) {
+		uint64_t word;
+
+		memcpy(&word, next, sizeof(word));
+		crc0 = _mm_crc32_u64(crc0, word);
+		next += 8;
+		len -= 8;
+	}
+
+	while (len) {
+		crc0 = _mm_crc32_u8(crc0, *next++);
+		len--;
+	}
+
+	return ~(uint32_t)crc0;
+}
+
+#endif /* CRC32C_X86 */
+
+/* Runtime dispatch */
+
+static struct {
+	enum crc32c_isa isa;
+	uint32_t (*crc32c)(uint32_t, const void *, size_t);
+} impl;
+
+static int isa_supported(enum crc32c_isa isa)
+{
+	switch (isa) {
+	case CRC32C_SCALAR:
+		return 1;
+#ifdef CRC32C_X86
+	case CRC32C_SSE42:
+		return __builtin_cpu_supports("sse4.2");
+#endif
+	default:
+		return 0;
+	}
+}
+
+int crc32c_select(enum crc32c_isa isa)
+{
+	if (!isa_supported(isa))
+		return -1;
+
+	/* Tables are only built once, whatever the implementation */
+	if (table[0][1] == 0) {
+		build_table();
+		build_zeros(zeros_short, SHORT);
+	}
+
+	switch (isa) {
+#ifdef CRC32C_X86
+	case CRC32C_SSE42:
+		impl.crc32c = crc32c_sse42;
+		break;
+#endif
+	default:
+		impl.crc32c = crc32c_scalar;
+		break;
+	}
+	impl.isa = isa;
+
+	return 0;
+}
+
+/* Pick the best implementation the CPU supports on first use */
+static void crc32c_init(void)
+{
+	if (impl.crc32c)
+		return;
+
+	if (crc32c_select(CRC32C_SSE42))
+		crc32c_select(CRC32C_SCALAR);
+}
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len)
+{
+	crc32c_init();
+	return impl.crc32c(crc, buf, len);
+}
+
+const char *crc32c_isa_name(void)
+{
+	static const char *names[] = {
+		[CRC32C_SCALAR] = "scalar",
+		[CRC32C_SSE42] = "sse4.2",
+	};
+
+	crc32c_init();
+	return names[impl.isa];
+}
@@ -0,0 +1,42 @@
+#ifndef _CRC32C_H
+#define _CRC32C_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/** Instruction sets the CRC32C kernel can be built for */
+enum crc32c_isa {
+	CRC32C_SCALAR,
+	CRC32C_SSE42,
+};
+
+/**
+ * crc32c - Compute a CRC32C (Castagnoli) checksum
+ * @crc: Checksum of the preceding data, or 0 to start a new checksum
+ * @buf: Data to checksum
+ * @len: Length of @buf in bytes
+ *
+ * Return: the checksum of the data that @crc covers followed by @buf.
+ */
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+/**
+ * crc32c_select - Select the instruction set used by the kernel
+ * @isa: Instruction set to use
+ *
+ * The kernel picks the best instruction set supported by the CPU the first
+ * time it is called. This function overrides that choice, which is mostly
+ * useful to compare implementations against each other.
+ *
+ * Return: -1 if @isa is not supported by the CPU. 0 otherwise.
+ */
+int crc32c_select(enum crc32c_isa isa);
+
+/**
+ * crc32c_isa_name - Get the name of the selected instruction set
+ *
+ * Return: a static string naming the instruction set currently used.
+ */
+const char *crc32c_isa_name(void);
+
+#endif /* _CRC32C_H */
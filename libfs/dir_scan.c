@@ -0,0 +1,55 @@
+#include <stdint.h>
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#include "dir_scan.h"
+
+size_t dir_name_key(char key[DIR_NAME_LEN], const char *filename)
+{
+	size_t len = strlen(filename);
+
+	memset(key, 0, DIR_NAME_LEN);
+	memcpy(key, filename, len);
+
+	return len;
+}
+
+#ifdef __SSE2__
+
+int dir_find_name(const void *entries, size_t count, size_t stride,
+		  const char key[DIR_NAME_LEN], size_t len)
+{
+	const uint8_t *entry = entries;
+	__m128i k = _mm_loadu_si128((const __m128i *)key);
+	/* Filename bytes and terminating NULL character, one bit each */
+	unsigned int want = (1u << (len + 1)) - 1;
+
+	for (size_t i = 0; i < count; i++, entry += stride) {
+		__m128i name = _mm_loadu_si128((const __m128i *)entry);
+		unsigned int eq = _mm_movemask_epi8(_mm_cmpeq_epi8(name, k));
+
+		if ((eq & want) == want)
+			return i;
+	}
+
+	return -1;
+}
+
+#else
+
+int dir_find_name(const void *entries, size_t count, size_t stride,
+		  const char key[DIR_NAME_LEN], size_t len)
+{
+	const uint8_t *entry = entries;
+
+	for (size_t i = 0; i < count; i++, entry += stride)
+		if (entry[0] == key[0] && !memcmp(entry, key, len + 1))
+			return i;
+
+	return -1;
+}
+
+#endif /* __SSE2__ */
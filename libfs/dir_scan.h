@@ -0,0 +1,39 @@
+#ifndef _DIR_SCAN_H
+#define _DIR_SCAN_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Size of the filename field at the start of every directory entry */
+#define DIR_NAME_LEN 16
+
+/**
+ * dir_name_key - Build a lookup key from a filename
+ * @key: Key to be filled in (%DIR_NAME_LEN bytes)
+ * @filename: NULL-terminated filename, shorter than %DIR_NAME_LEN
+ *
+ * Copy @filename into @key and pad it with zeros, so that it can be compared
+ * against a whole filename field at once.
+ *
+ * Return: the length of @filename.
+ */
+size_t dir_name_key(char key[DIR_NAME_LEN], const char *filename);
+
+/**
+ * dir_find_name - Look up a filename in an array of directory entries
+ * @entries: First directory entry
+ * @count: Number of directory entries
+ * @stride: Size of a directory entry in bytes
+ * @key: Lookup key built by dir_name_key()
+ * @len: Length of the filename in @key
+ *
+ * Only the first @len + 1 bytes of each filename field are compared, so that
+ * bytes left after the terminating NULL character by earlier entries do not
+ * prevent a match.
+ *
+ * Return: the index of the first entry whose filename is @key, or -1 if there
+ * is none.
+ */
+int dir_find_name(const void *entries, size_t count, size_t stride,
+		  const char key[DIR_NAME_LEN], size_t len);
+
+#endif /* _DIR_SCAN_H */
@@ -1,144 +1,889 @@
 #include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "disk.h"
+#include "disk_backend.h"
 
-#define block_error(fmt, ...) \
-	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+/* Number of blocks copied at a time by block_disk_save_h() */
+#define SAVE_RUN 256
 
-/* Invalid file descriptor */
-#define INVALID_FD -1
+/* Largest number of buffers of a single preadv() or pwritev() */
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
 
-/* Disk instance description */
-struct disk {
+/* Disk instance description, for disks backed by a single image file */
+struct file_disk {
+	struct disk disk;
 	/* File descriptor */
 	int fd;
-	/* Block count */
-	size_t bcount;
 };
 
-/* Currently open virtual disk (invalid by default) */
-static struct disk disk = { .fd = INVALID_FD };
+/* Currently open virtual disk, used by the functions without a handle */
+static struct disk *disk;
 
-int block_disk_open(const char *diskname)
+/*
+ * Finish a transfer that preadv() or pwritev() left short, @done bytes into the
+ * buffers of @iov
+ */
+static int file_io_rest(int fd, int write, off_t off, const struct iovec *iov,
+			int iovcnt, size_t done)
 {
-	int fd;
-	struct stat st;
+	for (int i = 0; i < iovcnt; i++) {
+		size_t len = iov[i].iov_len;
 
-	if (!diskname) {
-		block_error("invalid file diskname");
+		if (done >= len) {
+			done -= len;
+			off += len;
+			continue;
+		}
+
+		while (done < len) {
+			char *base = (char *)iov[i].iov_base + done;
+			ssize_t ret = write ?
+				pwrite(fd, base, len - done, off + done) :
+				pread(fd, base, len - done, off + done);
+
+			if (ret < 0) {
+				perror(write ? "pwrite" : "pread");
+				return -1;
+			}
+			if (ret == 0) {
+				block_error("unexpected end of disk image");
+				return -1;
+			}
+			done += ret;
+		}
+		off += len;
+		done = 0;
+	}
+
+	return 0;
+}
+
+static int file_io(struct disk *d, int write, size_t block,
+		   const struct iovec *iov, int iovcnt)
+{
+	struct file_disk *f = (struct file_disk *)d;
+	off_t off = (off_t)block * BLOCK_SIZE;
+
+	/*
+	 * Perform the actual transfer with the disk image, at the specified
+	 * block number. pread() and pwrite() leave the file offset alone, so that
+	 * several threads can share a disk.
+	 */
+	while (iovcnt > 0) {
+		int n = iovcnt < IOV_MAX ? iovcnt : IOV_MAX;
+		size_t len = 0;
+		ssize_t ret;
+
+		for (int i = 0; i < n; i++)
+			len += iov[i].iov_len;
+
+		ret = write ? pwritev(f->fd, iov, n, off) :
+			preadv(f->fd, iov, n, off);
+		if (ret < 0) {
+			perror(write ? "pwritev" : "preadv");
+			return -1;
+		}
+		if ((size_t)ret < len &&
+		    file_io_rest(f->fd, write, off, iov, n, ret))
+			return -1;
+
+		off += len;
+		iov += n;
+		iovcnt -= n;
+	}
+
+	return 0;
+}
+
+static int file_readv(struct disk *d, size_t block, const struct iovec *iov,
+		      int iovcnt)
+{
+	return file_io(d, 0, block, iov, iovcnt);
+}
+
+static int file_writev(struct disk *d, size_t block, const struct iovec *iov,
+		       int iovcnt)
+{
+	return file_io(d, 1, block, iov, iovcnt);
+}
+
+static int file_advise(struct disk *d, size_t block, size_t count,
+		       int advice)
+{
+	struct file_disk *f = (struct file_disk *)d;
+	int err = posix_fadvise(f->fd, (off_t)block * BLOCK_SIZE,
+				(off_t)count * BLOCK_SIZE, advice);
+
+	if (err) {
+		block_error("posix_fadvise: %s", strerror(err));
 		return -1;
 	}
 
-	if (disk.fd != INVALID_FD) {
-		block_error("disk already open");
+	return 0;
+}
+
+static void file_close(struct disk *d)
+{
+	struct file_disk *f = (struct file_disk *)d;
+
+	close(f->fd);
+	free(f);
+}
+
+static const struct disk_ops file_ops = {
+	.readv = file_readv,
+	.writev = file_writev,
+	.close = file_close,
+	.advise = file_advise,
+};
+
+int disk_split_names(const char *list, char **names, int max)
+{
+	int count = 0;
+
+	for (;;) {
+		const char *end = strchr(list, ',');
+		size_t len = end ? (size_t)(end - list) : strlen(list);
+
+		if (len == 0 || count == max) {
+			block_error("invalid list of disks '%s'", list);
+			disk_free_names(names, count);
+			return -1;
+		}
+		if (!(names[count] = strndup(list, len))) {
+			perror("strndup");
+			disk_free_names(names, count);
+			return -1;
+		}
+		count++;
+
+		if (!end)
+			return count;
+		list = end + 1;
+	}
+}
+
+void disk_free_names(char **names, int count)
+{
+	for (int i = 0; i < count; i++)
+		free(names[i]);
+}
+
+int disk_run_job(struct disk *d, const struct disk_job *job)
+{
+	if (job->write)
+		return d->ops->writev(d, job->block, job->iov, job->iovcnt);
+	return d->ops->readv(d, job->block, job->iov, job->iovcnt);
+}
+
+int disk_iov_take(const struct iovec *iov, int *vi, size_t *at, size_t len,
+		  struct iovec *out)
+{
+	int n = 0;
+
+	while (len) {
+		size_t take = iov[*vi].iov_len - *at;
+
+		if (take > len)
+			take = len;
+		out[n].iov_base = (char *)iov[*vi].iov_base + *at;
+		out[n].iov_len = take;
+		n++;
+		len -= take;
+		*at += take;
+		if (*at == iov[*vi].iov_len) {
+			(*vi)++;
+			*at = 0;
+		}
+	}
+
+	return n;
+}
+
+static void *worker_thread(void *arg)
+{
+	struct disk_worker *w = arg;
+
+	pthread_mutex_lock(&w->lock);
+	for (;;) {
+		while (!w->pending && !w->stop)
+			pthread_cond_wait(&w->cond, &w->lock);
+		if (w->stop)
+			break;
+		w->pending = 0;
+		pthread_mutex_unlock(&w->lock);
+
+		int ret = disk_run_job(w->disk, &w->job);
+
+		pthread_mutex_lock(&w->lock);
+		w->job.ret = ret;
+		w->done = 1;
+		pthread_cond_broadcast(&w->cond);
+	}
+	pthread_mutex_unlock(&w->lock);
+
+	return NULL;
+}
+
+int disk_worker_start(struct disk_worker *w, struct disk *disk)
+{
+	w->disk = disk;
+	w->busy = w->pending = w->done = w->stop = 0;
+	pthread_mutex_init(&w->lock, NULL);
+	pthread_cond_init(&w->cond, NULL);
+	if (pthread_create(&w->thread, NULL, worker_thread, w)) {
+		block_error("cannot start thread");
+		pthread_cond_destroy(&w->cond);
+		pthread_mutex_destroy(&w->lock);
+		return -1;
+	}
+
+	return 0;
+}
+
+void disk_worker_stop(struct disk_worker *w)
+{
+	pthread_mutex_lock(&w->lock);
+	w->stop = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+	pthread_join(w->thread, NULL);
+	pthread_cond_destroy(&w->cond);
+	pthread_mutex_destroy(&w->lock);
+}
+
+void disk_worker_post(struct disk_worker *w, const struct disk_job *job)
+{
+	pthread_mutex_lock(&w->lock);
+	while (w->busy)
+		pthread_cond_wait(&w->cond, &w->lock);
+	w->busy = 1;
+	w->job = *job;
+	w->pending = 1;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+}
+
+int disk_worker_wait(struct disk_worker *w)
+{
+	int ret;
+
+	pthread_mutex_lock(&w->lock);
+	while (!w->done)
+		pthread_cond_wait(&w->cond, &w->lock);
+	ret = w->job.ret;
+	w->done = 0;
+	w->busy = 0;
+	pthread_cond_broadcast(&w->cond);
+	pthread_mutex_unlock(&w->lock);
+
+	return ret;
+}
+
+/*
+ * Block I/O tracing. Each thread records its transfers into its own ring, in
+ * which only it writes: it fills an event, then publishes it by advancing the
+ * ring's head. Rings are listed under trace_lock when they are created, and
+ * outlive their thread until the trace is written. A ring made for a previous
+ * trace is reset by its thread on its next transfer.
+ */
+
+struct trace_ring {
+	struct block_trace_event *events;
+	size_t size;
+	/* Number of events recorded, the last size of which are kept */
+	uint64_t head;
+	/* Trace the ring belongs to */
+	unsigned int generation;
+	/* The thread has exited */
+	int orphan;
+	struct trace_ring *next;
+};
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_once = PTHREAD_ONCE_INIT;
+static pthread_key_t trace_key;
+static struct trace_ring *trace_rings;
+static unsigned int trace_threads;
+/* Tracing is on, read without the lock */
+static int tracing;
+static unsigned int trace_generation;
+static size_t trace_size;
+static uint64_t trace_start;
+static char *trace_env_path;
+
+static __thread struct trace_ring *trace_self;
+static __thread uint16_t trace_thread;
+static __thread int trace_tag = BLOCK_TRACE_UNTAGGED;
+/* Transfers in progress, the nested ones being made by virtual disks */
+static __thread int trace_depth;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_thread_exit(void *arg)
+{
+	struct trace_ring *r = arg;
+
+	__atomic_store_n(&r->orphan, 1, __ATOMIC_RELEASE);
+}
+
+/* Ring of the calling thread for the current trace, NULL if out of memory */
+static struct trace_ring *trace_ring(void)
+{
+	struct trace_ring *r = trace_self;
+	unsigned int generation;
+	size_t size;
+
+	pthread_mutex_lock(&trace_lock);
+	generation = trace_generation;
+	size = trace_size;
+	pthread_mutex_unlock(&trace_lock);
+
+	if (r && r->size != size) {
+		free(r->events);
+		r->size = 0;
+		if (!(r->events = malloc(size * sizeof(*r->events))))
+			return NULL;
+		r->size = size;
+	}
+
+	if (!r) {
+		if (!(r = calloc(1, sizeof(*r))) ||
+		    !(r->events = malloc(size * sizeof(*r->events)))) {
+			free(r);
+			return NULL;
+		}
+		r->size = size;
+
+		pthread_mutex_lock(&trace_lock);
+		r->next = trace_rings;
+		trace_rings = r;
+		trace_thread = trace_threads++;
+		pthread_mutex_unlock(&trace_lock);
+		pthread_setspecific(trace_key, r);
+		trace_self = r;
+	}
+
+	__atomic_store_n(&r->head, 0, __ATOMIC_RELAXED);
+	__atomic_store_n(&r->generation, generation, __ATOMIC_RELEASE);
+	return r;
+}
+
+static void trace_event(uint64_t start, size_t block, size_t count, int write,
+			int tag, int ret)
+{
+	struct trace_ring *r = trace_self;
+	struct block_trace_event *e;
+	uint64_t end = now_ns();
+
+	if (!r || __atomic_load_n(&r->generation, __ATOMIC_ACQUIRE) !=
+	    __atomic_load_n(&trace_generation, __ATOMIC_ACQUIRE)) {
+		if (!(r = trace_ring()))
+			return;
+	}
+
+	e = &r->events[r->head % r->size];
+	e->time = start > trace_start ? start - trace_start : 0;
+	e->block = block;
+	e->duration = end - start > UINT32_MAX ? UINT32_MAX : end - start;
+	e->count = count > UINT32_MAX ? UINT32_MAX : count;
+	e->thread = trace_thread;
+	e->write = write;
+	e->tag = tag;
+	e->ret = ret;
+	__atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+}
+
+static int start_trace(size_t events)
+{
+	struct trace_ring *r, **p;
+	int ret = -1;
+
+	pthread_mutex_lock(&trace_lock);
+	if (tracing) {
+		block_error("block transfers are already being traced");
+	} else {
+		/* Rings of exited threads were written by the last trace */
+		for (p = &trace_rings; (r = *p);) {
+			if (__atomic_load_n(&r->orphan, __ATOMIC_ACQUIRE)) {
+				*p = r->next;
+				free(r->events);
+				free(r);
+			} else {
+				p = &r->next;
+			}
+		}
+		trace_size = events;
+		trace_start = now_ns();
+		__atomic_store_n(&trace_generation, trace_generation + 1,
+				 __ATOMIC_RELEASE);
+		__atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	return ret;
+}
+
+static void trace_exit(void)
+{
+	block_trace_stop(trace_env_path);
+}
+
+static void trace_init(void)
+{
+	const char *path = getenv("BLOCK_TRACE");
+
+	pthread_key_create(&trace_key, trace_thread_exit);
+	if (!path || !*path)
+		return;
+
+	if (!(trace_env_path = strdup(path))) {
+		perror("strdup");
+		return;
+	}
+	if (start_trace(BLOCK_TRACE_EVENTS) == 0)
+		atexit(trace_exit);
+}
+
+int block_trace_start(size_t events)
+{
+	if (!events)
+		events = BLOCK_TRACE_EVENTS;
+	if (events > SIZE_MAX / sizeof(struct block_trace_event)) {
+		block_error("too many trace events (%zu)", events);
+		return -1;
+	}
+
+	/* A trace requested by the environment comes first */
+	pthread_once(&trace_once, trace_init);
+	return start_trace(events);
+}
+
+static int event_cmp(const void *a, const void *b)
+{
+	const struct block_trace_event *x = a, *y = b;
+
+	return (x->time > y->time) - (x->time < y->time);
+}
+
+/* Copy the events of the current trace, with the lock held */
+static struct block_trace_event *trace_collect(size_t *count,
+					       uint64_t *dropped)
+{
+	struct block_trace_event *events;
+	struct trace_ring *r;
+	size_t total = 0, n = 0;
+
+	*dropped = 0;
+	for (r = trace_rings; r; r = r->next) {
+		if (__atomic_load_n(&r->generation, __ATOMIC_ACQUIRE) ==
+		    trace_generation)
+			total += r->size;
+	}
+
+	if (!(events = malloc((total ? total : 1) * sizeof(*events)))) {
+		perror("malloc");
+		return NULL;
+	}
+
+	for (r = trace_rings; r; r = r->next) {
+		uint64_t head, first;
+
+		if (__atomic_load_n(&r->generation, __ATOMIC_ACQUIRE) !=
+		    trace_generation)
+			continue;
+
+		/*
+		 * The thread may still be transferring: leave out the slot it
+		 * might be filling once the ring has wrapped around
+		 */
+		head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+		first = head > r->size - 1 ? head - (r->size - 1) : 0;
+		*dropped += first;
+		for (uint64_t i = first; i < head; i++)
+			events[n++] = r->events[i % r->size];
+	}
+
+	qsort(events, n, sizeof(*events), event_cmp);
+	*count = n;
+	return events;
+}
+
+static int trace_write(const char *path, struct block_trace_event *events,
+		       size_t count, uint64_t dropped)
+{
+	struct block_trace_header h = {
+		.signature = BLOCK_TRACE_SIGNATURE,
+		.version = BLOCK_TRACE_VERSION,
+		.event_size = sizeof(struct block_trace_event),
+		.dropped = dropped,
+	};
+	FILE *f;
+	int ret = 0;
+
+	if (!(f = fopen(path, "wb"))) {
+		perror("fopen");
+		return -1;
+	}
+
+	if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+	    fwrite(events, sizeof(*events), count, f) != count) {
+		perror("fwrite");
+		ret = -1;
+	}
+	if (fclose(f)) {
+		perror("fclose");
+		ret = -1;
+	}
+
+	return ret;
+}
+
+int block_trace_stop(const char *path)
+{
+	struct block_trace_event *events = NULL;
+	size_t count = 0;
+	uint64_t dropped;
+	int ret = 0;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!tracing) {
+		pthread_mutex_unlock(&trace_lock);
 		return -1;
 	}
 
+	__atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+	if (path && !(events = trace_collect(&count, &dropped)))
+		ret = -1;
+	pthread_mutex_unlock(&trace_lock);
+
+	if (events) {
+		ret = trace_write(path, events, count, dropped);
+		free(events);
+	}
+
+	return ret;
+}
+
+void block_trace_tag(int tag)
+{
+	trace_tag = tag;
+}
+
+static struct disk *file_open(const char *diskname)
+{
+	struct file_disk *f;
+	int fd;
+	struct stat st;
+
 	if ((fd = open(diskname, O_RDWR, 0644)) < 0) {
 		perror("open");
-		return -1;
+		return NULL;
 	}
 
 	if (fstat(fd, &st)) {
 		perror("fstat");
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
 	/* The disk image's size should be a multiple of the block size */
 	if (st.st_size % BLOCK_SIZE != 0) {
 		block_error("size '%zu' is not multiple of '%d'",
 			    st.st_size, BLOCK_SIZE);
-		return -1;
+		close(fd);
+		return NULL;
 	}
 
-	disk.fd = fd;
-	disk.bcount = st.st_size / BLOCK_SIZE;
+	if (!(f = calloc(1, sizeof(*f)))) {
+		perror("calloc");
+		close(fd);
+		return NULL;
+	}
 
-	return 0;
+	f->disk.ops = &file_ops;
+	f->disk.bcount = st.st_size / BLOCK_SIZE;
+	f->fd = fd;
+
+	return &f->disk;
 }
 
-int block_disk_close(void)
+struct disk *block_disk_open_h(const char *diskname)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	/* Tracing may be turned on by the environment */
+	pthread_once(&trace_once, trace_init);
+
+	if (!diskname) {
+		block_error("invalid file diskname");
+		return NULL;
+	}
+
+	if (!strncmp(diskname, "stripe:", 7))
+		return stripe_open(diskname + 7);
+	if (!strncmp(diskname, "mirror:", 7))
+		return mirror_open(diskname + 7);
+	if (!strncmp(diskname, "ram:", 4))
+		return ram_open(diskname + 4);
+	if (!strncmp(diskname, "tier:", 5))
+		return tier_open(diskname + 5);
+
+	return file_open(diskname);
+}
+
+int block_disk_create(const char *diskname, size_t bcount)
+{
+	int fd;
+
+	if (!diskname || !bcount) {
+		block_error("invalid file diskname or block count");
 		return -1;
 	}
 
-	close(disk.fd);
+	if (!strncmp(diskname, "stripe:", 7))
+		return stripe_create(diskname + 7, bcount);
+	if (!strncmp(diskname, "mirror:", 7))
+		return mirror_create(diskname + 7, bcount);
+	if (!strncmp(diskname, "ram:", 4))
+		return ram_create(diskname + 4, bcount);
+	if (!strncmp(diskname, "tier:", 5))
+		return tier_create(diskname + 5, bcount);
 
-	disk.fd = INVALID_FD;
+	if ((fd = open(diskname, O_RDWR | O_CREAT | O_TRUNC, 0644)) < 0) {
+		perror("open");
+		return -1;
+	}
 
+	/* Blocks are zero-filled, and sparse on most file systems */
+	if (ftruncate(fd, (off_t)bcount * BLOCK_SIZE)) {
+		perror("ftruncate");
+		close(fd);
+		return -1;
+	}
+
+	close(fd);
 	return 0;
 }
 
-int block_disk_count(void)
+int block_disk_drop(const char *diskname)
 {
-	if (disk.fd == INVALID_FD) {
-		block_error("no disk currently open");
+	if (!diskname || strncmp(diskname, "ram:", 4)) {
+		block_error("invalid RAM disk name");
 		return -1;
 	}
 
-	return disk.bcount;
+	return ram_drop(diskname + 4);
 }
 
-int block_write(size_t block, const void *buf)
+int block_disk_save_h(struct disk *d, const char *diskname)
 {
-	if (disk.fd == INVALID_FD) {
+	struct disk *out;
+	char *buf;
+	int ret = 0;
+
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
-		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+	if (!(buf = malloc(SAVE_RUN * BLOCK_SIZE))) {
+		perror("malloc");
+		return -1;
+	}
+	if (block_disk_create(diskname, d->bcount) ||
+	    !(out = block_disk_open_h(diskname))) {
+		free(buf);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	for (size_t i = 0; i < d->bcount && !ret; i += SAVE_RUN) {
+		size_t n = d->bcount - i < SAVE_RUN ? d->bcount - i : SAVE_RUN;
+
+		ret = block_read_many_h(d, i, n, buf) ||
+			block_write_many_h(out, i, n, buf) ? -1 : 0;
+	}
+
+	if (block_disk_close_h(out))
+		ret = -1;
+	free(buf);
+	return ret;
+}
+
+int block_disk_close_h(struct disk *d)
+{
+	if (!d) {
+		block_error("no disk currently open");
+		return -1;
+	}
+
+	d->ops->close(d);
+
+	return 0;
+}
+
+int block_disk_count_h(struct disk *d)
+{
+	if (!d) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
-	/* Perform the actual write into the disk image */
-	if (write(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("write");
+	return d->bcount;
+}
+
+int block_disk_io_count_h(struct disk *d, size_t *reads, size_t *writes)
+{
+	if (!d) {
+		block_error("no disk currently open");
 		return -1;
 	}
 
+	*reads = __atomic_load_n(&d->read_count, __ATOMIC_RELAXED);
+	*writes = __atomic_load_n(&d->write_count, __ATOMIC_RELAXED);
 	return 0;
 }
 
-int block_read(size_t block, void *buf)
+/* Check that blocks @block to @block + @count - 1 can be accessed */
+static int check_range(struct disk *d, size_t block, size_t count)
 {
-	if (disk.fd == INVALID_FD) {
+	if (!d) {
 		block_error("no disk currently open");
 		return -1;
 	}
 
-	if (block >= disk.bcount) {
+	if (block >= d->bcount || count > d->bcount - block) {
 		block_error("block index out of bounds (%zu/%zu)",
-			    block, disk.bcount);
+			    block + count - 1, d->bcount);
 		return -1;
 	}
 
-	/* Move to the specified block number */
-	if (lseek(disk.fd, block * BLOCK_SIZE, SEEK_SET) < 0) {
-		perror("lseek");
+	return 0;
+}
+
+/*
+ * Transfer blocks @block to @block + @count - 1 with buffer @iov, recording the
+ * transfer if tracing is on
+ */
+static int transfer(struct disk *d, int write, size_t block, size_t count,
+		    struct iovec *iov)
+{
+	int tag = trace_tag, ret;
+	uint64_t start;
+
+	trace_tag = BLOCK_TRACE_UNTAGGED;
+	if (check_range(d, block, count))
 		return -1;
-	}
 
-	/* Perform the actual read from the disk image */
-	if (read(disk.fd, buf, BLOCK_SIZE) < 0) {
-		perror("read");
+	__atomic_fetch_add(write ? &d->write_count : &d->read_count, count,
+			   __ATOMIC_RELAXED);
+
+	if (!__atomic_load_n(&tracing, __ATOMIC_RELAXED) || trace_depth)
+		return write ? d->ops->writev(d, block, iov, 1) :
+			       d->ops->readv(d, block, iov, 1);
+
+	trace_depth++;
+	start = now_ns();
+	ret = write ? d->ops->writev(d, block, iov, 1) :
+		      d->ops->readv(d, block, iov, 1);
+	trace_event(start, block, count, write, tag, ret);
+	trace_depth--;
+
+	return ret;
+}
+
+int block_advise_h(struct disk *d, size_t block, size_t count, int advice)
+{
+	if (count == 0)
+		return 0;
+	if (check_range(d, block, count))
+		return -1;
+
+	return d->ops->advise ? d->ops->advise(d, block, count, advice) : 0;
+}
+
+int block_write_many_h(struct disk *d, size_t block, size_t count,
+		       const void *buf)
+{
+	struct iovec iov = { (void *)buf, count * BLOCK_SIZE };
+
+	if (count == 0)
+		return 0;
+	return transfer(d, 1, block, count, &iov);
+}
+
+int block_read_many_h(struct disk *d, size_t block, size_t count, void *buf)
+{
+	struct iovec iov = { buf, count * BLOCK_SIZE };
+
+	if (count == 0)
+		return 0;
+	return transfer(d, 0, block, count, &iov);
+}
+
+int block_write_h(struct disk *d, size_t block, const void *buf)
+{
+	struct iovec iov = { (void *)buf, BLOCK_SIZE };
+
+	return transfer(d, 1, block, 1, &iov);
+}
+
+int block_read_h(struct disk *d, size_t block, void *buf)
+{
+	struct iovec iov = { buf, BLOCK_SIZE };
+
+	return transfer(d, 0, block, 1, &iov);
+}
+
+int block_disk_open(const char *diskname)
+{
+	if (disk) {
+		block_error("disk already open");
 		return -1;
 	}
 
+	if (!(disk = block_disk_open_h(diskname)))
+		return -1;
+
 	return 0;
 }
 
+int block_disk_close(void)
+{
+	int ret = block_disk_close_h(disk);
+
+	disk = NULL;
+	return ret;
+}
+
+int block_disk_count(void)
+{
+	return block_disk_count_h(disk);
+}
+
+int block_write(size_t block, const void *buf)
+{
+	return block_write_h(disk, block, buf);
+}
+
+int block_read(size_t block, void *buf)
+{
+	return block_read_h(disk, block, buf);
+}
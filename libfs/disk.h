@@ -2,6 +2,7 @@
 #define _DISK_H
 
 #include <stddef.h> /* for size_t definition */
+#include <stdint.h>
 
 /** Size of a disk block in bytes */
 #define BLOCK_SIZE 4096
@@ -60,5 +61,272 @@ int block_write(size_t block, const void *buf);
  */
 int block_read(size_t block, void *buf);
 
+/**
+ * block_disk_create - Create virtual disk file
+ * @diskname: Name of the virtual disk file
+ * @bcount: Number of blocks of the virtual disk
+ *
+ * Create virtual disk file @diskname, made of @bcount zero-filled blocks. An
+ * existing file named @diskname is overwritten.
+ *
+ * Virtual disks named "stripe:[<unit>:]<member>,<member>,..." are striped
+ * over the member virtual disks, which are created: blocks are spread over
+ * them @unit consecutive blocks at a time (16 by default). Each member starts
+ * with a block recording the layout, so a striped disk is opened under the
+ * same name, where <unit> can be left out.
+ *
+ * Virtual disks named "mirror:<member>,<member>,..." keep a copy of every
+ * block on each of the member virtual disks, which are created. Reads are
+ * spread over the members, and fail over to another member when one fails.
+ * Each member starts with a header block, which records how many times
+ * members were dropped: a member that missed writes is left out when the
+ * mirrored disk is opened again, until a current member is copied over it.
+ *
+ * Virtual disks named "ram:<name>" are kept in memory, until they are dropped
+ * with block_disk_drop(): closing them does not free their blocks, and
+ * creating one that exists replaces its blocks. Only the process that created
+ * a RAM disk can see it.
+ *
+ * Virtual disks named "tier:[wt:|wb:][<size>:]<cache>,<main>" keep copies of
+ * the most used blocks of virtual disk <main> on virtual disk <cache>, which
+ * is meant to be smaller and faster. Both are created, <cache> with <size>
+ * blocks (an eighth of @bcount by default). Blocks are cached on their second
+ * miss, except by transfers of 32 blocks or more. Writes go to both disks
+ * with write-through ("wt", the default), and only to the cache with
+ * write-back ("wb") until the block leaves the cache or the tiered disk is
+ * closed. The cache is kept across opens. A cache can also be put in front of
+ * an existing virtual disk: opening a tiered disk whose <cache> is still
+ * zero-filled sets up an empty cache on it.
+ *
+ * Return: -1 if @diskname is invalid, if @bcount is 0, or if the virtual disk
+ * file cannot be created. 0 otherwise.
+ */
+int block_disk_create(const char *diskname, size_t bcount);
+
+/*
+ * Handle-based interface
+ *
+ * The functions above work on a single virtual disk per process. The
+ * functions below take the virtual disk to work on as a handle instead, so
+ * that several virtual disks can be open at the same time. They behave like
+ * their counterparts above, and can be used from several threads at once.
+ */
+
+/** Open virtual disk */
+struct disk;
+
+/**
+ * block_disk_open_h - Open virtual disk file
+ * @diskname: Name of the virtual disk file
+ *
+ * Virtual disks can be striped or mirrored over several files, be kept in
+ * memory, or have a cache, see block_disk_create(). Opening a RAM disk
+ * "ram:<name>" that does not exist loads virtual disk <name> into memory, as a
+ * new RAM disk.
+ *
+ * Return: NULL if @diskname is invalid or if the virtual disk file cannot be
+ * opened. Otherwise, a handle to the open virtual disk.
+ */
+struct disk *block_disk_open_h(const char *diskname);
+
+/**
+ * block_disk_save_h - Copy a virtual disk
+ * @disk: Virtual disk to copy
+ * @diskname: Name of the virtual disk to create with the copy
+ *
+ * Create virtual disk @diskname, of the size of @disk, and copy every block of
+ * @disk to it. This is how RAM disks are saved to a file.
+ *
+ * Return: -1 if @disk is NULL, or if @diskname cannot be created or written
+ * to. 0 otherwise.
+ */
+int block_disk_save_h(struct disk *disk, const char *diskname);
+
+/**
+ * block_disk_drop - Free a RAM disk
+ * @diskname: Name of the RAM disk, "ram:<name>"
+ *
+ * Return: -1 if @diskname is not the name of a RAM disk, or if the RAM disk is
+ * open. 0 otherwise.
+ */
+int block_disk_drop(const char *diskname);
+
+/**
+ * block_disk_close_h - Close virtual disk file
+ * @disk: Virtual disk to close, which is freed
+ *
+ * Return: -1 if @disk is NULL. 0 otherwise.
+ */
+int block_disk_close_h(struct disk *disk);
+
+/**
+ * block_disk_count_h - Get disk's block count
+ * @disk: Virtual disk
+ *
+ * Return: -1 if @disk is NULL, otherwise the number of blocks that @disk
+ * contains.
+ */
+int block_disk_count_h(struct disk *disk);
+
+/**
+ * block_disk_io_count_h - Get the number of blocks transferred by a disk
+ * @disk: Virtual disk
+ * @reads: Set to the number of blocks read since @disk was opened
+ * @writes: Set to the number of blocks written since @disk was opened
+ *
+ * Blocks that @disk transfers with its own member disks are not counted.
+ *
+ * Return: -1 if @disk is NULL. 0 otherwise.
+ */
+int block_disk_io_count_h(struct disk *disk, size_t *reads, size_t *writes);
+
+/**
+ * block_advise_h - Pass an access pattern hint down to a virtual disk
+ * @disk: Virtual disk
+ * @block: Index of the first block the hint is about
+ * @count: Number of blocks the hint is about
+ * @advice: Hint, one of the POSIX_FADV_* values of posix_fadvise()
+ *
+ * The hint is passed to posix_fadvise() on the image files backing the blocks.
+ * It only changes how fast the blocks are transferred, and has no effect on
+ * RAM disks.
+ *
+ * Return: -1 if @disk is NULL, if a block is out of bounds, or if an image
+ * file rejects the hint. 0 otherwise.
+ */
+int block_advise_h(struct disk *disk, size_t block, size_t count, int advice);
+
+/**
+ * block_write_h - Write a block to disk
+ * @disk: Virtual disk
+ * @block: Index of the block to write to
+ * @buf: Data buffer to write in the block
+ *
+ * Return: -1 if @disk is NULL, if @block is out of bounds or inaccessible or
+ * if the writing operation fails. 0 otherwise.
+ */
+int block_write_h(struct disk *disk, size_t block, const void *buf);
+
+/**
+ * block_read_h - Read a block from disk
+ * @disk: Virtual disk
+ * @block: Index of the block to read from
+ * @buf: Data buffer to be filled with content of block
+ *
+ * Return: -1 if @disk is NULL, if @block is out of bounds or inaccessible, or
+ * if the reading operation fails. 0 otherwise.
+ */
+int block_read_h(struct disk *disk, size_t block, void *buf);
+
+/**
+ * block_write_many_h - Write consecutive blocks to disk
+ * @disk: Virtual disk
+ * @block: Index of the first block to write to
+ * @count: Number of blocks to write
+ * @buf: Data buffer to write in the blocks (@count * %BLOCK_SIZE bytes)
+ *
+ * Same as calling block_write_h() on each block, in a single transfer. On
+ * striped disks, the transfer is split into one transfer per member, and these
+ * run in parallel.
+ *
+ * Return: -1 if @disk is NULL, if a block is out of bounds or inaccessible or
+ * if the writing operation fails. 0 otherwise.
+ */
+int block_write_many_h(struct disk *disk, size_t block, size_t count,
+		       const void *buf);
+
+/**
+ * block_read_many_h - Read consecutive blocks from disk
+ * @disk: Virtual disk
+ * @block: Index of the first block to read from
+ * @count: Number of blocks to read
+ * @buf: Data buffer to be filled with content of blocks (@count * %BLOCK_SIZE
+ *       bytes)
+ *
+ * Same as calling block_read_h() on each block, in a single transfer. On
+ * striped disks, the transfer is split into one transfer per member, and these
+ * run in parallel.
+ *
+ * Return: -1 if @disk is NULL, if a block is out of bounds or inaccessible, or
+ * if the reading operation fails. 0 otherwise.
+ */
+int block_read_many_h(struct disk *disk, size_t block, size_t count, void *buf);
+
+/*
+ * Block I/O tracing
+ *
+ * While tracing is on, every transfer made through the handle-based interface
+ * is recorded into a ring buffer of the thread that made it, without taking
+ * any lock. When a ring is full, its oldest events are overwritten. Transfers
+ * that virtual disks make with their own member disks are not recorded.
+ *
+ * Setting environment variable BLOCK_TRACE to a file name turns tracing on for
+ * the whole process, from the first virtual disk opened, and writes the trace
+ * to that file when the process exits.
+ *
+ * A trace file starts with struct block_trace_header, followed by the events
+ * as struct block_trace_event, in the order the transfers started. Fields are
+ * in host byte order.
+ */
+
+#define BLOCK_TRACE_SIGNATURE "ECS150BT"
+#define BLOCK_TRACE_VERSION 1
+
+/** Default number of events kept per thread */
+#define BLOCK_TRACE_EVENTS 65536
+
+/** Tag of transfers made without calling block_trace_tag() first */
+#define BLOCK_TRACE_UNTAGGED 0xff
+
+struct block_trace_header {
+	char signature[8];
+	uint32_t version;
+	uint32_t event_size;	/* sizeof(struct block_trace_event) */
+	uint64_t dropped;	/* Events overwritten before being written */
+} __attribute__((packed));
+
+struct block_trace_event {
+	uint64_t time;		/* Start of the transfer, in ns since tracing
+				   started */
+	uint64_t block;		/* First block transferred */
+	uint32_t duration;	/* Duration of the transfer, in ns */
+	uint32_t count;		/* Number of blocks transferred */
+	uint16_t thread;	/* Index of the thread, in order of first
+				   transfer */
+	uint8_t write;		/* The blocks were written, not read */
+	uint8_t tag;		/* Caller tag, see block_trace_tag() */
+	int32_t ret;		/* Return value of the transfer */
+} __attribute__((packed));
+
+/**
+ * block_trace_start - Start tracing block transfers
+ * @events: Number of events to keep per thread, 0 for %BLOCK_TRACE_EVENTS
+ *
+ * Events recorded by a previous trace are discarded.
+ *
+ * Return: -1 if tracing is already on, or if @events is too large. 0
+ * otherwise.
+ */
+int block_trace_start(size_t events);
+
+/**
+ * block_trace_stop - Stop tracing block transfers
+ * @path: Name of the trace file to write, or NULL to discard the trace
+ *
+ * Return: -1 if tracing is off, or if the trace file cannot be written. 0
+ * otherwise.
+ */
+int block_trace_stop(const char *path);
+
+/**
+ * block_trace_tag - Tag the next transfer of the calling thread
+ * @tag: Tag recorded with the transfer, telling what its blocks hold, from 0
+ *       to 254
+ *
+ * The tag only applies to the next transfer made by the calling thread, and is
+ * cheap enough to be set whether tracing is on or not.
+ */
+void block_trace_tag(int tag);
+
 #endif /* _DISK_H */
 
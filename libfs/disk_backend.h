@@ -0,0 +1,160 @@
+#ifndef _DISK_BACKEND_H
+#define _DISK_BACKEND_H
+
+#include <pthread.h>
+#include <stddef.h> /* for size_t definition */
+#include <sys/uio.h>
+
+#include "disk.h"
+
+/*
+ * Virtual disk backends
+ *
+ * Virtual disks are not necessarily backed by a single image file. Each kind of
+ * virtual disk implements the operations below, and embeds struct disk as its
+ * first member. Operations are only called with blocks within bounds, and with
+ * I/O vectors made of whole blocks.
+ */
+
+/** Operations of a kind of virtual disk */
+struct disk_ops {
+	/* Read consecutive blocks, from @block on, into the buffers of @iov */
+	int (*readv)(struct disk *d, size_t block, const struct iovec *iov,
+		     int iovcnt);
+	/* Write the buffers of @iov into consecutive blocks, from @block on */
+	int (*writev)(struct disk *d, size_t block, const struct iovec *iov,
+		      int iovcnt);
+	/* Release the disk, which is freed */
+	void (*close)(struct disk *d);
+	/*
+	 * Pass hint @advice about blocks @block to @block + @count - 1 down to
+	 * the storage of the disk, optional
+	 */
+	int (*advise)(struct disk *d, size_t block, size_t count, int advice);
+};
+
+/** Common part of all virtual disks */
+struct disk {
+	const struct disk_ops *ops;
+	/* Block count */
+	size_t bcount;
+	/* Number of blocks read and written since the disk was opened */
+	size_t read_count, write_count;
+};
+
+#define block_error(fmt, ...) \
+	fprintf(stderr, "%s: "fmt"\n", __func__, ##__VA_ARGS__)
+
+/* Largest number of member disks of a virtual disk */
+#define DISK_MEMBER_MAX 64
+
+/**
+ * disk_split_names - Split a list of disk names
+ * @list: Comma-separated list of disk names
+ * @names: Array to fill with copies of the names
+ * @max: Size of @names
+ *
+ * Return: -1 if @list holds an empty name or more than @max names, or if
+ * memory cannot be allocated. Otherwise the number of names, which must be
+ * freed with disk_free_names().
+ */
+int disk_split_names(const char *list, char **names, int max);
+void disk_free_names(char **names, int count);
+
+/** Transfer of consecutive blocks of a disk */
+struct disk_job {
+	int write;
+	size_t block;
+	struct iovec *iov;
+	int iovcnt;
+	int ret;
+};
+
+/**
+ * disk_run_job - Run a transfer
+ * @d: Disk to transfer blocks with
+ * @job: Transfer to run
+ *
+ * Return: the return value of the read or write operation of @d.
+ */
+int disk_run_job(struct disk *d, const struct disk_job *job);
+
+/**
+ * disk_iov_take - Take the next bytes of an I/O vector
+ * @iov: I/O vector
+ * @vi: Index of the buffer of @iov to take bytes from, updated
+ * @at: Offset in that buffer of the first byte to take, updated
+ * @len: Number of bytes to take
+ * @out: I/O vector to append the bytes to
+ *
+ * Return: the number of buffers appended to @out.
+ */
+int disk_iov_take(const struct iovec *iov, int *vi, size_t *at, size_t len,
+		  struct iovec *out);
+
+/*
+ * Member disks of a virtual disk run the transfers they are handed in their
+ * own thread, so that several members work at once. A member takes one
+ * transfer at a time: threads that share a virtual disk and need several of its
+ * members must post their transfers to the members in the same order.
+ */
+struct disk_worker {
+	struct disk *disk;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	/* The job slot is taken, the job is ready to run, the job is done */
+	int busy, pending, done;
+	int stop;
+	struct disk_job job;
+};
+
+/**
+ * disk_worker_start - Start the thread of a member disk
+ * @w: Worker to start
+ * @disk: Member disk
+ *
+ * Return: -1 if the thread cannot be started. 0 otherwise.
+ */
+int disk_worker_start(struct disk_worker *w, struct disk *disk);
+
+/** disk_worker_stop - Stop the thread of a member disk */
+void disk_worker_stop(struct disk_worker *w);
+
+/** disk_worker_post - Hand a transfer over to a member disk */
+void disk_worker_post(struct disk_worker *w, const struct disk_job *job);
+
+/**
+ * disk_worker_wait - Wait for the transfer handed over to a member disk
+ * @w: Worker the transfer was posted to
+ *
+ * Return: the return value of the transfer.
+ */
+int disk_worker_wait(struct disk_worker *w);
+
+/*
+ * Striped disks: "stripe:[<unit>:]<member>,<member>,..."
+ */
+struct disk *stripe_open(const char *spec);
+int stripe_create(const char *spec, size_t bcount);
+
+/*
+ * Mirrored disks: "mirror:<member>,<member>,..."
+ */
+struct disk *mirror_open(const char *spec);
+int mirror_create(const char *spec, size_t bcount);
+
+/*
+ * RAM disks: "ram:<name>"
+ */
+struct disk *ram_open(const char *name);
+int ram_create(const char *name, size_t bcount);
+int ram_drop(const char *name);
+
+/*
+ * Tiered disks: "tier:[wt:|wb:][<cache blocks>:]<cache>,<main>"
+ */
+struct disk *tier_open(const char *spec);
+int tier_create(const char *spec, size_t bcount);
+
+#endif /* _DISK_BACKEND_H */
@@ -0,0 +1,430 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "disk_backend.h"
+
+/*
+ * Mirrored disks keep a copy of every block on each of their member disks.
+ * Each member starts with a header block, followed by a copy of the blocks.
+ * Writes go to all members at once. Reads go to a single member, picked for
+ * having the fewest transfers under way and, among those, for having last
+ * served the blocks closest to the ones to read. Long reads are split between
+ * the members instead, which all work at once.
+ *
+ * A member that fails a transfer is dropped from the disk, and reads fail over
+ * to the other members. Since it misses the writes that follow, the event
+ * count in the header of the other members is bumped before any of these
+ * writes completes. When the disk is opened again, members whose event count
+ * is behind are left out, until a current member is copied over them.
+ */
+
+#define MIRROR_SIGNATURE "ECS150MV"
+#define MIRROR_VERSION 1
+
+/* Reads of at least this many blocks per member are split between members */
+#define MIRROR_SPLIT 16
+
+/* Header block of the members of a mirrored disk */
+struct mirror_header {
+	char signature[8];
+	uint32_t version;
+	uint32_t pad;
+	/* Block count of the mirrored disk */
+	uint64_t bcount;
+	/* Identifier shared by the members of a mirrored disk */
+	uint64_t volume_id;
+	/* Number of times members were dropped since the disk was created */
+	uint64_t events;
+} __attribute__((packed));
+
+struct mirror_member {
+	struct disk_worker w;
+	/* Number of transfers under way */
+	int inflight;
+	/* Block after the last one read */
+	size_t last;
+	/* The member failed a transfer, and is out of date */
+	int failed;
+};
+
+struct mirror_disk {
+	struct disk disk;
+	int member_count;
+	int started;
+	/* Header of the members, and lock taken to write it */
+	pthread_mutex_t lock;
+	struct mirror_header h;
+	/* Number of members dropped, and number recorded in the headers */
+	int dropped, recorded;
+	struct mirror_member members[];
+};
+
+static void member_failed(struct mirror_disk *m, int i)
+{
+	if (__atomic_exchange_n(&m->members[i].failed, 1, __ATOMIC_RELAXED))
+		return;
+
+	block_error("member %d of the mirrored disk failed, dropping it", i);
+	__atomic_fetch_add(&m->dropped, 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Bump the event count of the members left, if members were dropped since it
+ * was last written. Writes call this before they complete, so that a member
+ * that missed them is known to be behind.
+ */
+static void record_drops(struct mirror_disk *m)
+{
+	char buf[BLOCK_SIZE];
+	int dropped;
+
+	if (__atomic_load_n(&m->dropped, __ATOMIC_ACQUIRE) ==
+	    __atomic_load_n(&m->recorded, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&m->lock);
+	/* Members that fail to take the header are dropped in turn */
+	while ((dropped = __atomic_load_n(&m->dropped, __ATOMIC_ACQUIRE)) !=
+	       m->recorded) {
+		m->h.events++;
+		memset(buf, 0, sizeof(buf));
+		memcpy(buf, &m->h, sizeof(m->h));
+
+		for (int i = 0; i < m->member_count; i++) {
+			if (__atomic_load_n(&m->members[i].failed,
+					    __ATOMIC_RELAXED))
+				continue;
+			if (block_write_h(m->members[i].w.disk, 0, buf))
+				member_failed(m, i);
+		}
+		__atomic_store_n(&m->recorded, dropped, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&m->lock);
+}
+
+/* Pick the member to read from block @block, -1 if none is left */
+static int pick(struct mirror_disk *m, size_t block)
+{
+	int best = -1, best_inflight = 0;
+	size_t best_dist = 0;
+
+	for (int i = 0; i < m->member_count; i++) {
+		struct mirror_member *mm = &m->members[i];
+		int inflight = __atomic_load_n(&mm->inflight, __ATOMIC_RELAXED);
+		size_t last = __atomic_load_n(&mm->last, __ATOMIC_RELAXED);
+		size_t dist = last > block ? last - block : block - last;
+
+		if (__atomic_load_n(&mm->failed, __ATOMIC_RELAXED))
+			continue;
+		if (best == -1 || inflight < best_inflight ||
+		    (inflight == best_inflight && dist < best_dist)) {
+			best = i;
+			best_inflight = inflight;
+			best_dist = dist;
+		}
+	}
+
+	return best;
+}
+
+/* Read from member @i, which was picked to run @job */
+static int read_member(struct mirror_disk *m, int i, struct disk_job *job,
+		       int posted)
+{
+	struct mirror_member *mm = &m->members[i];
+	int ret;
+
+	if (posted) {
+		ret = disk_worker_wait(&mm->w);
+	} else {
+		__atomic_fetch_add(&mm->inflight, 1, __ATOMIC_RELAXED);
+		ret = disk_run_job(mm->w.disk, job);
+	}
+	__atomic_fetch_sub(&mm->inflight, 1, __ATOMIC_RELAXED);
+
+	if (ret)
+		member_failed(m, i);
+	return ret;
+}
+
+/* Read from a single member, failing over to the others */
+static int read_one(struct mirror_disk *m, struct disk_job *job, size_t count)
+{
+	int i;
+
+	while ((i = pick(m, job->block)) != -1) {
+		__atomic_store_n(&m->members[i].last, job->block + count,
+				 __ATOMIC_RELAXED);
+		if (!read_member(m, i, job, 0))
+			return 0;
+	}
+
+	block_error("no member of the mirrored disk is left");
+	return -1;
+}
+
+static int mirror_readv(struct disk *d, size_t block, const struct iovec *iov,
+			int iovcnt)
+{
+	struct mirror_disk *m = (struct mirror_disk *)d;
+	struct disk_job jobs[DISK_MEMBER_MAX], whole = {
+		.block = block + 1, .iov = (struct iovec *)iov,
+		.iovcnt = iovcnt,
+	};
+	int live[DISK_MEMBER_MAX], failed[DISK_MEMBER_MAX];
+	int nlive = 0, vi = 0, ret = 0;
+	size_t count = 0, at = 0, piece, counts[DISK_MEMBER_MAX];
+	struct iovec *vecs;
+
+	for (int i = 0; i < iovcnt; i++)
+		count += iov[i].iov_len / BLOCK_SIZE;
+	for (int i = 0; i < m->member_count; i++)
+		if (!__atomic_load_n(&m->members[i].failed, __ATOMIC_RELAXED))
+			live[nlive++] = i;
+
+	if (nlive < 2 || count < 2 * MIRROR_SPLIT)
+		return read_one(m, &whole, count);
+
+	/* Long reads are split into one piece per member */
+	if ((size_t)nlive > count / MIRROR_SPLIT)
+		nlive = count / MIRROR_SPLIT;
+	piece = (count + nlive - 1) / nlive;
+	vecs = malloc((size_t)nlive * (iovcnt + 1) * sizeof(*vecs));
+	if (!vecs) {
+		perror("malloc");
+		return -1;
+	}
+
+	for (int k = 0; k < nlive; k++) {
+		size_t n = count < piece ? count : piece;
+
+		jobs[k].write = 0;
+		/* Blocks of the members follow their header */
+		jobs[k].block = block + 1;
+		jobs[k].iov = vecs + (size_t)k * (iovcnt + 1);
+		jobs[k].iovcnt = disk_iov_take(iov, &vi, &at, n * BLOCK_SIZE,
+					       jobs[k].iov);
+		counts[k] = n;
+		block += n;
+		count -= n;
+	}
+
+	/* Members are posted to in order, see struct disk_worker */
+	for (int k = 1; k < nlive; k++) {
+		struct mirror_member *mm = &m->members[live[k]];
+
+		__atomic_fetch_add(&mm->inflight, 1, __ATOMIC_RELAXED);
+		__atomic_store_n(&mm->last, jobs[k].block + counts[k],
+				 __ATOMIC_RELAXED);
+		disk_worker_post(&mm->w, &jobs[k]);
+	}
+	__atomic_store_n(&m->members[live[0]].last, jobs[0].block + counts[0],
+			 __ATOMIC_RELAXED);
+	failed[0] = read_member(m, live[0], &jobs[0], 0);
+	for (int k = 1; k < nlive; k++)
+		failed[k] = read_member(m, live[k], &jobs[k], 1);
+
+	/* Pieces that could not be read are read again from other members */
+	for (int k = 0; k < nlive; k++)
+		if (failed[k] && read_one(m, &jobs[k], counts[k]))
+			ret = -1;
+
+	free(vecs);
+	return ret;
+}
+
+static int mirror_writev(struct disk *d, size_t block,
+			 const struct iovec *iov, int iovcnt)
+{
+	struct mirror_disk *m = (struct mirror_disk *)d;
+	struct disk_job job = {
+		.write = 1, .block = block + 1, .iov = (struct iovec *)iov,
+		.iovcnt = iovcnt,
+	};
+	int live[DISK_MEMBER_MAX], nlive = 0, written = 0;
+
+	for (int i = 0; i < m->member_count; i++)
+		if (!__atomic_load_n(&m->members[i].failed, __ATOMIC_RELAXED))
+			live[nlive++] = i;
+	if (nlive == 0) {
+		block_error("no member of the mirrored disk is left");
+		return -1;
+	}
+
+	for (int k = 1; k < nlive; k++)
+		disk_worker_post(&m->members[live[k]].w, &job);
+	if (disk_run_job(m->members[live[0]].w.disk, &job))
+		member_failed(m, live[0]);
+	else
+		written++;
+	for (int k = 1; k < nlive; k++) {
+		if (disk_worker_wait(&m->members[live[k]].w))
+			member_failed(m, live[k]);
+		else
+			written++;
+	}
+
+	/* The write stands as long as a member holds it */
+	record_drops(m);
+	return written ? 0 : -1;
+}
+
+/* Every member may serve the blocks, so they all get the hint */
+static int mirror_advise(struct disk *d, size_t block, size_t count,
+			 int advice)
+{
+	struct mirror_disk *m = (struct mirror_disk *)d;
+	int ret = 0;
+
+	for (int i = 0; i < m->member_count; i++) {
+		if (__atomic_load_n(&m->members[i].failed, __ATOMIC_RELAXED))
+			continue;
+		if (block_advise_h(m->members[i].w.disk, block + 1, count,
+				   advice))
+			ret = -1;
+	}
+
+	return ret;
+}
+
+static void mirror_release(struct mirror_disk *m)
+{
+	for (int i = 0; i < m->started; i++)
+		disk_worker_stop(&m->members[i].w);
+
+	for (int i = 0; i < m->member_count; i++)
+		if (m->members[i].w.disk)
+			block_disk_close_h(m->members[i].w.disk);
+	pthread_mutex_destroy(&m->lock);
+	free(m);
+}
+
+static void mirror_close(struct disk *d)
+{
+	mirror_release((struct mirror_disk *)d);
+}
+
+static const struct disk_ops mirror_ops = {
+	.readv = mirror_readv,
+	.writev = mirror_writev,
+	.close = mirror_close,
+	.advise = mirror_advise,
+};
+
+int mirror_create(const char *spec, size_t bcount)
+{
+	char *names[DISK_MEMBER_MAX];
+	char buf[BLOCK_SIZE];
+	struct mirror_header *h = (struct mirror_header *)buf;
+	struct timespec ts;
+	int count, ret = 0;
+
+	if ((count = disk_split_names(spec, names, DISK_MEMBER_MAX)) < 0)
+		return -1;
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(h->signature, MIRROR_SIGNATURE, sizeof(h->signature));
+	h->version = MIRROR_VERSION;
+	h->bcount = bcount;
+	/* Disks created in the same second must still be told apart */
+	clock_gettime(CLOCK_REALTIME, &ts);
+	h->volume_id = (uint64_t)ts.tv_sec << 32 ^ (uint64_t)getpid() << 16 ^
+		ts.tv_nsec;
+
+	for (int i = 0; i < count && !ret; i++) {
+		struct disk *md;
+
+		if (block_disk_create(names[i], bcount + 1) ||
+		    !(md = block_disk_open_h(names[i]))) {
+			ret = -1;
+			break;
+		}
+		ret = block_write_h(md, 0, buf);
+		block_disk_close_h(md);
+	}
+
+	disk_free_names(names, count);
+	return ret;
+}
+
+struct disk *mirror_open(const char *spec)
+{
+	char *names[DISK_MEMBER_MAX];
+	char buf[BLOCK_SIZE];
+	struct mirror_header *h = (struct mirror_header *)buf;
+	uint64_t events[DISK_MEMBER_MAX];
+	struct mirror_disk *m;
+	int count;
+
+	if ((count = disk_split_names(spec, names, DISK_MEMBER_MAX)) < 0)
+		return NULL;
+
+	if (!(m = calloc(1, sizeof(*m) + count * sizeof(m->members[0])))) {
+		perror("calloc");
+		disk_free_names(names, count);
+		return NULL;
+	}
+	m->disk.ops = &mirror_ops;
+	m->member_count = count;
+	pthread_mutex_init(&m->lock, NULL);
+
+	for (int i = 0; i < count; i++) {
+		struct disk *md = block_disk_open_h(names[i]);
+
+		if (!md)
+			goto fail;
+		m->members[i].w.disk = md;
+		if (block_read_h(md, 0, buf))
+			goto fail;
+
+		/* Members must belong to the same disk */
+		if (memcmp(h->signature, MIRROR_SIGNATURE,
+			   sizeof(h->signature)) ||
+		    h->version != MIRROR_VERSION ||
+		    (i && (h->volume_id != m->h.volume_id ||
+			   h->bcount != m->h.bcount))) {
+			block_error("'%s' is not a member of the mirrored disk",
+				    names[i]);
+			goto fail;
+		}
+		if ((size_t)block_disk_count_h(md) < h->bcount + 1) {
+			block_error("member '%s' is too small", names[i]);
+			goto fail;
+		}
+
+		events[i] = h->events;
+		if (!i || h->events > m->h.events)
+			memcpy(&m->h, h, sizeof(m->h));
+	}
+	m->disk.bcount = m->h.bcount;
+
+	/* Members that missed writes are left out */
+	for (int i = 0; i < count; i++) {
+		if (events[i] == m->h.events)
+			continue;
+		block_error("member '%s' of the mirrored disk is out of date, "
+			    "leaving it out", names[i]);
+		m->members[i].failed = 1;
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (disk_worker_start(&m->members[i].w, m->members[i].w.disk))
+			goto fail;
+		m->started++;
+	}
+
+	disk_free_names(names, count);
+	return &m->disk;
+
+fail:
+	disk_free_names(names, count);
+	mirror_release(m);
+	return NULL;
+}
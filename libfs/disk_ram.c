@@ -0,0 +1,235 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+#include "disk_backend.h"
+
+/*
+ * RAM disks keep their blocks in memory, in an arena that outlives the disk
+ * being closed: a RAM disk can be created, closed and opened again, which is
+ * what fs_mkfs() and fs_mount() do, until the arena is dropped. Opening a RAM
+ * disk that does not exist loads the virtual disk of the same name in a new
+ * arena.
+ */
+
+struct ram_arena {
+	char *name;
+	char *data;
+	size_t bcount;
+	/* Number of open disks on the arena */
+	int users;
+	struct ram_arena *next;
+};
+
+struct ram_disk {
+	struct disk disk;
+	struct ram_arena *arena;
+};
+
+/* Arenas of the process, by name */
+static struct ram_arena *arenas;
+static pthread_mutex_t arenas_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static struct ram_arena *find_arena(const char *name)
+{
+	struct ram_arena *a;
+
+	for (a = arenas; a; a = a->next)
+		if (!strcmp(a->name, name))
+			return a;
+
+	return NULL;
+}
+
+static int ram_readv(struct disk *d, size_t block, const struct iovec *iov,
+		     int iovcnt)
+{
+	const char *p = ((struct ram_disk *)d)->arena->data + block * BLOCK_SIZE;
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(iov[i].iov_base, p, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+static int ram_writev(struct disk *d, size_t block, const struct iovec *iov,
+		      int iovcnt)
+{
+	char *p = ((struct ram_disk *)d)->arena->data + block * BLOCK_SIZE;
+
+	for (int i = 0; i < iovcnt; i++) {
+		memcpy(p, iov[i].iov_base, iov[i].iov_len);
+		p += iov[i].iov_len;
+	}
+
+	return 0;
+}
+
+static void ram_close(struct disk *d)
+{
+	struct ram_disk *r = (struct ram_disk *)d;
+
+	pthread_mutex_lock(&arenas_lock);
+	r->arena->users--;
+	pthread_mutex_unlock(&arenas_lock);
+	free(r);
+}
+
+static const struct disk_ops ram_ops = {
+	.readv = ram_readv,
+	.writev = ram_writev,
+	.close = ram_close,
+};
+
+static void free_arena(struct ram_arena *a)
+{
+	free(a->name);
+	free(a->data);
+	free(a);
+}
+
+/* Allocate arena @name, of @bcount zero-filled blocks */
+static struct ram_arena *new_arena(const char *name, size_t bcount)
+{
+	struct ram_arena *a;
+
+	if (!(a = calloc(1, sizeof(*a)))) {
+		perror("calloc");
+		return NULL;
+	}
+	a->name = strdup(name);
+	a->data = calloc(bcount, BLOCK_SIZE);
+	if (!a->name || !a->data) {
+		perror("calloc");
+		free(a->name);
+		free(a->data);
+		free(a);
+		return NULL;
+	}
+	a->bcount = bcount;
+
+	return a;
+}
+
+/* Load virtual disk @name in a new arena */
+static struct ram_arena *load_arena(const char *name)
+{
+	struct ram_arena *a;
+	struct disk *d;
+	size_t bcount;
+
+	if (!(d = block_disk_open_h(name))) {
+		block_error("no RAM disk or virtual disk named '%s'", name);
+		return NULL;
+	}
+	bcount = block_disk_count_h(d);
+
+	if ((a = new_arena(name, bcount)) &&
+	    block_read_many_h(d, 0, bcount, a->data)) {
+		free_arena(a);
+		a = NULL;
+	}
+
+	block_disk_close_h(d);
+	return a;
+}
+
+struct disk *ram_open(const char *name)
+{
+	struct ram_arena *a;
+	struct ram_disk *r;
+
+	if (!(r = calloc(1, sizeof(*r)))) {
+		perror("calloc");
+		return NULL;
+	}
+
+	pthread_mutex_lock(&arenas_lock);
+	if (!(a = find_arena(name))) {
+		struct ram_arena *loaded, *raced;
+
+		/* The virtual disk to load may itself be a RAM disk */
+		pthread_mutex_unlock(&arenas_lock);
+		if (!(loaded = load_arena(name))) {
+			free(r);
+			return NULL;
+		}
+
+		pthread_mutex_lock(&arenas_lock);
+		if ((raced = find_arena(name))) {
+			free_arena(loaded);
+			a = raced;
+		} else {
+			a = loaded;
+			a->next = arenas;
+			arenas = a;
+		}
+	}
+	a->users++;
+	pthread_mutex_unlock(&arenas_lock);
+
+	r->disk.ops = &ram_ops;
+	r->disk.bcount = a->bcount;
+	r->arena = a;
+
+	return &r->disk;
+}
+
+int ram_create(const char *name, size_t bcount)
+{
+	struct ram_arena *a, *old;
+	int ret = 0;
+
+	pthread_mutex_lock(&arenas_lock);
+	old = find_arena(name);
+	if (old && old->users) {
+		block_error("RAM disk '%s' is open", name);
+		ret = -1;
+	} else if (!(a = new_arena(name, bcount))) {
+		ret = -1;
+	} else if (old) {
+		/* Replace the blocks of the existing arena */
+		free(old->data);
+		old->data = a->data;
+		old->bcount = bcount;
+		free(a->name);
+		free(a);
+	} else {
+		a->next = arenas;
+		arenas = a;
+	}
+	pthread_mutex_unlock(&arenas_lock);
+
+	return ret;
+}
+
+int ram_drop(const char *name)
+{
+	struct ram_arena **p, *a;
+	int ret = -1;
+
+	pthread_mutex_lock(&arenas_lock);
+	for (p = &arenas; (a = *p); p = &a->next) {
+		if (strcmp(a->name, name))
+			continue;
+
+		if (a->users) {
+			block_error("RAM disk '%s' is open", name);
+		} else {
+			*p = a->next;
+			free_arena(a);
+			ret = 0;
+		}
+		break;
+	}
+	pthread_mutex_unlock(&arenas_lock);
+
+	if (!a)
+		block_error("no RAM disk named '%s'", name);
+	return ret;
+}
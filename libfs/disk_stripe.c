@@ -0,0 +1,336 @@
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "disk_backend.h"
+
+/*
+ * Striped disks spread their blocks over several member disks: the first
+ * @unit blocks go to the first member, the next @unit blocks to the second
+ * member, and so on. Each member starts with a header block describing the
+ * layout, followed by its share of the blocks. A transfer of consecutive
+ * blocks is made of at most one transfer of consecutive blocks per member,
+ * and these are run in parallel.
+ */
+
+#define STRIPE_SIGNATURE "ECS150SV"
+#define STRIPE_VERSION 1
+
+/* Default stripe unit, in blocks */
+#define STRIPE_UNIT 16
+
+/* Header block of the members of a striped disk */
+struct stripe_header {
+	char signature[8];
+	uint32_t version;
+	/* Index of the member, and number of members */
+	uint32_t member;
+	uint32_t member_count;
+	/* Stripe unit, in blocks */
+	uint32_t unit;
+	/* Block count of the striped disk */
+	uint64_t bcount;
+	/* Identifier shared by the members of a striped disk */
+	uint64_t volume_id;
+} __attribute__((packed));
+
+struct stripe_disk {
+	struct disk disk;
+	size_t unit;
+	int member_count;
+	int started;
+	struct disk_worker members[];
+};
+
+/* Member holding block @block, and index of the block in that member */
+static int locate(struct stripe_disk *s, size_t block, size_t *mblock)
+{
+	size_t chunk = block / s->unit;
+
+	*mblock = 1 + chunk / s->member_count * s->unit + block % s->unit;
+	return chunk % s->member_count;
+}
+
+static int stripe_io(struct disk *d, int write, size_t block,
+		     const struct iovec *iov, int iovcnt)
+{
+	struct stripe_disk *s = (struct stripe_disk *)d;
+	struct disk_job jobs[DISK_MEMBER_MAX];
+	struct iovec *vecs;
+	size_t count = 0, mblock;
+	int m, nchunks, first = -1, ret = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		count += iov[i].iov_len / BLOCK_SIZE;
+
+	/* Transfers within a stripe unit involve a single member */
+	m = locate(s, block, &mblock);
+	if (block % s->unit + count <= s->unit) {
+		struct disk *md = s->members[m].disk;
+
+		if (write)
+			return md->ops->writev(md, mblock, iov, iovcnt);
+		return md->ops->readv(md, mblock, iov, iovcnt);
+	}
+
+	/*
+	 * Split the transfer into stripe units, each taking the next buffers of
+	 * @iov, and gather the units of each member. A unit may span two buffers
+	 * or more, so there are at most as many pieces as units and buffers.
+	 */
+	nchunks = (block % s->unit + count + s->unit - 1) / s->unit;
+	vecs = malloc((size_t)s->member_count * (nchunks + iovcnt) *
+		      sizeof(*vecs));
+	if (!vecs) {
+		perror("malloc");
+		return -1;
+	}
+	for (m = 0; m < s->member_count; m++) {
+		jobs[m].write = write;
+		jobs[m].iov = vecs + (size_t)m * (nchunks + iovcnt);
+		jobs[m].iovcnt = 0;
+	}
+
+	size_t at = 0;
+	int vi = 0;
+	while (count) {
+		size_t n = s->unit - block % s->unit;
+		struct disk_job *job;
+
+		if (n > count)
+			n = count;
+		m = locate(s, block, &mblock);
+		job = &jobs[m];
+		if (job->iovcnt == 0) {
+			job->block = mblock;
+			if (first == -1)
+				first = m;
+		}
+
+		job->iovcnt += disk_iov_take(iov, &vi, &at, n * BLOCK_SIZE,
+					     job->iov + job->iovcnt);
+
+		block += n;
+		count -= n;
+	}
+
+	/*
+	 * The members other than the first one run their transfer in their own
+	 * thread. Members are taken in order, so that threads sharing the disk
+	 * cannot wait for each other's members.
+	 */
+	for (m = 0; m < s->member_count; m++)
+		if (m != first && jobs[m].iovcnt)
+			disk_worker_post(&s->members[m], &jobs[m]);
+	if (disk_run_job(s->members[first].disk, &jobs[first]))
+		ret = -1;
+	for (m = 0; m < s->member_count; m++)
+		if (m != first && jobs[m].iovcnt &&
+		    disk_worker_wait(&s->members[m]))
+			ret = -1;
+
+	free(vecs);
+	return ret;
+}
+
+static int stripe_readv(struct disk *d, size_t block, const struct iovec *iov,
+			int iovcnt)
+{
+	return stripe_io(d, 0, block, iov, iovcnt);
+}
+
+static int stripe_writev(struct disk *d, size_t block,
+			 const struct iovec *iov, int iovcnt)
+{
+	return stripe_io(d, 1, block, iov, iovcnt);
+}
+
+/* Hints are passed to the members one stripe unit at a time */
+static int stripe_advise(struct disk *d, size_t block, size_t count,
+			 int advice)
+{
+	struct stripe_disk *s = (struct stripe_disk *)d;
+	int ret = 0;
+
+	while (count) {
+		size_t mblock, n = s->unit - block % s->unit;
+		int m = locate(s, block, &mblock);
+
+		if (n > count)
+			n = count;
+		if (block_advise_h(s->members[m].disk, mblock, n, advice))
+			ret = -1;
+		block += n;
+		count -= n;
+	}
+
+	return ret;
+}
+
+static void stripe_release(struct stripe_disk *s)
+{
+	for (int i = 0; i < s->started; i++)
+		disk_worker_stop(&s->members[i]);
+
+	for (int i = 0; i < s->member_count; i++)
+		if (s->members[i].disk)
+			block_disk_close_h(s->members[i].disk);
+	free(s);
+}
+
+static void stripe_close(struct disk *d)
+{
+	stripe_release((struct stripe_disk *)d);
+}
+
+static const struct disk_ops stripe_ops = {
+	.readv = stripe_readv,
+	.writev = stripe_writev,
+	.close = stripe_close,
+	.advise = stripe_advise,
+};
+
+/*
+ * Parse "[<unit>:]<member>,<member>,...", in @names and @unit. @unit is left
+ * alone when the specification does not give one.
+ */
+static int parse_spec(const char *spec, char **names, size_t *unit)
+{
+	const char *p = spec;
+
+	while (*p >= '0' && *p <= '9')
+		p++;
+	if (p != spec && *p == ':') {
+		*unit = strtoul(spec, NULL, 10);
+		if (*unit == 0) {
+			block_error("invalid stripe unit in '%s'", spec);
+			return -1;
+		}
+		spec = p + 1;
+	}
+
+	return disk_split_names(spec, names, DISK_MEMBER_MAX);
+}
+
+/* Blocks of each member of a striped disk of @bcount blocks */
+static size_t member_bcount(size_t bcount, size_t unit, int count)
+{
+	size_t rows = (bcount + unit * count - 1) / (unit * count);
+
+	return 1 + rows * unit;
+}
+
+int stripe_create(const char *spec, size_t bcount)
+{
+	char *names[DISK_MEMBER_MAX];
+	char buf[BLOCK_SIZE];
+	struct stripe_header *h = (struct stripe_header *)buf;
+	size_t unit = STRIPE_UNIT;
+	int count, ret = 0;
+
+	if ((count = parse_spec(spec, names, &unit)) < 0)
+		return -1;
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(h->signature, STRIPE_SIGNATURE, sizeof(h->signature));
+	h->version = STRIPE_VERSION;
+	h->member_count = count;
+	h->unit = unit;
+	h->bcount = bcount;
+	h->volume_id = (uint64_t)time(NULL) << 32 ^ (uint64_t)getpid() << 16 ^
+		(uintptr_t)h;
+
+	for (int i = 0; i < count && !ret; i++) {
+		struct disk *m;
+
+		h->member = i;
+		if (block_disk_create(names[i],
+				      member_bcount(bcount, unit, count)) ||
+		    !(m = block_disk_open_h(names[i]))) {
+			ret = -1;
+			break;
+		}
+		ret = block_write_h(m, 0, buf);
+		block_disk_close_h(m);
+	}
+
+	disk_free_names(names, count);
+	return ret;
+}
+
+struct disk *stripe_open(const char *spec)
+{
+	char *names[DISK_MEMBER_MAX];
+	char buf[BLOCK_SIZE];
+	struct stripe_header *h = (struct stripe_header *)buf;
+	struct stripe_disk *s;
+	size_t unit = 0;
+	uint64_t volume_id = 0;
+	int count;
+
+	if ((count = parse_spec(spec, names, &unit)) < 0)
+		return NULL;
+
+	if (!(s = calloc(1, sizeof(*s) + count * sizeof(s->members[0])))) {
+		perror("calloc");
+		disk_free_names(names, count);
+		return NULL;
+	}
+	s->disk.ops = &stripe_ops;
+	s->member_count = count;
+
+	for (int i = 0; i < count; i++) {
+		struct disk *m = block_disk_open_h(names[i]);
+
+		if (!m)
+			goto fail;
+		s->members[i].disk = m;
+		if (block_read_h(m, 0, buf))
+			goto fail;
+
+		/* Members must be given in order, and belong to the same disk */
+		if (memcmp(h->signature, STRIPE_SIGNATURE,
+			   sizeof(h->signature)) ||
+		    h->version != STRIPE_VERSION || h->member != (uint32_t)i ||
+		    h->member_count != (uint32_t)count || h->unit == 0 ||
+		    (i && (h->volume_id != volume_id ||
+			   h->bcount != s->disk.bcount))) {
+			block_error("'%s' is not member %d of the striped disk",
+				    names[i], i);
+			goto fail;
+		}
+		if (unit && h->unit != unit) {
+			block_error("stripe unit is %u, not %zu", h->unit, unit);
+			goto fail;
+		}
+		unit = h->unit;
+		volume_id = h->volume_id;
+		s->disk.bcount = h->bcount;
+
+		if ((size_t)block_disk_count_h(m) <
+		    member_bcount(h->bcount, unit, count)) {
+			block_error("member '%s' is too small", names[i]);
+			goto fail;
+		}
+	}
+	s->unit = unit;
+
+	for (int i = 0; i < count; i++) {
+		if (disk_worker_start(&s->members[i], s->members[i].disk))
+			goto fail;
+		s->started++;
+	}
+
+	disk_free_names(names, count);
+	return &s->disk;
+
+fail:
+	disk_free_names(names, count);
+	stripe_release(s);
+	return NULL;
+}
@@ -0,0 +1,637 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+#include "disk_backend.h"
+
+/*
+ * Tiered disks keep copies of the most used blocks of a main disk on a
+ * smaller and faster cache disk. The cache disk starts with a header block,
+ * followed by a table that tells which block of the main disk each cache slot
+ * holds, followed by the slots. The table stays on the cache disk, so the
+ * cache is still warm when the tiered disk is opened again.
+ *
+ * Blocks are only admitted in the cache on their second miss in a while, as
+ * tracked by a bitmap of recently missed blocks, and never by transfers of
+ * TIER_SCAN blocks or more: one-off reads and long scans leave the cache alone.
+ * Slots are reused in CLOCK order, skipping the slots used since the hand last
+ * went by.
+ *
+ * With write-through, writes go to the main disk and to the cached copy. With
+ * write-back, writes to cached blocks only go to the cache, and reach the main
+ * disk when their slot is reused or the tiered disk is closed. The table is
+ * then written as soon as it changes, since it locates the only copy of these
+ * blocks. A write-through cache that was not closed cleanly is dropped.
+ */
+
+#define TIER_SIGNATURE "ECS150TC"
+#define TIER_VERSION 1
+
+enum tier_policy {
+	TIER_WRITE_THROUGH,
+	TIER_WRITE_BACK,
+};
+
+/* Transfers of this many blocks or more are not admitted in the cache */
+#define TIER_SCAN 32
+
+/* Default cache size, in blocks, for a main disk of @bcount blocks */
+#define TIER_DEFAULT_SIZE(bcount) ((bcount) / 8 < 64 ? 64 : (bcount) / 8)
+
+/* Header block of a cache disk */
+struct tier_header {
+	char signature[8];
+	uint32_t version;
+	uint32_t policy;
+	/* Block count of the main disk */
+	uint64_t main_bcount;
+	/* Number of cache slots, and index of the first one */
+	uint64_t slot_count;
+	uint64_t slot_blk;
+	/* Number of table blocks, which start at block 1 */
+	uint64_t table_blk_count;
+	/* The tiered disk was closed cleanly */
+	uint32_t clean;
+} __attribute__((packed));
+
+/* Table entry of a cache slot */
+struct tier_entry {
+	/* Block of the main disk plus one, 0 for a free slot */
+	uint32_t block;
+	uint32_t flags;
+};
+
+#define TIER_DIRTY 0x1 /* The main disk does not have the slot's data */
+
+#define ENTRIES_PER_BLK (BLOCK_SIZE / sizeof(struct tier_entry))
+
+struct tier_disk {
+	struct disk disk;
+	struct disk *cache, *main;
+	pthread_mutex_t lock;
+	struct tier_header h;
+	/* Table, and table blocks to write back */
+	struct tier_entry *table;
+	uint64_t *table_dirty;
+	/* Slot holding each block of the main disk plus one, or 0 */
+	uint32_t *where;
+	/* Slots used since the CLOCK hand went by */
+	uint8_t *used;
+	size_t hand;
+	/* Recently missed blocks, and number of blocks marked since cleared */
+	uint64_t *missed;
+	size_t missed_bits, missed_count;
+};
+
+#define BIT_TEST(map, i) ((map)[(i) / 64] & (1ULL << ((i) % 64)))
+#define BIT_SET(map, i) ((map)[(i) / 64] |= 1ULL << ((i) % 64))
+
+static int cache_io(struct tier_disk *t, int write, size_t block, void *buf)
+{
+	return write ? block_write_h(t->cache, block, buf) :
+		block_read_h(t->cache, block, buf);
+}
+
+static int write_table_block(struct tier_disk *t, size_t i)
+{
+	t->table_dirty[i / 64] &= ~(1ULL << (i % 64));
+	return block_write_h(t->cache, 1 + i,
+			     t->table + i * ENTRIES_PER_BLK);
+}
+
+/* Record the change of the entry of @slot */
+static int table_changed(struct tier_disk *t, size_t slot)
+{
+	size_t i = slot / ENTRIES_PER_BLK;
+
+	if (t->h.policy == TIER_WRITE_BACK)
+		return write_table_block(t, i);
+
+	BIT_SET(t->table_dirty, i);
+	return 0;
+}
+
+static int flush_table(struct tier_disk *t)
+{
+	int ret = 0;
+
+	for (size_t i = 0; i < t->h.table_blk_count; i++)
+		if (BIT_TEST(t->table_dirty, i) && write_table_block(t, i))
+			ret = -1;
+
+	return ret;
+}
+
+/* Free @slot, writing its data back to the main disk if needed */
+static int evict(struct tier_disk *t, size_t slot)
+{
+	struct tier_entry *e = &t->table[slot];
+	char buf[BLOCK_SIZE];
+
+	if (!e->block)
+		return 0;
+
+	if (e->flags & TIER_DIRTY) {
+		if (cache_io(t, 0, t->h.slot_blk + slot, buf) ||
+		    block_write_h(t->main, e->block - 1, buf))
+			return -1;
+	}
+
+	t->where[e->block - 1] = 0;
+	e->block = 0;
+	e->flags = 0;
+	return table_changed(t, slot);
+}
+
+/* Drop @slot after a failed write, without writing it back */
+static void invalidate(struct tier_disk *t, size_t slot)
+{
+	struct tier_entry *e = &t->table[slot];
+
+	t->where[e->block - 1] = 0;
+	e->block = 0;
+	e->flags = 0;
+	table_changed(t, slot);
+}
+
+/* Tell whether missed block @block should be admitted in the cache */
+static int admit(struct tier_disk *t, size_t block)
+{
+	size_t bit = (block * 0x9E3779B97F4A7C15ULL >> 20) % t->missed_bits;
+
+	if (BIT_TEST(t->missed, bit))
+		return 1;
+
+	/* Forget old misses once the bitmap is a quarter full */
+	if (++t->missed_count > t->missed_bits / 4) {
+		memset(t->missed, 0, t->missed_bits / 8);
+		t->missed_count = 1;
+	}
+	BIT_SET(t->missed, bit);
+	return 0;
+}
+
+/* Copy @buf, block @block of the main disk, in the cache */
+static int fill(struct tier_disk *t, size_t block, void *buf, int dirty)
+{
+	size_t slot;
+
+	for (;;) {
+		slot = t->hand;
+		t->hand = (t->hand + 1) % t->h.slot_count;
+		if (!t->used[slot])
+			break;
+		t->used[slot] = 0;
+	}
+
+	if (evict(t, slot) ||
+	    cache_io(t, 1, t->h.slot_blk + slot, buf))
+		return -1;
+
+	t->table[slot].block = block + 1;
+	t->table[slot].flags = dirty ? TIER_DIRTY : 0;
+	t->where[block] = slot + 1;
+	t->used[slot] = 1;
+	return table_changed(t, slot);
+}
+
+/* Buffer of each block of a transfer */
+static char **block_buffers(const struct iovec *iov, int iovcnt, size_t *count)
+{
+	char **bufs;
+	size_t n = 0;
+
+	for (int i = 0; i < iovcnt; i++)
+		n += iov[i].iov_len / BLOCK_SIZE;
+	if (!(bufs = malloc(n * sizeof(*bufs)))) {
+		perror("malloc");
+		return NULL;
+	}
+
+	n = 0;
+	for (int i = 0; i < iovcnt; i++)
+		for (size_t at = 0; at < iov[i].iov_len; at += BLOCK_SIZE)
+			bufs[n++] = (char *)iov[i].iov_base + at;
+	*count = n;
+
+	return bufs;
+}
+
+/* Transfer blocks @first to @last - 1 of the transfer with the main disk */
+static int main_io(struct tier_disk *t, int write, size_t block, char **bufs,
+		   size_t first, size_t last)
+{
+	struct iovec iov[TIER_SCAN];
+
+	while (first < last) {
+		size_t n = last - first < TIER_SCAN ? last - first : TIER_SCAN;
+		struct disk_job job = { write, block + first, iov, n, 0 };
+
+		for (size_t i = 0; i < n; i++) {
+			iov[i].iov_base = bufs[first + i];
+			iov[i].iov_len = BLOCK_SIZE;
+		}
+		if (disk_run_job(t->main, &job))
+			return -1;
+		first += n;
+	}
+
+	return 0;
+}
+
+static int tier_readv(struct disk *d, size_t block, const struct iovec *iov,
+		      int iovcnt)
+{
+	struct tier_disk *t = (struct tier_disk *)d;
+	size_t count, miss = 0;
+	char **bufs;
+	int ret = 0;
+
+	if (!(bufs = block_buffers(iov, iovcnt, &count)))
+		return -1;
+
+	pthread_mutex_lock(&t->lock);
+	for (size_t i = 0; i <= count && !ret; i++) {
+		uint32_t slot = i < count ? t->where[block + i] : 0;
+
+		/* Read the misses so far from the main disk in one go */
+		if (i == count || slot) {
+			ret = main_io(t, 0, block, bufs, miss, i);
+			miss = i + 1;
+		}
+		if (!slot || ret)
+			continue;
+
+		if (!cache_io(t, 0, t->h.slot_blk + slot - 1, bufs[i])) {
+			t->used[slot - 1] = 1;
+		} else if (t->table[slot - 1].flags & TIER_DIRTY) {
+			ret = -1;
+		} else {
+			/* The main disk has the block too */
+			invalidate(t, slot - 1);
+			ret = block_read_h(t->main, block + i, bufs[i]);
+		}
+	}
+
+	/*
+	 * Admit the blocks that missed once they are all read, since filling a
+	 * slot may take the slot of another block of the transfer
+	 */
+	for (size_t i = 0; !ret && count < TIER_SCAN && i < count; i++)
+		if (!t->where[block + i] && admit(t, block + i))
+			fill(t, block + i, bufs[i], 0);
+	pthread_mutex_unlock(&t->lock);
+
+	free(bufs);
+	return ret;
+}
+
+static int tier_writev(struct disk *d, size_t block, const struct iovec *iov,
+		       int iovcnt)
+{
+	struct tier_disk *t = (struct tier_disk *)d;
+	int back;
+	size_t count;
+	char **bufs;
+	int ret = 0;
+
+	if (!(bufs = block_buffers(iov, iovcnt, &count)))
+		return -1;
+	back = t->h.policy == TIER_WRITE_BACK && count < TIER_SCAN;
+
+	pthread_mutex_lock(&t->lock);
+
+	/* Unless they stay in the cache, blocks go to the main disk first */
+	if (!back)
+		ret = main_io(t, 1, block, bufs, 0, count);
+
+	for (size_t i = 0; i < count && !ret; i++) {
+		uint32_t slot = t->where[block + i];
+
+		if (slot) {
+			struct tier_entry *e = &t->table[slot - 1];
+			int stale = 0;
+
+			/*
+			 * The slot is marked dirty before it takes the only
+			 * copy of the block, so that it is not taken for a
+			 * copy of the main disk after a crash
+			 */
+			if (back && !(e->flags & TIER_DIRTY)) {
+				e->flags |= TIER_DIRTY;
+				stale = table_changed(t, slot - 1);
+			}
+
+			/* The cached copy is stale, the main disk takes it */
+			if (stale ||
+			    cache_io(t, 1, t->h.slot_blk + slot - 1, bufs[i])) {
+				invalidate(t, slot - 1);
+				if (back)
+					ret = block_write_h(t->main, block + i,
+							    bufs[i]);
+				continue;
+			}
+			t->used[slot - 1] = 1;
+
+			/* The main disk has the block, the slot is clean */
+			if (!back && (e->flags & TIER_DIRTY)) {
+				e->flags &= ~TIER_DIRTY;
+				ret = table_changed(t, slot - 1);
+			}
+		} else {
+			int cached = count < TIER_SCAN &&
+				admit(t, block + i) &&
+				!fill(t, block + i, bufs[i], back);
+
+			if (!cached && back)
+				ret = block_write_h(t->main, block + i,
+						    bufs[i]);
+		}
+	}
+	pthread_mutex_unlock(&t->lock);
+
+	free(bufs);
+	return ret;
+}
+
+/* Write the dirty blocks back, and mark the cache as cleanly closed */
+static int tier_sync(struct tier_disk *t)
+{
+	char buf[BLOCK_SIZE];
+	int ret = 0;
+
+	for (size_t s = 0; s < t->h.slot_count; s++) {
+		struct tier_entry *e = &t->table[s];
+
+		if (!(e->flags & TIER_DIRTY))
+			continue;
+		if (cache_io(t, 0, t->h.slot_blk + s, buf) ||
+		    block_write_h(t->main, e->block - 1, buf)) {
+			ret = -1;
+			continue;
+		}
+		e->flags = 0;
+		BIT_SET(t->table_dirty, s / ENTRIES_PER_BLK);
+	}
+
+	if (flush_table(t))
+		ret = -1;
+	if (!ret) {
+		memset(buf, 0, sizeof(buf));
+		t->h.clean = 1;
+		memcpy(buf, &t->h, sizeof(t->h));
+		ret = block_write_h(t->cache, 0, buf);
+	}
+
+	return ret;
+}
+
+static void tier_release(struct tier_disk *t)
+{
+	if (t->cache)
+		block_disk_close_h(t->cache);
+	if (t->main)
+		block_disk_close_h(t->main);
+	free(t->table);
+	free(t->table_dirty);
+	free(t->where);
+	free(t->used);
+	free(t->missed);
+	pthread_mutex_destroy(&t->lock);
+	free(t);
+}
+
+static void tier_close(struct disk *d)
+{
+	struct tier_disk *t = (struct tier_disk *)d;
+
+	if (tier_sync(t))
+		block_error("cannot write the cache back");
+	tier_release(t);
+}
+
+/*
+ * Hints go to the main disk only: the cache is meant to be fast whatever the
+ * access pattern, and its slots do not follow the order of the blocks
+ */
+static int tier_advise(struct disk *d, size_t block, size_t count, int advice)
+{
+	struct tier_disk *t = (struct tier_disk *)d;
+
+	return block_advise_h(t->main, block, count, advice);
+}
+
+static const struct disk_ops tier_ops = {
+	.readv = tier_readv,
+	.writev = tier_writev,
+	.close = tier_close,
+	.advise = tier_advise,
+};
+
+/*
+ * Parse "[wt:|wb:][<cache blocks>:]<cache>,<main>". @policy and @size are left
+ * alone when the specification does not give them.
+ */
+static int parse_spec(const char *spec, char **names, int *policy,
+		      size_t *size)
+{
+	for (;;) {
+		const char *p = spec;
+
+		if (!strncmp(spec, "wt:", 3) || !strncmp(spec, "wb:", 3)) {
+			*policy = spec[1] == 'b' ? TIER_WRITE_BACK :
+				TIER_WRITE_THROUGH;
+			spec += 3;
+			continue;
+		}
+
+		while (*p >= '0' && *p <= '9')
+			p++;
+		if (p == spec || *p != ':')
+			break;
+		*size = strtoul(spec, NULL, 10);
+		spec = p + 1;
+	}
+
+	if (disk_split_names(spec, names, 2) != 2) {
+		block_error("tiered disks need a cache disk and a main disk");
+		return -1;
+	}
+	return 0;
+}
+
+/* Set up an empty cache on @cache, for a main disk of @main_bcount blocks */
+static int format(struct disk *cache, int policy, size_t main_bcount)
+{
+	char buf[BLOCK_SIZE];
+	struct tier_header *h = (struct tier_header *)buf;
+	size_t bcount = block_disk_count_h(cache);
+
+	memset(buf, 0, sizeof(buf));
+	memcpy(h->signature, TIER_SIGNATURE, sizeof(h->signature));
+	h->version = TIER_VERSION;
+	h->policy = policy;
+	h->main_bcount = main_bcount;
+	h->slot_count = (bcount - 1) * ENTRIES_PER_BLK / (ENTRIES_PER_BLK + 1);
+	h->table_blk_count = (h->slot_count + ENTRIES_PER_BLK - 1) /
+		ENTRIES_PER_BLK;
+	h->slot_blk = 1 + h->table_blk_count;
+	h->clean = 1;
+	if (h->slot_count == 0) {
+		block_error("cache disk is too small");
+		return -1;
+	}
+
+	if (block_write_h(cache, 0, buf))
+		return -1;
+
+	memset(buf, 0, sizeof(buf));
+	for (size_t i = 0; i < h->table_blk_count; i++)
+		if (block_write_h(cache, 1 + i, buf))
+			return -1;
+
+	return 0;
+}
+
+int tier_create(const char *spec, size_t bcount)
+{
+	char *names[2];
+	int policy = TIER_WRITE_THROUGH, ret = -1;
+	size_t size = TIER_DEFAULT_SIZE(bcount);
+	struct disk *cache;
+
+	if (parse_spec(spec, names, &policy, &size))
+		return -1;
+
+	if (!block_disk_create(names[1], bcount) &&
+	    !block_disk_create(names[0], size) &&
+	    (cache = block_disk_open_h(names[0]))) {
+		ret = format(cache, policy, bcount);
+		block_disk_close_h(cache);
+	}
+
+	disk_free_names(names, 2);
+	return ret;
+}
+
+/* Load the table of the cache, and index it */
+static int load_table(struct tier_disk *t)
+{
+	size_t n = t->h.table_blk_count * ENTRIES_PER_BLK;
+
+	t->table = malloc(n * sizeof(*t->table));
+	t->table_dirty = calloc((t->h.table_blk_count + 63) / 64,
+				sizeof(uint64_t));
+	t->where = calloc(t->h.main_bcount, sizeof(*t->where));
+	t->used = calloc(t->h.slot_count, 1);
+	t->missed_bits = 4 * t->h.slot_count < 4096 ? 4096 :
+		(4 * t->h.slot_count + 63) / 64 * 64;
+	t->missed = calloc(t->missed_bits / 64, sizeof(uint64_t));
+	if (!t->table || !t->table_dirty || !t->where || !t->used ||
+	    !t->missed) {
+		perror("calloc");
+		return -1;
+	}
+
+	for (size_t i = 0; i < t->h.table_blk_count; i++)
+		if (block_read_h(t->cache, 1 + i,
+				 t->table + i * ENTRIES_PER_BLK))
+			return -1;
+
+	for (size_t s = 0; s < t->h.slot_count; s++) {
+		struct tier_entry *e = &t->table[s];
+
+		/* A write-through cache may be stale after a crash */
+		if (!t->h.clean && t->h.policy == TIER_WRITE_THROUGH &&
+		    e->block) {
+			e->block = 0;
+			BIT_SET(t->table_dirty, s / ENTRIES_PER_BLK);
+		}
+		if (!e->block)
+			continue;
+
+		if (e->block > t->h.main_bcount || t->where[e->block - 1]) {
+			block_error("corrupted cache table");
+			return -1;
+		}
+		t->where[e->block - 1] = s + 1;
+	}
+
+	return 0;
+}
+
+struct disk *tier_open(const char *spec)
+{
+	char *names[2];
+	char buf[BLOCK_SIZE];
+	int policy = -1;
+	size_t size = 0;
+	struct tier_disk *t;
+
+	if (parse_spec(spec, names, &policy, &size))
+		return NULL;
+
+	if (!(t = calloc(1, sizeof(*t)))) {
+		perror("calloc");
+		disk_free_names(names, 2);
+		return NULL;
+	}
+	t->disk.ops = &tier_ops;
+	pthread_mutex_init(&t->lock, NULL);
+
+	if (!(t->cache = block_disk_open_h(names[0])) ||
+	    !(t->main = block_disk_open_h(names[1])) ||
+	    block_read_h(t->cache, 0, buf))
+		goto fail;
+
+	/* A zero-filled cache disk is set up as an empty cache */
+	static const char zero[BLOCK_SIZE];
+	if (!memcmp(buf, zero, BLOCK_SIZE) &&
+	    (format(t->cache, policy == -1 ? TIER_WRITE_THROUGH : policy,
+		    block_disk_count_h(t->main)) ||
+	     block_read_h(t->cache, 0, buf)))
+		goto fail;
+
+	memcpy(&t->h, buf, sizeof(t->h));
+	if (memcmp(t->h.signature, TIER_SIGNATURE, sizeof(t->h.signature)) ||
+	    t->h.version != TIER_VERSION ||
+	    t->h.slot_blk + t->h.slot_count >
+	    (size_t)block_disk_count_h(t->cache)) {
+		block_error("'%s' is not a cache disk", names[0]);
+		goto fail;
+	}
+	if (t->h.main_bcount != (size_t)block_disk_count_h(t->main)) {
+		block_error("'%s' is not the cache of '%s'", names[0],
+			    names[1]);
+		goto fail;
+	}
+	if (policy != -1 && (uint32_t)policy != t->h.policy) {
+		block_error("'%s' is a write-%s cache", names[0],
+			    t->h.policy == TIER_WRITE_BACK ?
+			    "back" : "through");
+		goto fail;
+	}
+	t->disk.bcount = t->h.main_bcount;
+
+	if (load_table(t) || flush_table(t))
+		goto fail;
+
+	/* Until closed, the cache may not match the main disk */
+	t->h.clean = 0;
+	memset(buf, 0, sizeof(buf));
+	memcpy(buf, &t->h, sizeof(t->h));
+	if (block_write_h(t->cache, 0, buf))
+		goto fail;
+
+	disk_free_names(names, 2);
+	return &t->disk;
+
+fail:
+	disk_free_names(names, 2);
+	tier_release(t);
+	return NULL;
+}
@@ -0,0 +1,494 @@
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FAT_SCAN_X86 1
+#endif
+
+#include "fat_scan.h"
+
+/*
+ * Run search shared by all implementations: @mask holds one bit per entry
+ * starting at @base (bit set if the entry is free), @cur is the length of the
+ * free run ending right before @base. Return the start of the first run of
+ * @run free entries within the mask, or SIZE_MAX after updating @cur.
+ */
+static size_t run_in_mask(uint32_t mask, unsigned int width, size_t base,
+			  size_t *cur, size_t run)
+{
+	uint32_t full = width == 32 ? 0xFFFFFFFFu : (1u << width) - 1;
+	unsigned int bit = 0;
+
+	/* Fast paths: the whole window is either free or used */
+	if (mask == full) {
+		*cur += width;
+		if (*cur >= run)
+			return base + width - *cur;
+		return SIZE_MAX;
+	}
+	if (mask == 0) {
+		*cur = 0;
+		return SIZE_MAX;
+	}
+
+	while (bit < width) {
+		uint32_t rest = mask >> bit;
+		unsigned int ones, zeros;
+
+		/* Length of the free run starting at @bit */
+		ones = (~rest) ? (unsigned int)__builtin_ctz(~rest) : 32 - bit;
+		if (ones > width - bit)
+			ones = width - bit;
+		if (ones) {
+			if (*cur + ones >= run)
+				return base + bit - *cur;
+			*cur += ones;
+			bit += ones;
+			if (bit >= width)
+				break;
+			rest = mask >> bit;
+		}
+
+		/* Skip the used entries that follow */
+		*cur = 0;
+		zeros = rest ? (unsigned int)__builtin_ctz(rest) : width - bit;
+		bit += zeros;
+	}
+
+	return SIZE_MAX;
+}
+
+/* Scalar implementation */
+
+static size_t count_free_scalar(const uint16_t *fat, size_t n)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < n; i++)
+		count += fat[i] == 0;
+
+	return count;
+}
+
+static size_t find_free_scalar(const uint16_t *fat, size_t n, size_t start)
+{
+	for (size_t i = start; i < n; i++)
+		if (fat[i] == 0)
+			return i;
+
+	return n;
+}
+
+static size_t find_free_run_scalar(const uint16_t *fat, size_t n,
+				   size_t start, size_t run)
+{
+	size_t cur = 0;
+
+	for (size_t i = start; i < n; i++) {
+		cur = fat[i] == 0 ? cur + 1 : 0;
+		if (cur >= run)
+			return i + 1 - run;
+	}
+
+	return n;
+}
+
+static size_t count_free32_scalar(const uint32_t *fat, size_t n)
+{
+	size_t count = 0;
+
+	for (size_t i = 0; i < n; i++)
+		count += fat[i] == 0;
+
+	return count;
+}
+
+static size_t find_free32_scalar(const uint32_t *fat, size_t n, size_t start)
+{
+	for (size_t i = start; i < n; i++)
+		if (fat[i] == 0)
+			return i;
+
+	return n;
+}
+
+static size_t find_free_run32_scalar(const uint32_t *fat, size_t n,
+				     size_t start, size_t run)
+{
+	size_t cur = 0;
+
+	for (size_t i = start; i < n; i++) {
+		cur = fat[i] == 0 ? cur + 1 : 0;
+		if (cur >= run)
+			return i + 1 - run;
+	}
+
+	return n;
+}
+
+#ifdef FAT_SCAN_X86
+
+/* SSE2 implementation, 8 entries per vector */
+
+__attribute__((target("sse2")))
+static size_t count_free_sse2(const uint16_t *fat, size_t n)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t count = 0, i = 0;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+		count += __builtin_popcount(mask) / 2;
+	}
+
+	return count + count_free_scalar(fat + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static size_t find_free_sse2(const uint16_t *fat, size_t n, size_t start)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t i = start;
+
+	for (; i + 8 <= n; i += 8) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(fat + i));
+		int mask = _mm_movemask_epi8(_mm_cmpeq_epi16(v, zero));
+		if (mask)
+			return i + __builtin_ctz(mask) / 2;
+	}
+
+	return find_free_scalar(fat, n, i);
+}
+
+__attribute__((target("sse2")))
+static size_t find_free_run_sse2(const uint16_t *fat, size_t n, size_t start,
+				 size_t run)
+{
+	const __m128i zero = _mm_setzero_si128();
+	size_t cur = 0, i = start, found;
+
+	for (; i + 16 <= n; i += 16) {
+		__m128i lo = _mm_loadu_si128((const __m128i *)(fat + i));
+		__m128i hi = _mm_loadu_si128((const __m128i *)(fat + i + 8));
+		/* Narrow both comparisons to one byte per entry */
+		__m128i eq = _mm_packs_epi16(_mm_cmpeq_epi16(lo, zero),
+					     _mm_cmpeq_epi16(hi, zero));
+		uint32_t mask = (uint32_t)_mm_movemask_epi8(eq);
+
+		found = run_in_mask(mask, 16, i, &cur, run);
+		if (found != SIZE_MAX)
+			return found;
+	}
+
+	/* Finish with the scalar code, restarting from the current run */
+	return find_free_run_scalar(fat, n, i - cur, run);
+}
+
+/* One bit per 32-bit entry of @v that is 0 */
+__attribute__((target("sse2")))
+static inline uint32_t zero_mask32_sse2(const uint32_t *fat)
+{
+	__m128i v = _mm_loadu_si128((const __m128i *)fat);
+	__m128i eq = _mm_cmpeq_epi32(v, _mm_setzero_si128());
+
+	return (uint32_t)_mm_movemask_ps(_mm_castsi128_ps(eq));
+}
+
+__attribute__((target("sse2")))
+static size_t count_free32_sse2(const uint32_t *fat, size_t n)
+{
+	size_t count = 0, i = 0;
+
+	for (; i + 4 <= n; i += 4)
+		count += __builtin_popcount(zero_mask32_sse2(fat + i));
+
+	return count + count_free32_scalar(fat + i, n - i);
+}
+
+__attribute__((target("sse2")))
+static size_t find_free32_sse2(const uint32_t *fat, size_t n, size_t start)
+{
+	size_t i = start;
+
+	for (; i + 4 <= n; i += 4) {
+		uint32_t mask = zero_mask32_sse2(fat + i);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return find_free32_scalar(fat, n, i);
+}
+
+__attribute__((target("sse2")))
+static size_t find_free_run32_sse2(const uint32_t *fat, size_t n, size_t start,
+				   size_t run)
+{
+	size_t cur = 0, i = start, found;
+
+	for (; i + 16 <= n; i += 16) {
+		uint32_t mask = zero_mask32_sse2(fat + i) |
+				zero_mask32_sse2(fat + i + 4) << 4 |
+				zero_mask32_sse2(fat + i + 8) << 8 |
+				zero_mask32_sse2(fat + i + 12) << 12;
+
+		found = run_in_mask(mask, 16, i, &cur, run);
+		if (found != SIZE_MAX)
+			return found;
+	}
+
+	return find_free_run32_scalar(fat, n, i - cur, run);
+}
+
+/* AVX2 implementation, 16 entries per vector */
+
+__attribute__((target("avx2")))
+static size_t count_free_avx2(const uint16_t *fat, size_t n)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t count = 0, i = 0;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(fat + i));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero));
+		count += __builtin_popcount(mask) / 2;
+	}
+
+	return count + count_free_sse2(fat + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t find_free_avx2(const uint16_t *fat, size_t n, size_t start)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t i = start;
+
+	for (; i + 16 <= n; i += 16) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(fat + i));
+		uint32_t mask = _mm256_movemask_epi8(_mm256_cmpeq_epi16(v, zero));
+		if (mask)
+			return i + __builtin_ctz(mask) / 2;
+	}
+
+	return find_free_sse2(fat, n, i);
+}
+
+__attribute__((target("avx2")))
+static size_t find_free_run_avx2(const uint16_t *fat, size_t n, size_t start,
+				 size_t run)
+{
+	const __m256i zero = _mm256_setzero_si256();
+	size_t cur = 0, i = start, found;
+
+	for (; i + 32 <= n; i += 32) {
+		__m256i lo = _mm256_loadu_si256((const __m256i *)(fat + i));
+		__m256i hi = _mm256_loadu_si256((const __m256i *)(fat + i + 16));
+		/* Packing works per 128-bit lane, put the quadwords back in order */
+		__m256i eq = _mm256_packs_epi16(_mm256_cmpeq_epi16(lo, zero),
+						_mm256_cmpeq_epi16(hi, zero));
+		eq = _mm256_permute4x64_epi64(eq, 0xD8);
+		uint32_t mask = (uint32_t)_mm256_movemask_epi8(eq);
+
+		found = run_in_mask(mask, 32, i, &cur, run);
+		if (found != SIZE_MAX)
+			return found;
+	}
+
+	return find_free_run_scalar(fat, n, i - cur, run);
+}
+
+/* One bit per 32-bit entry of @v that is 0 */
+__attribute__((target("avx2")))
+static inline uint32_t zero_mask32_avx2(const uint32_t *fat)
+{
+	__m256i v = _mm256_loadu_si256((const __m256i *)fat);
+	__m256i eq = _mm256_cmpeq_epi32(v, _mm256_setzero_si256());
+
+	return (uint32_t)_mm256_movemask_ps(_mm256_castsi256_ps(eq));
+}
+
+__attribute__((target("avx2")))
+static size_t count_free32_avx2(const uint32_t *fat, size_t n)
+{
+	size_t count = 0, i = 0;
+
+	for (; i + 8 <= n; i += 8)
+		count += __builtin_popcount(zero_mask32_avx2(fat + i));
+
+	return count + count_free32_sse2(fat + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t find_free32_avx2(const uint32_t *fat, size_t n, size_t start)
+{
+	size_t i = start;
+
+	for (; i + 8 <= n; i += 8) {
+		uint32_t mask = zero_mask32_avx2(fat + i);
+		if (mask)
+			return i + __builtin_ctz(mask);
+	}
+
+	return find_free32_sse2(fat, n, i);
+}
+
+__attribute__((target("avx2")))
+static size_t find_free_run32_avx2(const uint32_t *fat, size_t n, size_t start,
+				   size_t run)
+{
+	size_t cur = 0, i = start, found;
+
+	for (; i + 32 <= n; i += 32) {
+		uint32_t mask = zero_mask32_avx2(fat + i) |
+				zero_mask32_avx2(fat + i + 8) << 8 |
+				zero_mask32_avx2(fat + i + 16) << 16 |
+				zero_mask32_avx2(fat + i + 24) << 24;
+
+		found = run_in_mask(mask, 32, i, &cur, run);
+		if (found != SIZE_MAX)
+			return found;
+	}
+
+	return find_free_run32_scalar(fat, n, i - cur, run);
+}
+
+#endif /* FAT_SCAN_X86 */
+
+/* Runtime dispatch */
+
+static struct {
+	enum fat_scan_isa isa;
+	size_t (*count_free)(const uint16_t *, size_t);
+	size_t (*find_free)(const uint16_t *, size_t, size_t);
+	size_t (*find_free_run)(const uint16_t *, size_t, size_t, size_t);
+	size_t (*count_free32)(const uint32_t *, size_t);
+	size_t (*find_free32)(const uint32_t *, size_t, size_t);
+	size_t (*find_free_run32)(const uint32_t *, size_t, size_t, size_t);
+} impl;
+
+static int isa_supported(enum fat_scan_isa isa)
+{
+	switch (isa) {
+	case FAT_SCAN_SCALAR:
+		return 1;
+#ifdef FAT_SCAN_X86
+	case FAT_SCAN_SSE2:
+		return __builtin_cpu_supports("sse2");
+	case FAT_SCAN_AVX2:
+		return __builtin_cpu_supports("avx2");
+#endif
+	default:
+		return 0;
+	}
+}
+
+int fat_scan_select(enum fat_scan_isa isa)
+{
+	if (!isa_supported(isa))
+		return -1;
+
+	switch (isa) {
+#ifdef FAT_SCAN_X86
+	case FAT_SCAN_AVX2:
+		impl.count_free = count_free_avx2;
+		impl.find_free = find_free_avx2;
+		impl.find_free_run = find_free_run_avx2;
+		impl.count_free32 = count_free32_avx2;
+		impl.find_free32 = find_free32_avx2;
+		impl.find_free_run32 = find_free_run32_avx2;
+		break;
+	case FAT_SCAN_SSE2:
+		impl.count_free = count_free_sse2;
+		impl.find_free = find_free_sse2;
+		impl.find_free_run = find_free_run_sse2;
+		impl.count_free32 = count_free32_sse2;
+		impl.find_free32 = find_free32_sse2;
+		impl.find_free_run32 = find_free_run32_sse2;
+		break;
+#endif
+	default:
+		impl.count_free = count_free_scalar;
+		impl.find_free = find_free_scalar;
+		impl.find_free_run = find_free_run_scalar;
+		impl.count_free32 = count_free32_scalar;
+		impl.find_free32 = find_free32_scalar;
+		impl.find_free_run32 = find_free_run32_scalar;
+		break;
+	}
+	impl.isa = isa;
+
+	return 0;
+}
+
+/* Pick the best implementation the CPU supports on first use */
+static void fat_scan_init(void)
+{
+	if (impl.count_free)
+		return;
+
+	if (fat_scan_select(FAT_SCAN_AVX2) && fat_scan_select(FAT_SCAN_SSE2))
+		fat_scan_select(FAT_SCAN_SCALAR);
+}
+
+const char *fat_scan_isa_name(void)
+{
+	static const char *names[] = {
+		[FAT_SCAN_SCALAR] = "scalar",
+		[FAT_SCAN_SSE2] = "sse2",
+		[FAT_SCAN_AVX2] = "avx2",
+	};
+
+	fat_scan_init();
+	return names[impl.isa];
+}
+
+size_t fat_count_free(const uint16_t *fat, size_t n)
+{
+	fat_scan_init();
+	return impl.count_free(fat, n);
+}
+
+size_t fat_find_free(const uint16_t *fat, size_t n, size_t start)
+{
+	fat_scan_init();
+	if (start >= n)
+		return n;
+	return impl.find_free(fat, n, start);
+}
+
+size_t fat_find_free_run(const uint16_t *fat, size_t n, size_t start,
+			 size_t run)
+{
+	fat_scan_init();
+	if (start >= n)
+		return n;
+	if (run <= 1)
+		return impl.find_free(fat, n, start);
+	return impl.find_free_run(fat, n, start, run);
+}
+
+size_t fat32_count_free(const uint32_t *fat, size_t n)
+{
+	fat_scan_init();
+	return impl.count_free32(fat, n);
+}
+
+size_t fat32_find_free(const uint32_t *fat, size_t n, size_t start)
+{
+	fat_scan_init();
+	if (start >= n)
+		return n;
+	return impl.find_free32(fat, n, start);
+}
+
+size_t fat32_find_free_run(const uint32_t *fat, size_t n, size_t start,
+			   size_t run)
+{
+	fat_scan_init();
+	if (start >= n)
+		return n;
+	if (run <= 1)
+		return impl.find_free32(fat, n, start);
+	return impl.find_free_run32(fat, n, start, run);
+}
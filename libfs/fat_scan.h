@@ -0,0 +1,74 @@
+#ifndef _FAT_SCAN_H
+#define _FAT_SCAN_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/** Instruction sets the FAT scanning kernels can be built for */
+enum fat_scan_isa {
+	FAT_SCAN_SCALAR,
+	FAT_SCAN_SSE2,
+	FAT_SCAN_AVX2,
+};
+
+/**
+ * fat_count_free - Count free FAT entries
+ * @fat: Array of FAT entries
+ * @n: Number of entries in @fat
+ *
+ * Return: the number of entries of @fat that are 0.
+ */
+size_t fat_count_free(const uint16_t *fat, size_t n);
+
+/**
+ * fat_find_free - Find the first free FAT entry
+ * @fat: Array of FAT entries
+ * @n: Number of entries in @fat
+ * @start: Index to start looking from
+ *
+ * Return: the index of the first entry of @fat at or after @start that is 0,
+ * or @n if there is none.
+ */
+size_t fat_find_free(const uint16_t *fat, size_t n, size_t start);
+
+/**
+ * fat_find_free_run - Find a run of free FAT entries
+ * @fat: Array of FAT entries
+ * @n: Number of entries in @fat
+ * @start: Index to start looking from
+ * @run: Number of consecutive free entries to look for
+ *
+ * Return: the index of the first entry of the first run of @run consecutive
+ * entries that are 0 and start at or after @start, or @n if there is none.
+ */
+size_t fat_find_free_run(const uint16_t *fat, size_t n, size_t start,
+			 size_t run);
+
+/*
+ * Same kernels for FATs with 32-bit entries
+ */
+size_t fat32_count_free(const uint32_t *fat, size_t n);
+size_t fat32_find_free(const uint32_t *fat, size_t n, size_t start);
+size_t fat32_find_free_run(const uint32_t *fat, size_t n, size_t start,
+			   size_t run);
+
+/**
+ * fat_scan_select - Select the instruction set used by the kernels
+ * @isa: Instruction set to use
+ *
+ * The kernels pick the best instruction set supported by the CPU the first
+ * time they are called. This function overrides that choice, which is mostly
+ * useful to compare implementations against each other.
+ *
+ * Return: -1 if @isa is not supported by the CPU. 0 otherwise.
+ */
+int fat_scan_select(enum fat_scan_isa isa);
+
+/**
+ * fat_scan_isa_name - Get the name of the selected instruction set
+ *
+ * Return: a static string naming the instruction set currently used.
+ */
+const char *fat_scan_isa_name(void);
+
+#endif /* _FAT_SCAN_H */
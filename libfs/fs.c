@@ -1,14 +1,100 @@
 #include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
 #include <string.h>
 
+#include "dir_scan.h"
 #include "disk.h"
+#include "fat_scan.h"
+#include "crc32c.h"
 #include "fs.h"
+#include "fs_trace.h"
+#include "lz.h"
+#include "stats.h"
 
-// keeps track of whether fs is mounted or not
-static int fs_mounted = 0;
+// Largest number of FAT blocks of a v1 file system, enough for 65536 16-bit
+// entries
+#define FAT_MAX_BLK_COUNT 32
+
+// Largest number of data blocks of a v2 file system. FAT values with the top
+// bit set are reserved.
+#define V2_MAX_DATA_BLK_COUNT 0x7FFFFFFF
+
+// Largest size of a v2 file, which fs_stat() must be able to return
+#define V2_MAX_FILE_SIZE 0x7FFFFFFF
+
+// End of chain marker, whatever the size of FAT entries
+#define FAT_EOC 0xFFFFFFFF
+
+// FAT value of the blocks of mapped files, which may be shared. The low bits
+// count the references to the block, and an end of chain marker counts as one
+// reference. Map blocks are told apart from data blocks by FAT_REF_MAP.
+#define FAT_REF 0x80000000
+#define FAT_REF_MAP 0x40000000
+#define FAT_REF_COUNT 0x3FFFFFFF
+#define FAT_REF_MAX (FAT_REF_COUNT - 1)
+
+// Directory entries, 128 per directory block
+#define ENTRY_SIZE 32
+#define ENTRIES_PER_BLK (BLOCK_SIZE / ENTRY_SIZE)
+
+// Features of v2 file systems
+#define FEATURE_HASHED_DIR 0x1 // The root directory is a hash table
+#define FEATURE_SUBDIRS 0x2 // Directory entries may be subdirectories
+#define FEATURE_INLINE_DATA 0x4 // Directory blocks may hold file data
+#define FEATURE_MAPPED_FILES 0x8 // Files may list their blocks in a map
+#define FEATURE_SHARED_BLOCKS 0x10 // Data blocks may be shared between files
+#define FEATURE_CHECKSUMS 0x20 // A checksum table follows the FAT
+#define FEATURES_KNOWN (FEATURE_HASHED_DIR | FEATURE_SUBDIRS | \
+	FEATURE_INLINE_DATA | FEATURE_MAPPED_FILES | FEATURE_SHARED_BLOCKS | \
+	FEATURE_CHECKSUMS)
+
+// Checksum table entries, one CRC32C per data block. 0 stands for a block
+// whose checksum is unknown, so checksums that come out as 0 are stored as 1.
+#define CSUM_PER_BLK (BLOCK_SIZE / sizeof(u_int32_t))
+
+// Largest number of consecutive data blocks read or written at once, straight
+// from or to the caller's buffer
+#define IO_RUN_MAX 256
+
+// Directories are designated by the index of their first data block, except
+// for the root directory. Data block 0 is reserved, so it cannot be the first
+// block of a directory.
+#define ROOT_DIR 0
+
+// Flags of directory entries, v2 only
+#define ENTRY_DIR 0x1 // The entry is a subdirectory
+#define ENTRY_INLINE 0x2 // The file's data is in its directory block
+#define ENTRY_MAPPED 0x4 // The file's blocks are listed in a map
+#define ENTRY_COMPRESSED 0x8 // The file's data is compressed, implies mapped
+#define ENTRY_DEDUP 0x10 // The file's blocks are deduplicated, implies mapped
+
+// Files of up to INLINE_MAX bytes are kept in the directory slots that follow
+// their entry, whose number is stored in byte 25 of the entry. Each of these
+// slots starts with INLINE_MARK, so that it is neither free nor taken for an
+// entry, and holds INLINE_SLOT_DATA bytes of data.
+#define INLINE_MARK 0xFF
+#define INLINE_SLOT_DATA (ENTRY_SIZE - 1)
+#define INLINE_MAX_SLOTS 4
+#define INLINE_MAX (INLINE_MAX_SLOTS * INLINE_SLOT_DATA)
+
+// Mapped files list their data blocks in a two-level map instead of chaining
+// them in the FAT. The first block of their entry is the root map block, which
+// holds the data blocks of up to MAP_ENTRIES leaf map blocks, each listing
+// MAP_ENTRIES consecutive blocks of the file. Map slots of 0 stand for blocks
+// that were never written, which read as zeros.
+#define MAP_ENTRIES (BLOCK_SIZE / sizeof(u_int32_t))
+
+// Compressed files are mapped files written in chunks of CHUNK_BLOCKS blocks.
+// A chunk that compresses well takes fewer blocks: the first of them has
+// MAP_COMPRESSED set in its map slot and starts with the compressed size.
+#define CHUNK_BLOCKS 16
+#define CHUNK_SIZE (CHUNK_BLOCKS * BLOCK_SIZE)
+#define MAP_COMPRESSED 0x80000000
+#define MAP_BLK(slot) ((slot) & ~MAP_COMPRESSED)
 
 struct superblock{
 	char signature[8];
@@ -20,449 +106,3372 @@ struct superblock{
 	u_int8_t padding[4079];
 };
 
+// Superblock of v2 file systems, which use 32-bit block numbers and FAT
+// entries, and a root directory that spans rdir_blk_count blocks. Its v1
+// total_blk_count field is always 0, so that v1 implementations reject it.
+struct superblock_v2{
+	char signature[8];
+	u_int16_t v1_total_blk_count;
+	u_int16_t version;
+	u_int32_t total_blk_count;
+	u_int32_t fat_blk_count;
+	u_int32_t rdir_blk;
+	u_int32_t rdir_blk_count;
+	u_int32_t data_blk;
+	u_int32_t data_blk_count;
+	u_int32_t features;
+	u_int8_t padding[4056];
+};
+
+_Static_assert(sizeof(struct superblock_v2) == BLOCK_SIZE, "bad superblock size");
+
+#define SUMMARY_MAGIC 0x4D555346 // "FSUM"
+#define SUMMARY_VERSION 2
+
+// Offset of the summary in the padding of the v2 superblock, and largest number
+// of per-FAT-block counts it can hold
+#define SUMMARY_OFFSET 40
+#define SUMMARY_MAX 1536
+
+// Free space summary, kept in the superblock padding and followed by the free
+// entry count of each FAT block (16 bits each). It is written with clean set at
+// fs_umount() so that the next fs_mount() can skip scanning the FAT, and
+// cleared again at mount so that a crash forces a full scan. Only v2 file
+// systems have one: other ECS150FS implementations write v1 images without
+// touching the summary, which would then look clean but be stale.
+struct summary{
+	u_int32_t magic;
+	u_int8_t version;
+	u_int8_t clean;
+	u_int16_t fat_blk_count;
+	u_int32_t rdir_free;
+	u_int32_t fat_free;
+};
+
 struct file_descriptor{
 	int used;
 	size_t offset;
+	// Location of the file's directory entry
+	u_int32_t rootBlk;
 	int rootIndex;
+	// Hints given with fs_advise(): FS_ADVICE_NORMAL, FS_ADVICE_SEQUENTIAL
+	// or FS_ADVICE_RANDOM, and whether FS_ADVICE_NOREUSE was given since
+	int advice;
+	int noreuse;
+	// File block up to which the file was read ahead
+	u_int32_t readahead;
 };
 
-static struct superblock infoSuperblock;
+// Cached result of a directory lookup
+struct dentry{
+	int valid;
+	u_int32_t parent;
+	char name[FS_FILENAME_LEN];
+	// Location of the entry
+	u_int32_t blk;
+	int index;
+	// Flags and first data block of the entry. The first block of a file
+	// changes as it is written, so it is only kept for directories.
+	u_int8_t flags;
+	u_int32_t first;
+};
 
-static struct file_descriptor fds[FS_OPEN_MAX_COUNT];
+// Number of dentry cache slots
+#define DCACHE_SIZE 1024
 
+// Fingerprint of a data block of a deduplicated file
+struct dedup_slot{
+	u_int64_t hash;
+	u_int32_t blk; // 0 if the slot is free
+};
 
-// Helper function, it gets the next block's index as the name suggests
-uint16_t get_next_block(uint16_t index) {
-    uint8_t fat_block[BLOCK_SIZE];
+// Number of dedup index slots
+#define DEDUP_INDEX_SIZE 65536
 
-    int fat_block_num = index / 2048;
-    int fat_offset = (index % 2048) * 2;
+// Data blocks held in memory for fs_advise(). Data block blk can only be held
+// in one of the BUF_WAYS slots of set blk % BUF_SETS.
+#define BUF_SETS 64
+#define BUF_WAYS 8
+#define BUF_SLOTS (BUF_SETS * BUF_WAYS)
 
-    if (block_read(1 + fat_block_num, fat_block) == -1) {
-        return 0xFFFF; // Error, indicating EOF
-	}
+// Number of blocks read ahead of the file offset of a sequential reader, and
+// largest number of blocks read at a time by the prefetch thread
+#define READAHEAD_BLOCKS 64
+#define PREFETCH_RUN 32
 
-    uint16_t value;
-    memcpy(&value, &fat_block[fat_offset], sizeof(uint16_t));
-    return value;
-}
+enum buf_state{
+	BUF_FREE,
+	BUF_LOADING, // Being read by the prefetch thread
+	BUF_STALE, // Being read, but written or dropped since
+	BUF_VALID,
+};
 
-// Helper function, it sets the FAT index with value(next FAT entry)
-void set_fat_entry(uint16_t index, uint16_t value) {
-    uint8_t fat_block[BLOCK_SIZE];
+struct buf_slot{
+	u_int32_t blk;
+	u_int8_t state;
+	u_int8_t referenced;
+	u_int8_t once; // Dropped once read
+};
 
-    int fat_block_num = index / 2048;
-    int fat_offset = (index % 2048) * 2;
+// State of one mounted file system
+struct fs_instance{
+	// Serializes the calls made on the file system, see lock_fs()
+	pthread_mutex_t lock;
 
-    // Read the correct FAT block
-    if (block_read(1 + fat_block_num, fat_block) == -1) {
-        return;
-	}
+	// keeps track of whether fs is mounted or not
+	int mounted;
 
-    // Update the FAT entry
-    memcpy(&fat_block[fat_offset], &value, sizeof(uint16_t));
+	struct disk *disk;
+	union {
+		struct superblock v1;
+		struct superblock_v2 v2;
+		char raw[BLOCK_SIZE];
+	} sb;
+	struct file_descriptor fds[FS_OPEN_MAX_COUNT];
 
-    // Write it back to disk
-    block_write(1 + fat_block_num, fat_block);
-}
+	// Layout, whatever the version of the file system
+	int version;
+	u_int32_t total_blk_count;
+	u_int32_t fat_blk_count;
+	u_int32_t rdir_blk;
+	u_int32_t rdir_blk_count;
+	u_int32_t data_blk;
+	u_int32_t data_blk_count;
+	u_int32_t fat_per_blk;
 
-int fs_mount(const char *diskname)
+	// With a hashed root directory, each root directory block is the head of
+	// a bucket, chained to overflow blocks taken from the data blocks
+	int dir_hashed;
+
+	// Checksum table, csum_blk_count blocks (0 without checksums) between
+	// the FAT and the root directory. Its blocks are loaded on first use and
+	// the modified ones are written back by csum_flush().
+	u_int32_t csum_blk;
+	u_int32_t csum_blk_count;
+	u_int32_t **csum_cache;
+	u_int64_t *csum_dirty;
+
+	// Free data blocks and free root directory entries, counted at mount and
+	// kept up to date by set_fat_entry(), fs_create() and fs_delete(). The
+	// directory count is -1 until the root directory is counted.
+	int free_blk_count;
+	int free_rdir_count;
+
+	// Free entries in each FAT block, so that allocate_block() can skip full
+	// ones. A count is -1 until the FAT block is first loaded, and
+	// free_blk_count only covers the FAT blocks whose count is known.
+	int *fat_free;
+	u_int32_t fat_unknown;
+
+	// FAT blocks cached in memory. They are loaded on first use and written
+	// through on every update, so any of them can be dropped at any time.
+	void **fat_cache;
+
+	// Resident and recently used FAT blocks, one bit per FAT block
+	u_int64_t *fat_resident;
+	u_int64_t *fat_referenced;
+	u_int32_t fat_resident_count;
+
+	// Largest number of resident FAT blocks (0 for no limit), and clock hand
+	// used to pick the FAT block to drop when the limit is reached
+	u_int32_t fat_cache_max;
+	u_int32_t fat_clock_hand;
+
+	// Directory lookups, indexed by a hash of the parent and the name, so
+	// that resolving a path again does not read any directory block
+	struct dentry dcache[DCACHE_SIZE];
+
+	// Last chunk decompressed by fs_read(), identified by the root map block
+	// of its file (FAT_EOC if there is none) and its index in the file
+	struct {
+		u_int32_t root;
+		u_int32_t chunk;
+		char *data;
+	} zcache;
+
+	// Blocks written or read through deduplicated files, indexed by their
+	// fingerprint and allocated on first use. Slots are only hints, the
+	// block is compared with the data before it is shared.
+	struct dedup_slot *dedup;
+
+	// Data blocks held in memory for fs_advise(), and the thread that reads
+	// them in the background. The thread only takes buf.lock, which is
+	// taken after lock, and the blocks and the thread are set up on first
+	// use. Blocks to read are queued with their slot taken, and loaded is
+	// signaled whenever blocks are read.
+	struct {
+		pthread_mutex_t lock;
+		pthread_cond_t cond;
+		pthread_cond_t loaded;
+		pthread_t thread;
+		int running;
+		int stop;
+		struct buf_slot slot[BUF_SLOTS];
+		char *data;
+		u_int32_t count; // Slots that are not free
+		u_int32_t queue[BUF_SLOTS];
+		u_int32_t queue_head;
+		u_int32_t queue_len;
+	} buf;
+};
+
+// Instance used by the fs_*() functions that do not take a handle
+static struct fs_instance default_fs = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.buf = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.cond = PTHREAD_COND_INITIALIZER,
+		.loaded = PTHREAD_COND_INITIALIZER,
+	},
+};
+
+#define BIT_TEST(map, i) ((map)[(i) / 64] & (1ULL << ((i) % 64)))
+#define BIT_SET(map, i) ((map)[(i) / 64] |= 1ULL << ((i) % 64))
+#define BIT_CLEAR(map, i) ((map)[(i) / 64] &= ~(1ULL << ((i) % 64)))
+
+// Helper function, it returns the slot holding data block blk in memory, or
+// NULL if there is none. buf.lock must be held.
+static struct buf_slot *buf_find(struct fs_instance *fs, u_int32_t blk)
 {
-	if (block_disk_open(diskname) == -1){
-		return -1;
+	struct buf_slot *set = &fs->buf.slot[blk % BUF_SETS * BUF_WAYS];
+	for (int i = 0; i < BUF_WAYS; i++){
+		if (set[i].state != BUF_FREE && set[i].blk == blk){
+			return &set[i];
+		}
 	}
-	char buf[4096];
+	return NULL;
+}
 
-	if (block_read(0, buf) == -1){
-		block_disk_close();
-		return -1;
+// Helper function, it drops the copies held in memory of the n blocks of the
+// disk from blk on. The ones being read are dropped once read.
+static void buf_forget(struct fs_instance *fs, u_int32_t blk, size_t n)
+{
+	if (__atomic_load_n(&fs->buf.count, __ATOMIC_RELAXED) == 0 ||
+		blk + n <= fs->data_blk){
+		return;
 	}
-	memcpy(&infoSuperblock, buf, sizeof(struct superblock));
 
-	if (strncmp(infoSuperblock.signature, "ECS150FS", 8) != 0){
-		block_disk_close();
-		return -1;
+	pthread_mutex_lock(&fs->buf.lock);
+	for (size_t i = 0; i < n; i++){
+		if (blk + i < fs->data_blk){
+			continue;
+		}
+		struct buf_slot *s = buf_find(fs, blk + i - fs->data_blk);
+		if (s == NULL){
+			continue;
+		}
+		if (s->state == BUF_LOADING){
+			s->state = BUF_STALE;
+		} else if (s->state == BUF_VALID){
+			s->state = BUF_FREE;
+			fs->buf.count--;
+		}
 	}
+	pthread_mutex_unlock(&fs->buf.lock);
+}
 
-	if (infoSuperblock.total_blk_count != block_disk_count()){
-		block_disk_close();
-		return -1;
-	}
+// Helper functions, they read or write blocks of fs, and count them as blocks
+// of the given kind (FS_STATS_*) for fs_get_stats(), which also tags the
+// transfer for block I/O tracing
+static int read_block(struct fs_instance *fs, int kind, u_int32_t blk,
+	void *buf)
+{
+	stats_blocks(kind, 0, 1);
+	block_trace_tag(kind);
+	return block_read_h(fs->disk, blk, buf);
+}
 
-	for (int i = 0; i < FS_OPEN_MAX_COUNT; i ++){
-		fds[i].used = 0;
-		fds[i].offset = 0;
-		fds[i].rootIndex = 0;
-	}
-	fs_mounted = 1;
-	return 0;
+static int write_block(struct fs_instance *fs, int kind, u_int32_t blk,
+	const void *buf)
+{
+	stats_blocks(kind, 1, 1);
+	buf_forget(fs, blk, 1);
+	block_trace_tag(kind);
+	return block_write_h(fs->disk, blk, buf);
 }
 
-int fs_umount(void)
-{	
-	int stat = block_disk_close();
-	if (stat == 0){
-		fs_mounted = 0;
-	}
-	return stat;
+static int read_blocks(struct fs_instance *fs, int kind, u_int32_t blk,
+	size_t count, void *buf)
+{
+	stats_blocks(kind, 0, count);
+	block_trace_tag(kind);
+	return block_read_many_h(fs->disk, blk, count, buf);
 }
 
-int fs_info(void)
+static int write_blocks(struct fs_instance *fs, int kind, u_int32_t blk,
+	size_t count, const void *buf)
 {
-	if (block_disk_count() == -1){
-		return -1;
+	stats_blocks(kind, 1, count);
+	buf_forget(fs, blk, count);
+	block_trace_tag(kind);
+	return block_write_many_h(fs->disk, blk, count, buf);
+}
+
+// Helper function, it copies data block blk to buf if it is held in memory,
+// waiting for it if it is being read. Returns -1 if it is not.
+static int buf_get(struct fs_instance *fs, u_int32_t blk, void *buf)
+{
+	int ret = -1;
+	struct buf_slot *s;
+
+	pthread_mutex_lock(&fs->buf.lock);
+	while ((s = buf_find(fs, blk)) != NULL && s->state == BUF_LOADING){
+		pthread_cond_wait(&fs->buf.loaded, &fs->buf.lock);
+	}
+	if (s != NULL && s->state == BUF_VALID){
+		memcpy(buf, fs->buf.data + (s - fs->buf.slot) * BLOCK_SIZE,
+			BLOCK_SIZE);
+		s->referenced = 1;
+		if (s->once){
+			s->state = BUF_FREE;
+			fs->buf.count--;
+		}
+		ret = 0;
 	}
+	pthread_mutex_unlock(&fs->buf.lock);
+	return ret;
+}
 
+// Helper function, it reads the n data blocks from blk on, taking the ones held
+// in memory from there
+static int data_fetch(struct fs_instance *fs, u_int32_t blk, size_t n,
+	void *buf)
+{
+	if (__atomic_load_n(&fs->buf.count, __ATOMIC_RELAXED) == 0){
+		return read_blocks(fs, FS_STATS_DATA, fs->data_blk + blk, n, buf);
+	}
 
-	int freeFat = 0;
-	int totalEntries = infoSuperblock.data_blk_count;
-	for (int i = 0; i < infoSuperblock.fat_blk_count; i++){
-		char buf[4096];
-		if (block_read(i + 1, buf) == -1){
+	// The blocks that are not in memory are read a run at a time
+	size_t i = 0;
+	while (i < n){
+		size_t j = i;
+		while (j < n && buf_get(fs, blk + j, (char *)buf + j * BLOCK_SIZE) == -1){
+			j++;
+		}
+		if (j > i && read_blocks(fs, FS_STATS_DATA, fs->data_blk + blk + i,
+			j - i, (char *)buf + i * BLOCK_SIZE) == -1){
 			return -1;
 		}
+		i = j + 1;
+	}
+	return 0;
+}
 
-		u_int16_t *entriesFat = (u_int16_t *)buf;
-		for (int j = 0; j < 2048; j++){
-			if (j >= totalEntries){
-				break;
+// Prefetch thread, it reads the queued blocks into their slots, consecutive
+// blocks at once. It leaves lock alone, so that it never waits for a call.
+static void *buf_thread(void *arg)
+{
+	struct fs_instance *fs = arg;
+	char *run = malloc(PREFETCH_RUN * BLOCK_SIZE);
+
+	pthread_mutex_lock(&fs->buf.lock);
+	while (!fs->buf.stop){
+		if (fs->buf.queue_len == 0){
+			pthread_cond_wait(&fs->buf.cond, &fs->buf.lock);
+			continue;
+		}
+
+		u_int32_t blk = fs->buf.queue[fs->buf.queue_head], n = 0;
+		while (n < PREFETCH_RUN && fs->buf.queue_len > 0 &&
+			fs->buf.queue[fs->buf.queue_head] == blk + n){
+			fs->buf.queue_head = (fs->buf.queue_head + 1) % BUF_SLOTS;
+			fs->buf.queue_len--;
+			n++;
+		}
+
+		pthread_mutex_unlock(&fs->buf.lock);
+		int ret = run == NULL ? -1 :
+			read_blocks(fs, FS_STATS_DATA, fs->data_blk + blk, n, run);
+		pthread_mutex_lock(&fs->buf.lock);
+
+		for (u_int32_t i = 0; i < n; i++){
+			struct buf_slot *s = buf_find(fs, blk + i);
+			if (s == NULL){
+				continue;
 			}
-			if (entriesFat[j] == 0){
-				freeFat += 1;
+			if (s->state == BUF_LOADING && ret == 0){
+				memcpy(fs->buf.data + (s - fs->buf.slot) * BLOCK_SIZE,
+					run + i * BLOCK_SIZE, BLOCK_SIZE);
+				s->state = BUF_VALID;
+			} else {
+				s->state = BUF_FREE;
+				fs->buf.count--;
 			}
 		}
-		totalEntries -= 2048;
+		pthread_cond_broadcast(&fs->buf.loaded);
 	}
+	pthread_mutex_unlock(&fs->buf.lock);
 
-	int freeRdir = 0;
-	char buf[4096];
-	if (block_read(infoSuperblock.rdir_blk, buf) == -1){
-		return -1;
+	free(run);
+	return NULL;
+}
+
+// Helper function, it sets up the memory holding data blocks and starts the
+// prefetch thread, if that is not done yet
+static int buf_start(struct fs_instance *fs)
+{
+	if (fs->buf.data == NULL){
+		fs->buf.data = malloc((size_t)BUF_SLOTS * BLOCK_SIZE);
+		if (fs->buf.data == NULL){
+			return -1;
+		}
 	}
-	for (int i = 0; i < 128; i++){
-		if (buf[i*32] == '\0'){
-			freeRdir += 1;
+	if (!fs->buf.running){
+		fs->buf.stop = 0;
+		if (pthread_create(&fs->buf.thread, NULL, buf_thread, fs) != 0){
+			return -1;
 		}
+		fs->buf.running = 1;
 	}
+	return 0;
+}
 
+// Helper function, it stops the prefetch thread and drops every block held in
+// memory
+static void buf_stop(struct fs_instance *fs)
+{
+	if (fs->buf.running){
+		pthread_mutex_lock(&fs->buf.lock);
+		fs->buf.stop = 1;
+		pthread_cond_signal(&fs->buf.cond);
+		pthread_mutex_unlock(&fs->buf.lock);
+		pthread_join(fs->buf.thread, NULL);
+		fs->buf.running = 0;
+	}
 
-	printf("FS Info:\n");
-	printf("total_blk_count=%d\n", infoSuperblock.total_blk_count);
-	printf("fat_blk_count=%d\n", infoSuperblock.fat_blk_count);
-	printf("rdir_blk=%d\n", infoSuperblock.rdir_blk);
-	printf("data_blk=%d\n", infoSuperblock.data_blk);
-	printf("data_blk_count=%d\n", infoSuperblock.data_blk_count);
-	printf("fat_free_ratio=%d/%d\n", freeFat, infoSuperblock.data_blk_count);     
-	printf("rdir_free_ratio=%d/128\n", freeRdir);
-	return 0;
+	memset(fs->buf.slot, 0, sizeof(fs->buf.slot));
+	fs->buf.count = 0;
+	fs->buf.queue_head = 0;
+	fs->buf.queue_len = 0;
+	free(fs->buf.data);
+	fs->buf.data = NULL;
 }
 
-int fs_create(const char *filename)
+// Helper function, it takes a slot for data block blk in its set, preferring
+// a free one, then one not read since the last time slots of the set were
+// taken. Returns NULL if every slot of the set is being read. buf.lock must be
+// held.
+static struct buf_slot *buf_take(struct fs_instance *fs, u_int32_t blk)
 {
-	if (!fs_mounted || filename == NULL || strlen(filename) >= FS_FILENAME_LEN){
-		return -1;
+	struct buf_slot *set = &fs->buf.slot[blk % BUF_SETS * BUF_WAYS];
+	struct buf_slot *victim = NULL;
+
+	for (int i = 0; i < BUF_WAYS; i++){
+		if (set[i].state == BUF_FREE){
+			fs->buf.count++;
+			return &set[i];
+		}
+		if (set[i].state == BUF_VALID && (victim == NULL ||
+			(victim->referenced && !set[i].referenced))){
+			victim = &set[i];
+		}
 	}
+	for (int i = 0; i < BUF_WAYS; i++){
+		set[i].referenced = 0;
+	}
+	return victim;
+}
 
-	char buf[4096];
-	if (block_read(infoSuperblock.rdir_blk, buf) == -1){
+// Helper function, it queues the n data blocks from blk on to be read into
+// memory, dropped once read if once is set. Blocks already in memory, or whose
+// set is busy, are left alone.
+static int buf_queue(struct fs_instance *fs, u_int32_t blk, u_int32_t n,
+	int once)
+{
+	if (buf_start(fs) == -1){
 		return -1;
 	}
 
-	// Check to see that file does not already exist.
-	for (int i = 0; i < 128; i++){
-		if (buf[i*32] != '\0'){
-			int index = i*32;
-			int match = 1;
-			
-			for (size_t j = 0; j < strlen(filename); j++){
-				if (buf[index + j] != filename[j]){
-					match = 0;
-					break;
-				}
-			}
-
-			if (match && buf[index + strlen(filename)] == '\0'){
-				return -1; 
-			}
+	pthread_mutex_lock(&fs->buf.lock);
+	for (u_int32_t i = 0; i < n && fs->buf.queue_len < BUF_SLOTS; i++){
+		struct buf_slot *s = buf_find(fs, blk + i);
+		if (s != NULL){
+			s->once = s->once && once;
+			continue;
+		}
+		if ((s = buf_take(fs, blk + i)) == NULL){
+			continue;
 		}
-	}
 
-	for (int i = 0; i < 128; i++){
-		if (buf[i*32] == '\0'){
-			int index = i*32;
-			for (size_t j = 0; j < strlen(filename); j++){
-				buf[index + j] = filename[j];
-			}
-			buf[index + strlen(filename)] = '\0';
+		s->blk = blk + i;
+		s->state = BUF_LOADING;
+		s->referenced = 1;
+		s->once = once;
+		fs->buf.queue[(fs->buf.queue_head + fs->buf.queue_len) % BUF_SLOTS] =
+			blk + i;
+		fs->buf.queue_len++;
+	}
+	pthread_cond_signal(&fs->buf.cond);
+	pthread_mutex_unlock(&fs->buf.lock);
+	return 0;
+}
 
-			buf[index + 16] = 0;
-			buf[index + 17] = 0;
-			buf[index + 18] = 0;
-			buf[index + 19] = 0;
+// Helper function, it returns the number of entries in FAT block i
+static int fat_blk_entries(struct fs_instance *fs, u_int32_t i)
+{
+	u_int32_t entries = fs->data_blk_count - i * fs->fat_per_blk;
+	return entries < fs->fat_per_blk ? entries : fs->fat_per_blk;
+}
 
-			u_int16_t data_blk = 0xFFFF;
-			memcpy(&buf[index + 20],&data_blk, sizeof(u_int16_t));
+// Helper function, it drops FAT block i from the cache
+static void fat_drop(struct fs_instance *fs, u_int32_t i)
+{
+	free(fs->fat_cache[i]);
+	fs->fat_cache[i] = NULL;
+	BIT_CLEAR(fs->fat_resident, i);
+	BIT_CLEAR(fs->fat_referenced, i);
+	fs->fat_resident_count -= 1;
+}
 
-			return block_write(infoSuperblock.rdir_blk, buf);
+// Helper function, it drops every cached FAT block and frees the cache
+static void fat_release(struct fs_instance *fs)
+{
+	if (fs->fat_cache != NULL){
+		for (u_int32_t i = 0; i < fs->fat_blk_count; i++){
+			if (BIT_TEST(fs->fat_resident, i)){
+				fat_drop(fs, i);
+			}
 		}
 	}
 
-	return -1; // Root directory already contains max number of files.
+	free(fs->fat_cache);
+	free(fs->fat_free);
+	free(fs->fat_resident);
+	free(fs->fat_referenced);
+	fs->fat_cache = NULL;
+	fs->fat_free = NULL;
+	fs->fat_resident = NULL;
+	fs->fat_referenced = NULL;
+	fs->fat_clock_hand = 0;
 }
 
-int fs_delete(const char *filename)
+// Helper function, it allocates the FAT cache, with every count unknown
+static int fat_init(struct fs_instance *fs, u_int32_t cache_max)
 {
-	if (!fs_mounted || filename == NULL || strlen(filename) >= FS_FILENAME_LEN){
+	size_t words = (fs->fat_blk_count + 63) / 64;
+
+	fs->fat_cache = calloc(fs->fat_blk_count, sizeof(void *));
+	fs->fat_free = malloc(fs->fat_blk_count * sizeof(int));
+	fs->fat_resident = calloc(words, sizeof(u_int64_t));
+	fs->fat_referenced = calloc(words, sizeof(u_int64_t));
+	if (!fs->fat_cache || !fs->fat_free || !fs->fat_resident ||
+		!fs->fat_referenced){
+		fat_release(fs);
 		return -1;
 	}
 
-	char buf[4096];
-	if (block_read(infoSuperblock.rdir_blk, buf) == -1){
-		return -1;
+	for (u_int32_t i = 0; i < fs->fat_blk_count; i++){
+		fs->fat_free[i] = -1;
 	}
+	fs->fat_unknown = fs->fat_blk_count;
+	fs->fat_resident_count = 0;
+	fs->fat_cache_max = cache_max;
+	fs->free_blk_count = 0;
+	return 0;
+}
 
-	for (int i = 0; i < 128; i++){
-		if (buf[i*32] != '\0'){
-			int index = i*32;
-			int match = 1;
-			
-			for (size_t j = 0; j < strlen(filename); j++){
-				if (buf[index + j] != filename[j]){
-					match = 0;
-					break;
-				}
-			}
+// Helper function, it drops the least recently used FAT block (second chance)
+static void fat_evict(struct fs_instance *fs)
+{
+	while (1){
+		u_int32_t i = fs->fat_clock_hand;
+		fs->fat_clock_hand = (fs->fat_clock_hand + 1) % fs->fat_blk_count;
 
-			if (match && buf[index + strlen(filename)] == '\0'){
-				for (int j = 0; j < 16; j++){
-					if(fds[j].rootIndex == index && fds[j].used == 1){
-						return -1; // File is open
-					}
-				}
+		if (!BIT_TEST(fs->fat_resident, i)){
+			continue;
+		}
+		if (BIT_TEST(fs->fat_referenced, i)){
+			BIT_CLEAR(fs->fat_referenced, i);
+			continue;
+		}
+		fat_drop(fs, i);
+		return;
+	}
+}
 
-				u_int16_t current_blk;
-				memcpy(&current_blk, &buf[index + 20], sizeof(u_int16_t));
-				while (current_blk != 0xFFFF){
-					u_int16_t next_blk = get_next_block(current_blk);
-					set_fat_entry(current_blk, 0x0000); 
-					current_blk = next_blk;
-				}		
+// Helper function, it counts the free entries of FAT block i
+static int fat_blk_count_free(struct fs_instance *fs, u_int32_t i, void *blk)
+{
+	if (fs->version == 1){
+		return fat_count_free(blk, fat_blk_entries(fs, i));
+	}
+	return fat32_count_free(blk, fat_blk_entries(fs, i));
+}
 
-				buf[index] = '\0';
+// Helper function, it returns FAT block i, loading it if it is not resident
+static void *fat_block(struct fs_instance *fs, u_int32_t i)
+{
+	if (BIT_TEST(fs->fat_resident, i)){
+		BIT_SET(fs->fat_referenced, i);
+		return fs->fat_cache[i];
+	}
 
-				for (int j = 16; j < 32; j++){
-					buf[index + j] = 0;
-				}
+	if (fs->fat_cache_max && fs->fat_resident_count >= fs->fat_cache_max){
+		fat_evict(fs);
+	}
 
-				return block_write(infoSuperblock.rdir_blk, buf);
-			}
-		}
+	void *blk = malloc(BLOCK_SIZE);
+	if (blk == NULL){
+		return NULL;
+	}
+	if (read_block(fs, FS_STATS_FAT, 1 + i, blk) == -1){
+		free(blk);
+		return NULL;
+	}
+
+	// First time we see this block, count its free entries
+	if (fs->fat_free[i] < 0){
+		fs->fat_free[i] = fat_blk_count_free(fs, i, blk);
+		fs->free_blk_count += fs->fat_free[i];
+		fs->fat_unknown -= 1;
 	}
 
-	return -1; // No file with that name
+	fs->fat_cache[i] = blk;
+	BIT_SET(fs->fat_resident, i);
+	BIT_SET(fs->fat_referenced, i);
+	fs->fat_resident_count += 1;
+	return blk;
 }
 
-int fs_ls(void)
+// Helper function, it frees the checksum table cache
+static void csum_release(struct fs_instance *fs)
 {
-	if (!fs_mounted){
-		return -1;
+	for (u_int32_t i = 0; fs->csum_cache && i < fs->csum_blk_count; i++){
+		free(fs->csum_cache[i]);
 	}
+	free(fs->csum_cache);
+	free(fs->csum_dirty);
+	fs->csum_cache = NULL;
+	fs->csum_dirty = NULL;
+}
 
-	printf("FS Ls:\n");
+// Helper function, it sets up the checksum table cache
+static int csum_init(struct fs_instance *fs)
+{
+	fs->csum_cache = NULL;
+	fs->csum_dirty = NULL;
+	if (fs->csum_blk_count == 0){
+		return 0;
+	}
 
-	char buf[4096];
-	if (block_read(infoSuperblock.rdir_blk, buf) == -1){
+	fs->csum_cache = calloc(fs->csum_blk_count, sizeof(u_int32_t *));
+	fs->csum_dirty = calloc((fs->csum_blk_count + 63) / 64, sizeof(u_int64_t));
+	if (fs->csum_cache == NULL || fs->csum_dirty == NULL){
+		csum_release(fs);
 		return -1;
 	}
+	return 0;
+}
 
-	for (int i = 0; i < 128; i++){
-		if (buf[i*32] != '\0'){
-			int index = i*32;
-			printf("file: ");
-			for (int j = 0; j < 16; j++){
-				if (buf[index + j] == '\0'){
-					break;
-				}
-				printf("%c", buf[index + j]);
-			}
-			u_int32_t size;
-			memcpy(&size, &buf[index + 16], sizeof(u_int32_t));
-			printf(", size: %u", size);
-			u_int16_t data_blk;
-			memcpy(&data_blk, &buf[index + 20], sizeof(u_int16_t));
-			printf(", data_blk: %u\n", data_blk);
+// Helper function, it returns the checksum table block holding the checksum of
+// data block blk, or NULL if it cannot be read
+static u_int32_t *csum_block(struct fs_instance *fs, u_int32_t blk)
+{
+	u_int32_t i = blk / CSUM_PER_BLK;
+	if (fs->csum_cache[i] == NULL){
+		u_int32_t *csums = malloc(BLOCK_SIZE);
+		if (csums == NULL){
+			return NULL;
+		}
+		if (read_block(fs, FS_STATS_CSUM, fs->csum_blk + i, csums) == -1){
+			free(csums);
+			return NULL;
 		}
+		fs->csum_cache[i] = csums;
 	}
-	
-	return 0;
+	return fs->csum_cache[i];
 }
 
-int fs_open(const char *filename)
+// Helper function, it records csum as the checksum of data block blk
+static int csum_set(struct fs_instance *fs, u_int32_t blk, u_int32_t csum)
 {
-	if (!fs_mounted || filename == NULL || strlen(filename) >= FS_FILENAME_LEN){
+	u_int32_t *csums = csum_block(fs, blk);
+	if (csums == NULL){
 		return -1;
 	}
 
-	char buf[4096];
-	if (block_read(infoSuperblock.rdir_blk, buf) == -1){
-		return -1;
+	if (csums[blk % CSUM_PER_BLK] != csum){
+		csums[blk % CSUM_PER_BLK] = csum;
+		BIT_SET(fs->csum_dirty, blk / CSUM_PER_BLK);
 	}
+	return 0;
+}
 
-	for (int i = 0; i < 128; i++){
-		if (buf[i*32] != '\0'){
-			int index = i*32;
-			int match = 1;
-			
-			for (size_t j = 0; j < strlen(filename); j++){
-				if (buf[index + j] != filename[j]){
-					match = 0;
-					break;
-				}
-			}
-
-			if (match && buf[index + strlen(filename)] == '\0'){
-				for (int j = 0; j < FS_OPEN_MAX_COUNT; j++){
-					if (fds[j].used == 0){
-						fds[j].used = 1;
-						fds[j].offset = 0;
-						fds[j].rootIndex = index;
-						return j;
-					}
-				}
-				return -1; // All file descriptors are used;
-			}
+// Helper function, it writes the modified checksum table blocks back
+static int csum_flush(struct fs_instance *fs)
+{
+	int stat = 0;
+	for (u_int32_t i = 0; i < fs->csum_blk_count; i++){
+		if (!BIT_TEST(fs->csum_dirty, i)){
+			continue;
+		}
+		if (write_block(fs, FS_STATS_CSUM, fs->csum_blk + i,
+			fs->csum_cache[i]) == -1){
+			stat = -1;
+			continue;
 		}
+		BIT_CLEAR(fs->csum_dirty, i);
 	}
+	return stat;
+}
 
-	return -1; // File name not found.
+// Helper function, it computes the checksum of a data block
+static u_int32_t block_csum(const void *buf)
+{
+	u_int32_t csum = crc32c(0, buf, BLOCK_SIZE);
+	return csum ? csum : 1;
 }
 
-int fs_close(int fd)
+// Helper function, it writes file data to data block blk and records its
+// checksum
+static int data_write(struct fs_instance *fs, u_int32_t blk, const void *buf)
 {
-	if (!fs_mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fds[fd].used == 0){
+	if (write_block(fs, FS_STATS_DATA, fs->data_blk + blk, buf) == -1){
 		return -1;
 	}
-
-	fds[fd].used = 0;
-	fds[fd].offset = 0;
-	fds[fd].rootIndex = 0;
-
-	return 0;
-
+	if (fs->csum_blk_count == 0){
+		return 0;
+	}
+	return csum_set(fs, blk, block_csum(buf));
 }
 
-int fs_stat(int fd)
+// Helper function, it reads file data from data block blk. Returns -1 if the
+// data does not match its checksum.
+static int data_read(struct fs_instance *fs, u_int32_t blk, void *buf)
 {
-	if (!fs_mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fds[fd].used == 0){
+	if (data_fetch(fs, blk, 1, buf) == -1){
 		return -1;
 	}
+	if (fs->csum_blk_count == 0){
+		return 0;
+	}
 
-	char buf[4096];
-	if (block_read(infoSuperblock.rdir_blk, buf) == -1){
+	u_int32_t *csums = csum_block(fs, blk);
+	if (csums == NULL){
 		return -1;
 	}
-
-	u_int32_t size;
-	memcpy(&size, &buf[fds[fd].rootIndex + 16], sizeof(u_int32_t));
-	return size;
+	u_int32_t csum = csums[blk % CSUM_PER_BLK];
+	if (csum != 0 && csum != block_csum(buf)){
+		fprintf(stderr, "fs: checksum mismatch on data block %u\n", blk);
+		return -1;
+	}
+	return 0;
 }
 
-int fs_lseek(int fd, size_t offset)
+// Helper function, it writes file data to the n data blocks from blk on, and
+// records their checksums
+static int data_write_run(struct fs_instance *fs, u_int32_t blk, size_t n,
+	const void *buf)
 {
-	if (!fs_mounted || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fds[fd].used == 0 || (int)offset > fs_stat(fd)){
+	if (write_blocks(fs, FS_STATS_DATA, fs->data_blk + blk, n, buf) == -1){
 		return -1;
 	}
-
-	fds->offset = offset;
+	for (size_t i = 0; fs->csum_blk_count != 0 && i < n; i++){
+		if (csum_set(fs, blk + i,
+			block_csum((const char *)buf + i * BLOCK_SIZE)) == -1){
+			return -1;
+		}
+	}
 	return 0;
 }
 
-// Helper function, it allocates space for a block
-uint16_t allocate_block() {
-    uint8_t fat_block[BLOCK_SIZE];
+// Helper function, it reads file data from the n data blocks from blk on.
+// Returns the number of blocks read before the first one that cannot be read
+// or does not match its checksum.
+static size_t data_read_run(struct fs_instance *fs, u_int32_t blk, size_t n,
+	void *buf)
+{
+	if (data_fetch(fs, blk, n, buf) == -1){
+		return 0;
+	}
+	if (fs->csum_blk_count == 0){
+		return n;
+	}
 
-    for (int i = 0; i < infoSuperblock.fat_blk_count; i++) {
-        if (block_read(1 + i, fat_block) == -1) {
-            return 0xFFFF; // Failed to read
+	for (size_t i = 0; i < n; i++){
+		u_int32_t *csums = csum_block(fs, blk + i);
+		if (csums == NULL){
+			return i;
 		}
+		u_int32_t csum = csums[(blk + i) % CSUM_PER_BLK];
+		if (csum != 0 && csum != block_csum((char *)buf + i * BLOCK_SIZE)){
+			fprintf(stderr, "fs: checksum mismatch on data block %zu\n",
+				blk + i);
+			return i;
+		}
+	}
+	return n;
+}
 
-        for (int j = 0; j < 2048; j++) {
-            uint16_t val;
-            memcpy(&val, &fat_block[j * 2], sizeof(uint16_t));
-
-            if (val == 0) {
-                uint16_t new_val = 0xFFFF;
-                memcpy(&fat_block[j * 2], &new_val, sizeof(uint16_t));
-                block_write(1 + i, fat_block);
-                return i * 2048 + j;
-            }
-        }
+// Helper function, it gets the next block's index as the name suggests
+static u_int32_t get_next_block(struct fs_instance *fs, u_int32_t index) {
+    if (index >= fs->data_blk_count) {
+        return FAT_EOC; // Out of bounds, indicating EOF
     }
-    return 0xFFFF; // No free block
-}
 
-int fs_write(int fd, void *buf, size_t count)
-{
-    if (!fs_mounted || buf == NULL || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fds[fd].used) {
-        return -1;
+    void *fat_blk = fat_block(fs, index / fs->fat_per_blk);
+    if (fat_blk == NULL) {
+        return FAT_EOC; // Error, indicating EOF
 	}
 
-	if (count == 0) {
-		return 0;
-	}
+    if (fs->version == 1) {
+        u_int16_t value = ((u_int16_t *)fat_blk)[index % fs->fat_per_blk];
+        return value == 0xFFFF ? FAT_EOC : value;
+    }
+    return ((u_int32_t *)fat_blk)[index % fs->fat_per_blk];
+}
 
-    struct file_descriptor *fd_entry = &fds[fd];
+// Helper function, it sets the FAT index with value(next FAT entry)
+static int set_fat_entry(struct fs_instance *fs, u_int32_t index, u_int32_t value) {
+    if (index >= fs->data_blk_count) {
+        return -1;
+    }
 
-    // Load root directory block
-    uint8_t rdir_block[BLOCK_SIZE];
-    if (block_read(infoSuperblock.rdir_blk, rdir_block) == -1) {
+    u_int32_t fat_block_num = index / fs->fat_per_blk;
+    void *fat_blk = fat_block(fs, fat_block_num);
+    if (fat_blk == NULL) {
         return -1;
 	}
 
-    // Read file size
-    uint32_t size;
-    memcpy(&size, &rdir_block[fd_entry->rootIndex + 16], sizeof(uint32_t));
+    // Update the FAT entry, and write the FAT block back to disk
+    u_int32_t old;
+    if (fs->version == 1) {
+        u_int16_t *entry = (u_int16_t *)fat_blk + index % fs->fat_per_blk;
+        old = *entry;
+        *entry = value == FAT_EOC ? 0xFFFF : value;
+    } else {
+        u_int32_t *entry = (u_int32_t *)fat_blk + index % fs->fat_per_blk;
+        old = *entry;
+        *entry = value;
+    }
+    if (write_block(fs, FS_STATS_FAT, 1 + fat_block_num, fat_blk) == -1) {
+        // Whatever made it to disk, reload it on next use
+        fat_drop(fs, fat_block_num);
+        return -1;
+    }
 
-    // Get starting data block
-    uint16_t block;
-    memcpy(&block, &rdir_block[fd_entry->rootIndex + 20], sizeof(uint16_t));
+    if (old == 0 && value != 0) {
+        fs->free_blk_count -= 1;
+        fs->fat_free[fat_block_num] -= 1;
+    } else if (old != 0 && value == 0) {
+        fs->free_blk_count += 1;
+        fs->fat_free[fat_block_num] += 1;
 
-    // If file is empty, allocate first block
-    if (block == 0xFFFF) {
-        block = allocate_block();
+        // Whatever the block is used for next, its checksum is unknown
+        if (fs->csum_blk_count != 0) {
+            csum_set(fs, index, 0);
+        }
+    }
+    return 0;
+}
 
-		// Failed to allocate
-        if (block == 0xFFFF) {
+// Helper function, it returns the size of the file of directory entry ent
+static u_int32_t entry_size(const char *ent)
+{
+	u_int32_t size;
+	memcpy(&size, &ent[16], sizeof(u_int32_t));
+	return size;
+}
+
+static void entry_set_size(char *ent, u_int32_t size)
+{
+	memcpy(&ent[16], &size, sizeof(u_int32_t));
+}
+
+// Helper function, it returns the first data block of directory entry ent
+static u_int32_t entry_first(struct fs_instance *fs, const char *ent)
+{
+	if (fs->version == 1){
+		u_int16_t data_blk;
+		memcpy(&data_blk, &ent[20], sizeof(u_int16_t));
+		return data_blk == 0xFFFF ? FAT_EOC : data_blk;
+	}
+
+	u_int32_t data_blk;
+	memcpy(&data_blk, &ent[20], sizeof(u_int32_t));
+	return data_blk;
+}
+
+static void entry_set_first(struct fs_instance *fs, char *ent, u_int32_t data_blk)
+{
+	if (fs->version == 1){
+		u_int16_t v1_blk = data_blk == FAT_EOC ? 0xFFFF : data_blk;
+		memcpy(&ent[20], &v1_blk, sizeof(u_int16_t));
+		return;
+	}
+
+	memcpy(&ent[20], &data_blk, sizeof(u_int32_t));
+}
+
+// Header of the blocks of a hashed directory, in place of their first entry
+struct dir_header{
+	u_int32_t next; // Data block of the next overflow block, 0 for none
+	u_int32_t used; // Number of used entries in the block
+	u_int8_t padding[24];
+};
+
+_Static_assert(sizeof(struct dir_header) == ENTRY_SIZE, "bad header size");
+
+// Position in the blocks of a directory
+struct dir_iter{
+	u_int32_t dir;
+	u_int32_t bucket; // Current root directory block
+	u_int32_t end;    // Root directory block to stop at
+	u_int32_t blk;    // Current block, 0 once every block was walked
+};
+
+// Helper function, it returns the first entry slot of the blocks of dir
+static int dir_first_slot(struct fs_instance *fs, u_int32_t dir)
+{
+	return dir == ROOT_DIR && fs->dir_hashed ? 1 : 0;
+}
+
+// Helper function, it returns the overflow block chained after the hashed
+// directory block in buf, or 0 if there is none
+static u_int32_t dir_overflow_blk(struct fs_instance *fs, const char *buf)
+{
+	if (!fs->dir_hashed){
+		return 0;
+	}
+
+	struct dir_header hdr;
+	memcpy(&hdr, buf, sizeof(struct dir_header));
+	if (hdr.next == 0 || hdr.next >= fs->data_blk_count){
+		return 0;
+	}
+	return fs->data_blk + hdr.next;
+}
+
+// Helper function, it starts walking the blocks of directory dir. If filename
+// is not NULL, only the blocks that may hold the entry named filename are
+// walked: with a hashed root directory, these are the blocks of one bucket.
+static void dir_iter_init(struct fs_instance *fs, struct dir_iter *it,
+	u_int32_t dir, const char *filename)
+{
+	it->dir = dir;
+	if (dir != ROOT_DIR){
+		it->blk = fs->data_blk + dir;
+		return;
+	}
+
+	it->bucket = fs->rdir_blk;
+	it->end = fs->rdir_blk + fs->rdir_blk_count;
+	if (fs->dir_hashed && filename != NULL){
+		// FNV-1a
+		u_int32_t hash = 2166136261u;
+		for (int i = 0; i < FS_FILENAME_LEN && filename[i] != '\0'; i++){
+			hash = (hash ^ (u_int8_t)filename[i]) * 16777619u;
+		}
+		it->bucket = fs->rdir_blk + hash % fs->rdir_blk_count;
+		it->end = it->bucket + 1;
+	}
+	it->blk = it->bucket;
+}
+
+// Helper function, it moves to the next block of the directory, buf holding
+// the current one
+static void dir_iter_next(struct fs_instance *fs, struct dir_iter *it,
+	const char *buf)
+{
+	// Subdirectories are chained in the FAT like files
+	if (it->dir != ROOT_DIR){
+		u_int32_t next = get_next_block(fs, it->blk - fs->data_blk);
+		it->blk = next == FAT_EOC || next == 0 ? 0 : fs->data_blk + next;
+		return;
+	}
+
+	it->blk = dir_overflow_blk(fs, buf);
+	if (it->blk == 0 && ++it->bucket < it->end){
+		it->blk = it->bucket;
+	}
+}
+
+// Helper function, it counts the entries of the root directory, and how many
+// of them are free
+static int dir_usage(struct fs_instance *fs, size_t *entries, size_t *free_entries)
+{
+	char buf[4096];
+	int first = dir_first_slot(fs, ROOT_DIR);
+	struct dir_iter it;
+
+	*entries = 0;
+	*free_entries = 0;
+	for (dir_iter_init(fs, &it, ROOT_DIR, NULL); it.blk != 0;
+		dir_iter_next(fs, &it, buf)){
+		if (read_block(fs, FS_STATS_DIR, it.blk, buf) == -1){
+			return -1;
+		}
+
+		for (int i = first; i < ENTRIES_PER_BLK; i++){
+			if (buf[i*32] == '\0'){
+				*free_entries += 1;
+			}
+		}
+		*entries += ENTRIES_PER_BLK - first;
+	}
+
+	return 0;
+}
+
+// Helper function, it returns the flags of directory entry ent
+static u_int8_t entry_flags(struct fs_instance *fs, const char *ent)
+{
+	return fs->version == 1 ? 0 : (u_int8_t)ent[24];
+}
+
+static void entry_set_flags(struct fs_instance *fs, char *ent, u_int8_t flags)
+{
+	if (fs->version != 1){
+		ent[24] = flags;
+	}
+}
+
+// Helper function, it counts the free root directory entries. Hashed
+// directories grow as needed, so their free entries are not tracked.
+static int count_free_rdir(struct fs_instance *fs)
+{
+	if (fs->free_rdir_count >= 0 || fs->dir_hashed){
+		return 0;
+	}
+
+	size_t entries, free_entries;
+	if (dir_usage(fs, &entries, &free_entries) == -1){
+		return -1;
+	}
+
+	fs->free_rdir_count = free_entries;
+	return 0;
+}
+
+// Helper function, it updates the free root directory entry count when count
+// slots of directory block blk are taken (count > 0) or given back (count < 0)
+// by inline data. Slots of other directories are not counted.
+static void rdir_slots_taken(struct fs_instance *fs, u_int32_t blk, int count)
+{
+	if (fs->free_rdir_count >= 0 && blk >= fs->rdir_blk &&
+		blk < fs->rdir_blk + fs->rdir_blk_count){
+		fs->free_rdir_count -= count;
+	}
+}
+
+// Helper function, it loads every FAT block whose free count is not known yet
+static int count_free_blocks(struct fs_instance *fs)
+{
+	for (u_int32_t i = 0; i < fs->fat_blk_count && fs->fat_unknown > 0; i++){
+		if (fs->fat_free[i] < 0 && fat_block(fs, i) == NULL){
+			return -1;
+		}
+	}
+
+	return 0;
+}
+
+// Helper function, it loads the free space counters from the superblock
+// summary. Returns -1 if there is no summary, or if it cannot be trusted.
+static int load_summary(struct fs_instance *fs)
+{
+	struct summary sum;
+	char *loc = &fs->sb.raw[SUMMARY_OFFSET];
+
+	if (fs->version == 1){
+		return -1;
+	}
+
+	memcpy(&sum, loc, sizeof(struct summary));
+	if (sum.magic != SUMMARY_MAGIC || sum.version != SUMMARY_VERSION ||
+		!sum.clean || sum.fat_blk_count != fs->fat_blk_count ||
+		fs->fat_blk_count > SUMMARY_MAX){
+		return -1;
+	}
+
+	if (sum.fat_free > fs->data_blk_count ||
+		sum.rdir_free > fs->rdir_blk_count * ENTRIES_PER_BLK){
+		return -1;
+	}
+
+	u_int16_t *counts = malloc(fs->fat_blk_count * sizeof(u_int16_t));
+	if (counts == NULL){
+		return -1;
+	}
+	memcpy(counts, loc + sizeof(struct summary),
+		fs->fat_blk_count * sizeof(u_int16_t));
+
+	u_int32_t total = 0;
+	for (u_int32_t i = 0; i < fs->fat_blk_count; i++){
+		if (counts[i] > fat_blk_entries(fs, i)){
+			free(counts);
+			return -1;
+		}
+		total += counts[i];
+	}
+	if (total != sum.fat_free){
+		free(counts);
+		return -1;
+	}
+
+	for (u_int32_t i = 0; i < fs->fat_blk_count; i++){
+		fs->fat_free[i] = counts[i];
+	}
+	free(counts);
+	fs->fat_unknown = 0;
+	fs->free_blk_count = sum.fat_free;
+	fs->free_rdir_count = fs->dir_hashed ? -1 : (int)sum.rdir_free;
+	return 0;
+}
+
+// Helper function, it writes the free space counters to the superblock summary.
+// The summary cannot be marked clean while some counts are not known, or if it
+// cannot hold the count of every FAT block. v1 superblocks are left untouched.
+static int write_summary(struct fs_instance *fs, int clean)
+{
+	struct summary sum;
+	char *loc = &fs->sb.raw[SUMMARY_OFFSET];
+
+	if (fs->version == 1){
+		return 0;
+	}
+
+	memset(&sum, 0, sizeof(struct summary));
+	sum.magic = SUMMARY_MAGIC;
+	sum.version = SUMMARY_VERSION;
+	sum.clean = clean && fs->fat_unknown == 0 &&
+		(fs->free_rdir_count >= 0 || fs->dir_hashed) &&
+		fs->fat_blk_count <= SUMMARY_MAX;
+	sum.fat_blk_count = fs->fat_blk_count;
+	sum.rdir_free = fs->free_rdir_count < 0 ? 0 : fs->free_rdir_count;
+	sum.fat_free = fs->free_blk_count;
+	memcpy(loc, &sum, sizeof(struct summary));
+
+	if (sum.clean){
+		for (u_int32_t i = 0; i < fs->fat_blk_count; i++){
+			u_int16_t count = fs->fat_free[i];
+			memcpy(loc + sizeof(struct summary) + i * sizeof(u_int16_t),
+				&count, sizeof(u_int16_t));
+		}
+	}
+
+	return write_block(fs, FS_STATS_SUPER, 0, &fs->sb);
+}
+
+// Helper function, it reads the layout of the file system from the superblock
+// in fs->sb, and checks that it is valid
+static int load_layout(struct fs_instance *fs)
+{
+	if (strncmp(fs->sb.v1.signature, "ECS150FS", 8) != 0){
+		return -1;
+	}
+
+	u_int32_t fat_entry_size;
+	if (fs->sb.v1.total_blk_count != 0){
+		struct superblock *sb = &fs->sb.v1;
+
+		fs->version = 1;
+		fs->dir_hashed = 0;
+		fs->total_blk_count = sb->total_blk_count;
+		fs->fat_blk_count = sb->fat_blk_count;
+		fs->csum_blk_count = 0;
+		fs->rdir_blk = sb->rdir_blk;
+		fs->rdir_blk_count = 1;
+		fs->data_blk = sb->data_blk;
+		fs->data_blk_count = sb->data_blk_count;
+		fat_entry_size = sizeof(u_int16_t);
+
+		if (fs->fat_blk_count > FAT_MAX_BLK_COUNT){
+			return -1;
+		}
+	} else if (fs->sb.v2.version == 2){
+		struct superblock_v2 *sb = &fs->sb.v2;
+
+		fs->version = 2;
+		fs->dir_hashed = (sb->features & FEATURE_HASHED_DIR) != 0;
+		fs->total_blk_count = sb->total_blk_count;
+		fs->fat_blk_count = sb->fat_blk_count;
+		fs->rdir_blk = sb->rdir_blk;
+		fs->rdir_blk_count = sb->rdir_blk_count;
+		fs->data_blk = sb->data_blk;
+		fs->data_blk_count = sb->data_blk_count;
+		fat_entry_size = sizeof(u_int32_t);
+
+		fs->csum_blk = 1 + fs->fat_blk_count;
+		fs->csum_blk_count = 0;
+		if (sb->features & FEATURE_CHECKSUMS){
+			fs->csum_blk_count = (fs->data_blk_count + CSUM_PER_BLK - 1) /
+				CSUM_PER_BLK;
+		}
+
+		if (fs->data_blk_count > V2_MAX_DATA_BLK_COUNT ||
+			fs->rdir_blk != fs->csum_blk + fs->csum_blk_count ||
+			fs->rdir_blk_count == 0 ||
+			fs->data_blk != fs->rdir_blk + fs->rdir_blk_count ||
+			(sb->features & ~FEATURES_KNOWN)){
+			return -1;
+		}
+	} else {
+		return -1;
+	}
+	fs->fat_per_blk = BLOCK_SIZE / fat_entry_size;
+
+	if ((int)fs->total_blk_count != block_disk_count_h(fs->disk)){
+		return -1;
+	}
+
+	if ((u_int64_t)fs->fat_blk_count * fs->fat_per_blk < fs->data_blk_count ||
+		(u_int64_t)fs->data_blk + fs->data_blk_count > fs->total_blk_count){
+		return -1;
+	}
+
+	return 0;
+}
+
+// Helper function, it checks that fs is a handle to a mounted file system
+static int is_mounted(struct fs_instance *fs)
+{
+	return fs != NULL && fs->mounted;
+}
+
+// Largest number of data blocks of a v1 file system, as accepted by fs_make
+#define V1_MAX_DATA_BLK_COUNT 8192
+
+static int mkfs_disk(const char *diskname, size_t data_blk_count,
+	const struct fs_mkfs_options *opts)
+{
+	int version = opts && opts->version ? opts->version : 1;
+	size_t rdir_entry_count = opts && opts->rdir_entry_count ?
+		opts->rdir_entry_count : FS_FILE_MAX_COUNT;
+	int hashed_dir = opts && opts->hashed_dir;
+	int checksums = opts && opts->checksums;
+
+	if (diskname == NULL || data_blk_count == 0){
+		return -1;
+	}
+
+	union {
+		struct superblock v1;
+		struct superblock_v2 v2;
+	} sb;
+	memset(&sb, 0, sizeof(sb));
+	memcpy(sb.v1.signature, "ECS150FS", 8);
+
+	size_t fat_blk_count, rdir_blk_count, total_blk_count;
+	if (version == 1){
+		if (data_blk_count > V1_MAX_DATA_BLK_COUNT ||
+			rdir_entry_count != FS_FILE_MAX_COUNT || hashed_dir ||
+			checksums){
+			return -1;
+		}
+
+		fat_blk_count = (data_blk_count * 2 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		rdir_blk_count = 1;
+		total_blk_count = 2 + fat_blk_count + data_blk_count;
+
+		sb.v1.total_blk_count = total_blk_count;
+		sb.v1.fat_blk_count = fat_blk_count;
+		sb.v1.rdir_blk = 1 + fat_blk_count;
+		sb.v1.data_blk = 2 + fat_blk_count;
+		sb.v1.data_blk_count = data_blk_count;
+	} else if (version == 2){
+		// Blocks of hashed directories lose their first entry to a header,
+		// and are only filled to 3/4 so that few buckets overflow
+		size_t per_blk = hashed_dir ? (ENTRIES_PER_BLK - 1) * 3 / 4 :
+			ENTRIES_PER_BLK;
+		rdir_blk_count = (rdir_entry_count + per_blk - 1) / per_blk;
+		fat_blk_count = (data_blk_count * 4 + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		size_t csum_blk_count = checksums ?
+			(data_blk_count + CSUM_PER_BLK - 1) / CSUM_PER_BLK : 0;
+		total_blk_count = 1 + fat_blk_count + csum_blk_count + rdir_blk_count +
+			data_blk_count;
+
+		// Block numbers must fit in 32 bits, and block counts in an int
+		if (data_blk_count > V2_MAX_DATA_BLK_COUNT ||
+			total_blk_count > 0x7FFFFFFF){
+			return -1;
+		}
+
+		sb.v2.version = 2;
+		sb.v2.total_blk_count = total_blk_count;
+		sb.v2.fat_blk_count = fat_blk_count;
+		sb.v2.rdir_blk = 1 + fat_blk_count + csum_blk_count;
+		sb.v2.rdir_blk_count = rdir_blk_count;
+		sb.v2.data_blk = sb.v2.rdir_blk + rdir_blk_count;
+		sb.v2.data_blk_count = data_blk_count;
+		sb.v2.features = (hashed_dir ? FEATURE_HASHED_DIR : 0) |
+			(checksums ? FEATURE_CHECKSUMS : 0);
+	} else {
+		return -1;
+	}
+
+	// The disk is zero-filled: every FAT entry is free and every directory
+	// entry is empty, except for the reserved first data block. Hashed
+	// directory blocks start with an empty header. Checksums of 0 are unknown,
+	// and not verified.
+	if (block_disk_create(diskname, total_blk_count) == -1){
+		return -1;
+	}
+
+	struct disk *d = block_disk_open_h(diskname);
+	if (d == NULL){
+		return -1;
+	}
+
+	char buf[4096];
+	memset(buf, 0, sizeof(buf));
+	if (version == 1){
+		u_int16_t eoc = 0xFFFF;
+		memcpy(buf, &eoc, sizeof(u_int16_t));
+	} else {
+		u_int32_t eoc = FAT_EOC;
+		memcpy(buf, &eoc, sizeof(u_int32_t));
+	}
+
+	int stat = 0;
+	stats_blocks(FS_STATS_SUPER, 1, 1);
+	stats_blocks(FS_STATS_FAT, 1, 1);
+	block_trace_tag(FS_STATS_SUPER);
+	if (block_write_h(d, 0, &sb) == -1){
+		stat = -1;
+	} else {
+		block_trace_tag(FS_STATS_FAT);
+		if (block_write_h(d, 1, buf) == -1){
+			stat = -1;
+		}
+	}
+	block_disk_close_h(d);
+	return stat;
+}
+
+// Helper function, it mounts diskname on fs
+static int mount_instance(struct fs_instance *fs, const char *diskname,
+	const struct fs_mount_options *opts)
+{
+	if (fs->mounted){
+		return -1;
+	}
+
+	fs->disk = block_disk_open_h(diskname);
+	if (fs->disk == NULL){
+		return -1;
+	}
+	char buf[4096];
+
+	if (read_block(fs, FS_STATS_SUPER, 0, buf) == -1){
+		goto fail;
+	}
+	memcpy(&fs->sb, buf, sizeof(fs->sb));
+
+	if (load_layout(fs) == -1){
+		goto fail;
+	}
+
+	if (fat_init(fs, opts ? opts->fat_cache_max : 0) == -1){
+		goto fail;
+	}
+	if (csum_init(fs) == -1){
+		goto fail;
+	}
+	fs->free_rdir_count = -1;
+	memset(fs->dcache, 0, sizeof(fs->dcache));
+	fs->zcache.root = FAT_EOC;
+	fs->zcache.data = NULL;
+	fs->dedup = NULL;
+
+	// Trust the summary after a clean unmount, count the free space otherwise.
+	// In lazy mode, directory and FAT blocks are only counted when needed.
+	if (load_summary(fs) == -1 && !(opts && opts->lazy)){
+		if (count_free_rdir(fs) == -1 || count_free_blocks(fs) == -1){
+			goto fail;
+		}
+	}
+
+	// Until the next fs_umount(), the summary on disk may become stale
+	if (write_summary(fs, 0) == -1){
+		goto fail;
+	}
+
+	for (int i = 0; i < FS_OPEN_MAX_COUNT; i ++){
+		fs->fds[i].used = 0;
+		fs->fds[i].offset = 0;
+		fs->fds[i].rootBlk = 0;
+		fs->fds[i].rootIndex = 0;
+		fs->fds[i].advice = FS_ADVICE_NORMAL;
+		fs->fds[i].noreuse = 0;
+		fs->fds[i].readahead = 0;
+	}
+	fs->mounted = 1;
+	return 0;
+
+fail:
+	fat_release(fs);
+	csum_release(fs);
+	block_disk_close_h(fs->disk);
+	fs->disk = NULL;
+	return -1;
+}
+
+fs_handle_t fs_mount_h(const char *diskname, const struct fs_mount_options *opts)
+{
+	uint64_t t = stats_begin();
+	struct fs_instance *fs = calloc(1, sizeof(struct fs_instance));
+	if (fs == NULL){
+		stats_end(t, FS_STATS_MOUNT, -1, 0);
+		return NULL;
+	}
+	pthread_mutex_init(&fs->lock, NULL);
+	pthread_mutex_init(&fs->buf.lock, NULL);
+	pthread_cond_init(&fs->buf.cond, NULL);
+	pthread_cond_init(&fs->buf.loaded, NULL);
+
+	if (mount_instance(fs, diskname, opts) == -1){
+		pthread_cond_destroy(&fs->buf.loaded);
+		pthread_cond_destroy(&fs->buf.cond);
+		pthread_mutex_destroy(&fs->buf.lock);
+		pthread_mutex_destroy(&fs->lock);
+		free(fs);
+		fs = NULL;
+	}
+	stats_end(t, FS_STATS_MOUNT, fs == NULL ? -1 : 0, 0);
+	return fs;
+}
+
+// Helper function, it unmounts fs
+static int umount_instance(struct fs_instance *fs)
+{	
+	// If the summary cannot be written, the next mount simply scans the FAT
+	if (fs->mounted){
+		csum_flush(fs);
+		count_free_rdir(fs);
+		write_summary(fs, 1);
+	}
+
+	// The prefetch thread reads from the disk
+	buf_stop(fs);
+
+	int stat = block_disk_close_h(fs->disk);
+	if (stat == 0){
+		fat_release(fs);
+		csum_release(fs);
+		free(fs->zcache.data);
+		fs->zcache.data = NULL;
+		free(fs->dedup);
+		fs->dedup = NULL;
+		fs->disk = NULL;
+		fs->mounted = 0;
+	}
+	return stat;
+}
+
+int fs_umount_h(fs_handle_t fs)
+{
+	uint64_t t = stats_begin();
+	if (fs == NULL){
+		return stats_end(t, FS_STATS_UMOUNT, -1, 0);
+	}
+
+	pthread_mutex_lock(&fs->lock);
+	int ret = umount_instance(fs);
+	pthread_mutex_unlock(&fs->lock);
+	stats_end(t, FS_STATS_UMOUNT, ret, 0);
+	if (ret == -1){
+		return -1;
+	}
+
+	pthread_cond_destroy(&fs->buf.loaded);
+	pthread_cond_destroy(&fs->buf.cond);
+	pthread_mutex_destroy(&fs->buf.lock);
+	pthread_mutex_destroy(&fs->lock);
+	free(fs);
+	return 0;
+}
+
+static int statfs_locked(struct fs_instance *fs, struct fs_statfs *st)
+{
+	if (!is_mounted(fs) || st == NULL){
+		return -1;
+	}
+
+	// After a lazy mount, some blocks may not have been counted yet
+	if (count_free_blocks(fs) == -1 || count_free_rdir(fs) == -1){
+		return -1;
+	}
+
+	size_t rdir_entry_count = fs->rdir_blk_count * ENTRIES_PER_BLK;
+	size_t rdir_free_count = fs->free_rdir_count;
+	if (fs->dir_hashed &&
+		dir_usage(fs, &rdir_entry_count, &rdir_free_count) == -1){
+		return -1;
+	}
+
+	st->version = fs->version;
+	st->total_blk_count = fs->total_blk_count;
+	st->fat_blk_count = fs->fat_blk_count;
+	st->csum_blk_count = fs->csum_blk_count;
+	st->rdir_blk = fs->rdir_blk;
+	st->rdir_blk_count = fs->rdir_blk_count;
+	st->rdir_entry_count = rdir_entry_count;
+	st->data_blk = fs->data_blk;
+	st->data_blk_count = fs->data_blk_count;
+	st->fat_free_count = fs->free_blk_count;
+	st->rdir_free_count = rdir_free_count;
+	return block_disk_io_count_h(fs->disk, &st->blk_read_count,
+		&st->blk_write_count);
+}
+
+static int info_locked(struct fs_instance *fs)
+{
+	if (fs == NULL || block_disk_count_h(fs->disk) == -1){
+		return -1;
+	}
+
+	struct fs_statfs st;
+	if (statfs_locked(fs, &st) == -1){
+		return -1;
+	}
+
+	printf("FS Info:\n");
+	printf("total_blk_count=%zu\n", st.total_blk_count);
+	printf("fat_blk_count=%zu\n", st.fat_blk_count);
+	printf("rdir_blk=%zu\n", st.rdir_blk);
+	printf("data_blk=%zu\n", st.data_blk);
+	printf("data_blk_count=%zu\n", st.data_blk_count);
+	printf("fat_free_ratio=%zu/%zu\n", st.fat_free_count, st.data_blk_count);
+	printf("rdir_free_ratio=%zu/%zu\n", st.rdir_free_count, st.rdir_entry_count);
+	return 0;
+}
+
+// Helper function, it marks a v2 file system as using feature, so that
+// implementations that do not know about it refuse to mount it
+static int set_feature(struct fs_instance *fs, u_int32_t feature)
+{
+	if ((fs->sb.v2.features & feature) == feature){
+		return 0;
+	}
+
+	fs->sb.v2.features |= feature;
+	return write_block(fs, FS_STATS_SUPER, 0, &fs->sb);
+}
+
+// Helper function, it checks that filename is a valid file name
+static int valid_filename(const char *filename)
+{
+	return filename != NULL && filename[0] != '\0' &&
+		strlen(filename) < FS_FILENAME_LEN;
+}
+
+// Helper function, it returns the offset of the entry named filename in the
+// block buf of directory dir, or -1 if there is none
+static int find_entry(struct fs_instance *fs, u_int32_t dir, const char *buf,
+	const char *filename)
+{
+	char key[FS_FILENAME_LEN];
+	size_t len = dir_name_key(key, filename);
+	int first = dir_first_slot(fs, dir);
+
+	int i = dir_find_name(buf + first*32, ENTRIES_PER_BLK - first, ENTRY_SIZE,
+		key, len);
+	return i == -1 ? -1 : (first + i)*32;
+}
+
+// Helper function, it looks for the entry named filename in directory dir. On
+// success, buf holds the directory block the entry is in, whose number is
+// stored in blk. Returns the offset of the entry in buf, -1 if there is none
+// and -2 on I/O errors.
+static int dir_lookup(struct fs_instance *fs, u_int32_t dir,
+	const char *filename, char *buf, u_int32_t *blk)
+{
+	struct dir_iter it;
+
+	for (dir_iter_init(fs, &it, dir, filename); it.blk != 0;
+		dir_iter_next(fs, &it, buf)){
+		if (read_block(fs, FS_STATS_DIR, it.blk, buf) == -1){
+			return -2;
+		}
+
+		int index = find_entry(fs, dir, buf, filename);
+		if (index != -1){
+			*blk = it.blk;
+			return index;
+		}
+	}
+
+	return -1;
+}
+
+// Helper function, it returns the dentry cache slot of filename in directory
+// dir
+static struct dentry *dentry_slot(struct fs_instance *fs, u_int32_t dir,
+	const char *filename)
+{
+	u_int32_t hash = 2166136261u ^ dir;
+	for (int i = 0; i < FS_FILENAME_LEN && filename[i] != '\0'; i++){
+		hash = (hash ^ (u_int8_t)filename[i]) * 16777619u;
+	}
+	return &fs->dcache[hash % DCACHE_SIZE];
+}
+
+// Helper function, it looks for the entry named filename in directory dir,
+// in the dentry cache first and then on disk. Returns 0 and fills in d if
+// there is one, -1 if there is none and -2 on I/O errors.
+static int dentry_lookup(struct fs_instance *fs, u_int32_t dir,
+	const char *filename, struct dentry *d)
+{
+	struct dentry *slot = dentry_slot(fs, dir, filename);
+	if (slot->valid && slot->parent == dir &&
+		strncmp(slot->name, filename, FS_FILENAME_LEN) == 0){
+		*d = *slot;
+		return 0;
+	}
+
+	char buf[4096];
+	u_int32_t blk;
+	int index = dir_lookup(fs, dir, filename, buf, &blk);
+	if (index < 0){
+		return index;
+	}
+
+	memset(slot, 0, sizeof(struct dentry));
+	slot->valid = 1;
+	slot->parent = dir;
+	strncpy(slot->name, filename, FS_FILENAME_LEN - 1);
+	slot->blk = blk;
+	slot->index = index;
+	slot->flags = entry_flags(fs, &buf[index]);
+	slot->first = entry_first(fs, &buf[index]);
+	*d = *slot;
+	return 0;
+}
+
+// Helper function, it drops the entry named filename in directory dir from
+// the dentry cache
+static void dentry_forget(struct fs_instance *fs, u_int32_t dir,
+	const char *filename)
+{
+	struct dentry *slot = dentry_slot(fs, dir, filename);
+	if (slot->parent == dir &&
+		strncmp(slot->name, filename, FS_FILENAME_LEN) == 0){
+		slot->valid = 0;
+	}
+}
+
+// Helper function, it resolves every component of path but the last one. The
+// directory holding the last component is stored in dir, and its name is
+// copied to name. Returns -1 if path is invalid, or if one of the directories
+// on the way does not exist.
+static int path_parent(struct fs_instance *fs, const char *path, u_int32_t *dir,
+	char *name)
+{
+	*dir = ROOT_DIR;
+
+	// v1 file systems have no subdirectories, '/' is a plain character
+	if (fs->version == 1){
+		if (!valid_filename(path)){
+			return -1;
+		}
+		strcpy(name, path);
+		return 0;
+	}
+
+	if (path == NULL){
+		return -1;
+	}
+
+	const char *p = path;
+	while (1){
+		while (*p == '/'){
+			p++;
+		}
+		const char *end = strchr(p, '/');
+		size_t len = end ? (size_t)(end - p) : strlen(p);
+		if (len == 0 || len >= FS_FILENAME_LEN || (u_int8_t)*p == INLINE_MARK){
+			return -1;
+		}
+		memcpy(name, p, len);
+		name[len] = '\0';
+
+		const char *rest = p + len;
+		while (*rest == '/'){
+			rest++;
+		}
+		if (*rest == '\0'){
+			return 0;
+		}
+
+		struct dentry d;
+		if (dentry_lookup(fs, *dir, name, &d) != 0 || !(d.flags & ENTRY_DIR)){
+			return -1;
+		}
+		*dir = d.first;
+		p = rest;
+	}
+}
+
+// Helper function, it resolves path to a directory. An empty path, or one
+// made of slashes only, is the root directory.
+static int path_dir(struct fs_instance *fs, const char *path, u_int32_t *dir)
+{
+	if (path == NULL || path[strspn(path, "/")] == '\0'){
+		*dir = ROOT_DIR;
+		return 0;
+	}
+
+	char name[FS_FILENAME_LEN];
+	u_int32_t parent;
+	struct dentry d;
+	if (path_parent(fs, path, &parent, name) == -1 ||
+		dentry_lookup(fs, parent, name, &d) != 0 || !(d.flags & ENTRY_DIR)){
+		return -1;
+	}
+
+	*dir = d.first;
+	return 0;
+}
+
+// Helper function, it adds n to the used entry count of hashed directory block
+// buf, and returns the new count
+static u_int32_t dir_add_used(char *buf, int n)
+{
+	struct dir_header hdr;
+	memcpy(&hdr, buf, sizeof(struct dir_header));
+	hdr.used += n;
+	memcpy(buf, &hdr, sizeof(struct dir_header));
+	return hdr.used;
+}
+
+static u_int32_t allocate_block(struct fs_instance *fs);
+static u_int32_t allocate_block_as(struct fs_instance *fs, u_int32_t value);
+
+// Helper function, it allocates a data block and fills it with zeros
+static u_int32_t allocate_zeroed_block(struct fs_instance *fs)
+{
+	u_int32_t data_blk = allocate_block(fs);
+	if (data_blk == FAT_EOC){
+		return FAT_EOC;
+	}
+
+	char buf[4096];
+	memset(buf, 0, sizeof(buf));
+	if (write_block(fs, FS_STATS_DIR, fs->data_blk + data_blk, buf) == -1){
+		set_fat_entry(fs, data_blk, 0);
+		return FAT_EOC;
+	}
+	return data_blk;
+}
+
+// Helper function, it chains a new block after the last block of directory
+// dir, whose content is in buf, and returns its number in new_blk. buf then
+// holds the new block. The root directory can only grow if it is hashed.
+static int dir_extend(struct fs_instance *fs, u_int32_t dir, u_int32_t last,
+	char *buf, u_int32_t *new_blk)
+{
+	if (dir == ROOT_DIR && !fs->dir_hashed){
+		return -1;
+	}
+
+	// Write the new block before linking it, so that the chain is always valid
+	u_int32_t data_blk = allocate_zeroed_block(fs);
+	if (data_blk == FAT_EOC){
+		return -1;
+	}
+
+	int stat;
+	if (dir == ROOT_DIR){
+		struct dir_header hdr;
+		memcpy(&hdr, buf, sizeof(struct dir_header));
+		hdr.next = data_blk;
+		memcpy(buf, &hdr, sizeof(struct dir_header));
+		stat = write_block(fs, FS_STATS_DIR, last, buf);
+	} else {
+		stat = set_fat_entry(fs, last - fs->data_blk, data_blk);
+	}
+	if (stat == -1){
+		set_fat_entry(fs, data_blk, 0);
+		return -1;
+	}
+
+	memset(buf, 0, BLOCK_SIZE);
+	*new_blk = fs->data_blk + data_blk;
+	return 0;
+}
+
+// Helper function, it unlinks the empty overflow block blk from the bucket of
+// filename in the hashed root directory, and frees it
+static int dir_shrink(struct fs_instance *fs, const char *filename,
+	u_int32_t blk, u_int32_t next)
+{
+	char buf[4096];
+	struct dir_iter it;
+
+	for (dir_iter_init(fs, &it, ROOT_DIR, filename); it.blk != 0;
+		dir_iter_next(fs, &it, buf)){
+		if (read_block(fs, FS_STATS_DIR, it.blk, buf) == -1){
+			return -1;
+		}
+
+		if (dir_overflow_blk(fs, buf) == blk){
+			struct dir_header hdr;
+			memcpy(&hdr, buf, sizeof(struct dir_header));
+			hdr.next = next == 0 ? 0 : next - fs->data_blk;
+			memcpy(buf, &hdr, sizeof(struct dir_header));
+			if (write_block(fs, FS_STATS_DIR, it.blk, buf) == -1){
+				return -1;
+			}
+			return set_fat_entry(fs, blk - fs->data_blk, 0);
+		}
+	}
+
+	return -1;
+}
+
+// Helper function, it adds an entry named filename to directory dir
+static int dir_add_entry(struct fs_instance *fs, u_int32_t dir,
+	const char *filename, u_int8_t flags, u_int32_t first)
+{
+	// Root directory already contains max number of files.
+	if (dir == ROOT_DIR && fs->free_rdir_count == 0){
+		return -1;
+	}
+
+	// Check to see that file does not already exist.
+	struct dentry d;
+	if (dentry_lookup(fs, dir, filename, &d) != -1){
+		return -1;
+	}
+
+	char buf[4096];
+	struct dir_iter it;
+	u_int32_t blk = 0;
+	int index = -1;
+	for (dir_iter_init(fs, &it, dir, filename); it.blk != 0 && index == -1;
+		dir_iter_next(fs, &it, buf)){
+		if (read_block(fs, FS_STATS_DIR, it.blk, buf) == -1){
+			return -1;
+		}
+
+		blk = it.blk;
+		for (int i = dir_first_slot(fs, dir); i < ENTRIES_PER_BLK; i++){
+			if (buf[i*32] == '\0'){
+				index = i*32;
+				break;
+			}
+		}
+	}
+
+	// Every block is full, chain a new one to the directory
+	if (index == -1){
+		if (dir_extend(fs, dir, blk, buf, &blk) == -1){
+			// Root directory already contains max number of files.
+			if (dir == ROOT_DIR && !fs->dir_hashed){
+				fs->free_rdir_count = 0;
+			}
+			return -1;
+		}
+		index = dir_first_slot(fs, dir)*32;
+	}
+
+	memset(&buf[index], 0, ENTRY_SIZE);
+	memcpy(&buf[index], filename, strlen(filename));
+	entry_set_size(&buf[index], 0);
+	entry_set_first(fs, &buf[index], first);
+	entry_set_flags(fs, &buf[index], flags);
+	if (dir_first_slot(fs, dir)){
+		dir_add_used(buf, 1);
+	}
+
+	if (write_block(fs, FS_STATS_DIR, blk, buf) == -1){
+		return -1;
+	}
+	if (dir == ROOT_DIR && fs->free_rdir_count > 0){
+		fs->free_rdir_count -= 1;
+	}
+	return 0;
+}
+
+// Helper function, it removes the entry named filename from directory dir. The
+// entry is at offset index of block blk, whose content is in buf.
+static int dir_remove_entry(struct fs_instance *fs, u_int32_t dir,
+	const char *filename, char *buf, u_int32_t blk, int index)
+{
+	dentry_forget(fs, dir, filename);
+
+	// The inline data of the file goes with its entry
+	int slots = 0;
+	if (entry_flags(fs, &buf[index]) & ENTRY_INLINE){
+		slots = (u_int8_t)buf[index + 25];
+	}
+	memset(&buf[index], 0, 32 * (1 + slots));
+
+	// Free overflow blocks as soon as they are empty, bucket heads are kept
+	u_int32_t used = dir_first_slot(fs, dir) ? dir_add_used(buf, -1) : 1;
+	if (write_block(fs, FS_STATS_DIR, blk, buf) == -1){
+		return -1;
+	}
+	if (used == 0 && blk >= fs->data_blk){
+		dir_shrink(fs, filename, blk, dir_overflow_blk(fs, buf));
+	}
+
+	if (dir == ROOT_DIR && fs->free_rdir_count >= 0){
+		fs->free_rdir_count += 1;
+	}
+	rdir_slots_taken(fs, blk, -slots);
+	return 0;
+}
+
+// Helper function, it frees the chain of data blocks starting at current_blk
+static void free_chain(struct fs_instance *fs, u_int32_t current_blk)
+{
+	while (current_blk != FAT_EOC){
+		u_int32_t next_blk = get_next_block(fs, current_blk);
+		set_fat_entry(fs, current_blk, 0); 
+		current_blk = next_blk;
+	}		
+}
+
+// Helper function, it returns the number of references to block blk of a
+// mapped file
+static u_int32_t block_refs(struct fs_instance *fs, u_int32_t blk)
+{
+	u_int32_t value = get_next_block(fs, blk);
+	if (value == FAT_EOC || !(value & FAT_REF)){
+		return 1;
+	}
+	return value & FAT_REF_COUNT;
+}
+
+// Helper function, it adds a reference to block blk of a mapped file
+static int block_ref(struct fs_instance *fs, u_int32_t blk)
+{
+	u_int32_t value = get_next_block(fs, blk);
+	if (value == FAT_EOC || !(value & FAT_REF)){
+		value = FAT_REF | FAT_REF_MAP | 1;
+	}
+	if ((value & FAT_REF_COUNT) >= FAT_REF_MAX){
+		return -1;
+	}
+	return set_fat_entry(fs, blk, value + 1);
+}
+
+// Helper function, it gives back block blk of a mapped file, which is only
+// freed once nothing refers to it anymore
+static int release_block(struct fs_instance *fs, u_int32_t blk)
+{
+	u_int32_t value = get_next_block(fs, blk);
+	if (value != FAT_EOC && (value & FAT_REF) && (value & FAT_REF_COUNT) > 1){
+		return set_fat_entry(fs, blk, value - 1);
+	}
+	return set_fat_entry(fs, blk, 0);
+}
+
+// Helper function, it allocates a data block for a mapped file
+static u_int32_t allocate_data_block(struct fs_instance *fs)
+{
+	return allocate_block_as(fs, FAT_REF | 1);
+}
+
+// Helper function, it allocates a map block for a mapped file
+static u_int32_t allocate_map_block(struct fs_instance *fs)
+{
+	return allocate_block_as(fs, FAT_REF | FAT_REF_MAP | 1);
+}
+
+// Helper function, it fingerprints a data block. Four independent lanes keep
+// the multiplications from waiting on each other.
+static u_int64_t block_hash(const char *data)
+{
+	u_int64_t h[4] = { 0x9E3779B97F4A7C15ULL, 0xC2B2AE3D27D4EB4FULL,
+		0x165667B19E3779F9ULL, 0x27D4EB2F165667C5ULL };
+
+	for (size_t i = 0; i < BLOCK_SIZE; i += 4 * sizeof(u_int64_t)){
+		for (int l = 0; l < 4; l++){
+			u_int64_t w;
+			memcpy(&w, data + i + l * sizeof(u_int64_t), sizeof(w));
+			h[l] = (h[l] ^ w) * 0x9E3779B97F4A7C15ULL;
+			h[l] ^= h[l] >> 29;
+		}
+	}
+	return (h[0] ^ (h[1] << 1)) + (h[2] ^ (h[3] >> 1));
+}
+
+// Helper function, it returns the dedup index slot of fingerprint hash, or
+// NULL if the index cannot be allocated
+static struct dedup_slot *dedup_slot(struct fs_instance *fs, u_int64_t hash)
+{
+	if (fs->dedup == NULL){
+		fs->dedup = calloc(DEDUP_INDEX_SIZE, sizeof(struct dedup_slot));
+		if (fs->dedup == NULL){
+			return NULL;
+		}
+	}
+	return &fs->dedup[(hash ^ (hash >> 32)) % DEDUP_INDEX_SIZE];
+}
+
+// Helper function, it records that block blk holds data with fingerprint hash
+static void dedup_insert(struct fs_instance *fs, u_int64_t hash, u_int32_t blk)
+{
+	struct dedup_slot *slot = dedup_slot(fs, hash);
+	if (slot != NULL){
+		slot->hash = hash;
+		slot->blk = blk;
+	}
+}
+
+// Helper function, it looks for a block of a mapped file that holds data,
+// whose fingerprint is hash. Returns 0 if there is none.
+static u_int32_t dedup_find(struct fs_instance *fs, u_int64_t hash,
+	const char *data)
+{
+	struct dedup_slot *slot = dedup_slot(fs, hash);
+	if (slot == NULL || slot->blk == 0 || slot->hash != hash){
+		return 0;
+	}
+
+	// The block may have been freed or rewritten since it was indexed, and
+	// map blocks are never shared with data
+	u_int32_t value = get_next_block(fs, slot->blk);
+	char buf[BLOCK_SIZE];
+	if (!(value & FAT_REF) || (value & FAT_REF_MAP) ||
+		read_block(fs, FS_STATS_DATA, fs->data_blk + slot->blk, buf) == -1 ||
+		memcmp(buf, data, BLOCK_SIZE) != 0){
+		slot->blk = 0;
+		return 0;
+	}
+	return slot->blk;
+}
+
+// Map of a mapped file, with the leaf map block in use. Map blocks shared with
+// other files are copied before they are modified.
+struct map_cursor{
+	u_int32_t root; // Root map block, FAT_EOC if there is none yet
+	u_int32_t root_map[MAP_ENTRIES];
+	int root_dirty;
+	int root_shared;
+	u_int32_t leaf_index; // Index of leaf_map in root_map, MAP_ENTRIES if none
+	u_int32_t leaf_map[MAP_ENTRIES];
+	int leaf_dirty;
+	int leaf_shared;
+};
+
+// Helper function, it loads the map whose root map block is root
+static int map_open(struct fs_instance *fs, struct map_cursor *c, u_int32_t root)
+{
+	c->root = root;
+	c->root_dirty = 0;
+	c->root_shared = 0;
+	c->leaf_index = MAP_ENTRIES;
+	c->leaf_dirty = 0;
+	c->leaf_shared = 0;
+
+	if (root == FAT_EOC){
+		memset(c->root_map, 0, sizeof(c->root_map));
+		return 0;
+	}
+	c->root_shared = block_refs(fs, root) > 1;
+	return read_block(fs, FS_STATS_MAP, fs->data_blk + root, c->root_map);
+}
+
+// Helper function, it copies the n blocks listed in map (0 for none) to a new
+// map block, which then takes a reference to each of them. old is the shared
+// map block that held map, and loses a reference.
+static u_int32_t map_copy(struct fs_instance *fs, u_int32_t old,
+	const u_int32_t *map, u_int32_t n)
+{
+	u_int32_t blk = allocate_map_block(fs);
+	if (blk == FAT_EOC){
+		return FAT_EOC;
+	}
+
+	for (u_int32_t i = 0; i < n; i++){
+		if (map[i] != 0 && block_ref(fs, MAP_BLK(map[i])) == -1){
+			while (i-- > 0){
+				if (map[i] != 0){
+					release_block(fs, MAP_BLK(map[i]));
+				}
+			}
+			release_block(fs, blk);
+			return FAT_EOC;
+		}
+	}
+
+	release_block(fs, old);
+	return blk;
+}
+
+// Helper function, it makes sure the root map block can be modified
+static int map_own_root(struct fs_instance *fs, struct map_cursor *c)
+{
+	if (c->root == FAT_EOC){
+		c->root = allocate_map_block(fs);
+		if (c->root == FAT_EOC){
+			return -1;
+		}
+		c->root_dirty = 1;
+	} else if (c->root_shared){
+		u_int32_t root = map_copy(fs, c->root, c->root_map, MAP_ENTRIES);
+		if (root == FAT_EOC){
+			return -1;
+		}
+		c->root = root;
+		c->root_shared = 0;
+		c->root_dirty = 1;
+	}
+	return 0;
+}
+
+// Helper function, it writes the leaf map block in use back if it was modified
+static int map_flush_leaf(struct fs_instance *fs, struct map_cursor *c)
+{
+	if (!c->leaf_dirty){
+		return 0;
+	}
+
+	u_int32_t blk = c->root_map[c->leaf_index];
+	if (write_block(fs, FS_STATS_MAP, fs->data_blk + blk, c->leaf_map) == -1){
+		return -1;
+	}
+	c->leaf_dirty = 0;
+	return 0;
+}
+
+// Helper function, it loads leaf map block li, which is allocated if create is
+// set, along with the root map block if needed. Returns 1 if there is no such
+// leaf and create is not set.
+static int map_load_leaf(struct fs_instance *fs, struct map_cursor *c,
+	u_int32_t li, int create)
+{
+	if (c->leaf_index == li){
+		return 0;
+	}
+	if (map_flush_leaf(fs, c) == -1){
+		return -1;
+	}
+
+	u_int32_t blk = c->root_map[li];
+	if (blk == 0){
+		if (!create){
+			return 1;
+		}
+
+		// Map blocks are allocated before the data blocks they list, so
+		// that running out of space never leaves a data block unlisted
+		if (map_own_root(fs, c) == -1){
+			return -1;
+		}
+
+		blk = allocate_map_block(fs);
+		if (blk == FAT_EOC){
+			return -1;
+		}
+		c->root_map[li] = blk;
+		c->root_dirty = 1;
+		memset(c->leaf_map, 0, sizeof(c->leaf_map));
+		c->leaf_index = li;
+		c->leaf_dirty = 1;
+		c->leaf_shared = 0;
+		return 0;
+	}
+
+	c->leaf_index = MAP_ENTRIES;
+	if (read_block(fs, FS_STATS_MAP, fs->data_blk + blk, c->leaf_map) == -1){
+		return -1;
+	}
+	c->leaf_index = li;
+	c->leaf_shared = c->root_shared || block_refs(fs, blk) > 1;
+	return 0;
+}
+
+// Helper function, it makes sure the map slot of block lblk of the file can
+// be modified. Map blocks are allocated or copied as needed.
+static int map_prepare(struct fs_instance *fs, struct map_cursor *c,
+	u_int32_t lblk)
+{
+	u_int32_t li = lblk / MAP_ENTRIES;
+	if (map_load_leaf(fs, c, li, 1) == -1){
+		return -1;
+	}
+	if (!c->leaf_shared){
+		return 0;
+	}
+
+	// The root lists the leaf, so it is copied first
+	if (map_own_root(fs, c) == -1){
+		return -1;
+	}
+
+	u_int32_t old = c->root_map[li];
+	if (block_refs(fs, old) > 1){
+		u_int32_t blk = map_copy(fs, old, c->leaf_map, MAP_ENTRIES);
+		if (blk == FAT_EOC){
+			return -1;
+		}
+		c->root_map[li] = blk;
+		c->root_dirty = 1;
+		c->leaf_dirty = 1;
+	}
+	c->leaf_shared = 0;
+	return 0;
+}
+
+// Helper function, it gets the map slot of block lblk of the file
+static int map_get(struct fs_instance *fs, struct map_cursor *c,
+	u_int32_t lblk, u_int32_t *slot)
+{
+	int stat = map_load_leaf(fs, c, lblk / MAP_ENTRIES, 0);
+	if (stat == -1){
+		return -1;
+	}
+
+	*slot = stat == 1 ? 0 : c->leaf_map[lblk % MAP_ENTRIES];
+	return 0;
+}
+
+// Helper function, it sets the map slot of block lblk of the file
+static int map_set(struct fs_instance *fs, struct map_cursor *c,
+	u_int32_t lblk, u_int32_t slot)
+{
+	if (map_prepare(fs, c, lblk) == -1){
+		return -1;
+	}
+
+	c->leaf_map[lblk % MAP_ENTRIES] = slot;
+	c->leaf_dirty = 1;
+	return 0;
+}
+
+// Helper function, it writes the modified map blocks back, leaves first so
+// that the root never points to an unwritten leaf
+static int map_flush(struct fs_instance *fs, struct map_cursor *c)
+{
+	if (map_flush_leaf(fs, c) == -1){
+		return -1;
+	}
+	if (!c->root_dirty){
+		return 0;
+	}
+
+	if (write_block(fs, FS_STATS_MAP, fs->data_blk + c->root, c->root_map) == -1){
+		return -1;
+	}
+	c->root_dirty = 0;
+	return 0;
+}
+
+// Helper function, it frees a map and the data blocks it lists. Map blocks
+// shared with other files only lose a reference.
+static int map_free(struct fs_instance *fs, u_int32_t root)
+{
+	if (root == FAT_EOC){
+		return 0;
+	}
+	if (block_refs(fs, root) > 1){
+		return release_block(fs, root);
+	}
+
+	// The decompressed chunk may belong to this file
+	if (fs->zcache.root == root){
+		fs->zcache.root = FAT_EOC;
+	}
+
+	u_int32_t root_map[MAP_ENTRIES], leaf_map[MAP_ENTRIES];
+	if (read_block(fs, FS_STATS_MAP, fs->data_blk + root, root_map) == -1){
+		return -1;
+	}
+
+	for (u_int32_t i = 0; i < MAP_ENTRIES; i++){
+		if (root_map[i] == 0){
+			continue;
+		}
+		if (block_refs(fs, root_map[i]) > 1){
+			release_block(fs, root_map[i]);
+			continue;
+		}
+		if (read_block(fs, FS_STATS_MAP, fs->data_blk + root_map[i], leaf_map) == -1){
+			return -1;
+		}
+
+		for (u_int32_t j = 0; j < MAP_ENTRIES; j++){
+			if (leaf_map[j] != 0){
+				release_block(fs, MAP_BLK(leaf_map[j]));
+			}
+		}
+		release_block(fs, root_map[i]);
+	}
+
+	return release_block(fs, root);
+}
+
+// Helper function, it lists the chain of data blocks starting at first in a
+// new map, whose root map block is returned in root. The data blocks are not
+// moved, they only change hands. size is the size of the file.
+static int map_from_chain(struct fs_instance *fs, u_int32_t first,
+	u_int32_t size, u_int32_t *root)
+{
+	struct map_cursor c;
+	map_open(fs, &c, FAT_EOC);
+
+	int stat = 0;
+	u_int32_t lblk = 0, last = FAT_EOC;
+	for (u_int32_t blk = first; blk != FAT_EOC && stat == 0;
+		blk = get_next_block(fs, blk)){
+		if (lblk == size / BLOCK_SIZE){
+			last = blk;
+		}
+		stat = map_set(fs, &c, lblk++, blk);
+	}
+
+	// Chained files leave whatever was in their last block past their end,
+	// which would show through a hole after it
+	if (stat == 0 && last != FAT_EOC && size % BLOCK_SIZE != 0){
+		char buf[BLOCK_SIZE];
+		stat = data_read(fs, last, buf);
+		memset(buf + size % BLOCK_SIZE, 0, BLOCK_SIZE - size % BLOCK_SIZE);
+		if (stat == 0){
+			stat = data_write(fs, last, buf);
+		}
+	}
+	if (stat == 0){
+		stat = map_flush(fs, &c);
+	}
+
+	if (stat == -1){
+		// Only map blocks were allocated, the chain is untouched
+		for (u_int32_t i = 0; i < MAP_ENTRIES; i++){
+			if (c.root_map[i] != 0){
+				release_block(fs, c.root_map[i]);
+			}
+		}
+		if (c.root != FAT_EOC){
+			release_block(fs, c.root);
+		}
+		return -1;
+	}
+
+	u_int32_t blk = first;
+	while (blk != FAT_EOC){
+		u_int32_t next = get_next_block(fs, blk);
+		if (set_fat_entry(fs, blk, FAT_REF | 1) == -1){
+			return -1;
+		}
+		blk = next;
+	}
+
+	*root = c.root;
+	return 0;
+}
+
+// Helper function, it turns the file of directory entry ent, which is not
+// inline, into a mapped file
+static int file_to_mapped(struct fs_instance *fs, char *ent)
+{
+	u_int32_t first = entry_first(fs, ent);
+	if (set_feature(fs, FEATURE_MAPPED_FILES) == -1 ||
+		(first != FAT_EOC &&
+		map_from_chain(fs, first, entry_size(ent), &first) == -1)){
+		return -1;
+	}
+
+	entry_set_first(fs, ent, first);
+	entry_set_flags(fs, ent, entry_flags(fs, ent) | ENTRY_MAPPED);
+	return 0;
+}
+
+// Helper function, it frees the data of the file of directory entry ent
+static int free_file(struct fs_instance *fs, const char *ent)
+{
+	if (entry_flags(fs, ent) & ENTRY_MAPPED){
+		return map_free(fs, entry_first(fs, ent));
+	}
+
+	free_chain(fs, entry_first(fs, ent));
+	return 0;
+}
+
+// Helper function, it reads chunk ci of a compressed file into data
+// (CHUNK_SIZE bytes). Parts of the chunk that were never written read as
+// zeros.
+static int chunk_read(struct fs_instance *fs, struct map_cursor *c,
+	u_int32_t ci, char *data)
+{
+	u_int32_t slots[CHUNK_BLOCKS];
+	for (int j = 0; j < CHUNK_BLOCKS; j++){
+		if (map_get(fs, c, ci * CHUNK_BLOCKS + j, &slots[j]) == -1){
+			return -1;
+		}
+	}
+
+	if (!(slots[0] & MAP_COMPRESSED)){
+		for (int j = 0; j < CHUNK_BLOCKS; j++){
+			char *blk = data + j * BLOCK_SIZE;
+			if (slots[j] == 0){
+				memset(blk, 0, BLOCK_SIZE);
+			} else if (data_read(fs, slots[j], blk) == -1){
+				return -1;
+			}
+		}
+		return 0;
+	}
+
+	// Compressed chunks fit in less than CHUNK_BLOCKS blocks
+	char *z = malloc(CHUNK_SIZE);
+	if (z == NULL){
+		return -1;
+	}
+
+	int k = 0;
+	while (k < CHUNK_BLOCKS && slots[k] != 0){
+		if (data_read(fs, MAP_BLK(slots[k]), z + k * BLOCK_SIZE) == -1){
+			free(z);
+			return -1;
+		}
+		k++;
+	}
+
+	u_int32_t clen;
+	memcpy(&clen, z, sizeof(u_int32_t));
+	int len = -1;
+	if (clen <= k * BLOCK_SIZE - sizeof(u_int32_t)){
+		len = lz_decompress(z + sizeof(u_int32_t), clen, data, CHUNK_SIZE);
+	}
+	free(z);
+
+	if (len == -1){
+		return -1;
+	}
+	memset(data + len, 0, CHUNK_SIZE - len);
+	return 0;
+}
+
+// Helper function, it writes the first len bytes of data as chunk ci of a
+// compressed file. The chunk is written to new blocks, compressed if that
+// saves at least one block, and then its old blocks are freed.
+static int chunk_write(struct fs_instance *fs, struct map_cursor *c,
+	u_int32_t ci, char *data, size_t len)
+{
+	// Chunks never span two leaves, make sure the chunk's leaf can be
+	// modified before allocating data blocks
+	if (map_prepare(fs, c, ci * CHUNK_BLOCKS) == -1){
+		return -1;
+	}
+
+	u_int32_t old[CHUNK_BLOCKS], slots[CHUNK_BLOCKS];
+	for (int j = 0; j < CHUNK_BLOCKS; j++){
+		if (map_get(fs, c, ci * CHUNK_BLOCKS + j, &old[j]) == -1){
+			return -1;
+		}
+		slots[j] = 0;
+	}
+
+	char *z = malloc(CHUNK_SIZE);
+	if (z == NULL){
+		return -1;
+	}
+
+	size_t nraw = (len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	u_int32_t clen = 0;
+	if (nraw > 1){
+		clen = lz_compress(data, len, z + sizeof(u_int32_t),
+			(nraw - 1) * BLOCK_SIZE - sizeof(u_int32_t));
+	}
+
+	char *src = data;
+	int k = nraw;
+	if (clen > 0){
+		memcpy(z, &clen, sizeof(u_int32_t));
+		k = (clen + sizeof(u_int32_t) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+		memset(z + sizeof(u_int32_t) + clen, 0,
+			k * BLOCK_SIZE - sizeof(u_int32_t) - clen);
+		src = z;
+	}
+
+	int stat = 0;
+	for (int j = 0; j < k && stat == 0; j++){
+		slots[j] = allocate_data_block(fs);
+		if (slots[j] == FAT_EOC){
+			slots[j] = 0;
+			stat = -1;
+		} else {
+			stat = data_write(fs, slots[j], src + j * BLOCK_SIZE);
+		}
+	}
+	free(z);
+
+	if (stat == -1){
+		for (int j = 0; j < k; j++){
+			if (slots[j] != 0){
+				release_block(fs, slots[j]);
+			}
+		}
+		return -1;
+	}
+
+	if (clen > 0){
+		slots[0] |= MAP_COMPRESSED;
+	}
+	for (int j = 0; j < CHUNK_BLOCKS; j++){
+		if (map_set(fs, c, ci * CHUNK_BLOCKS + j, slots[j]) == -1){
+			return -1;
+		}
+	}
+	for (int j = 0; j < CHUNK_BLOCKS; j++){
+		if (old[j] != 0){
+			release_block(fs, MAP_BLK(old[j]));
+		}
+	}
+	return 0;
+}
+
+// Helper function, it stores data as block lblk of a mapped file, whose
+// current block is slot (0 if there is none). Shared blocks are copied on
+// write. With dedup, a block that already holds the same data is shared
+// instead of writing a new one.
+static int mapped_store(struct fs_instance *fs, struct map_cursor *c,
+	u_int32_t lblk, u_int32_t slot, const char *data, int dedup)
+{
+	// Copying shared map blocks tells which data blocks are shared
+	if (map_prepare(fs, c, lblk) == -1){
+		return -1;
+	}
+
+	u_int64_t hash = 0;
+	if (dedup){
+		hash = block_hash(data);
+		u_int32_t same = dedup_find(fs, hash, data);
+		if (same != 0 && same == slot){
+			return 0;
+		}
+		if (same != 0 && block_ref(fs, same) == 0){
+			if (map_set(fs, c, lblk, same) == -1){
+				release_block(fs, same);
+				return -1;
+			}
+			if (slot != 0){
+				release_block(fs, slot);
+			}
+			return 0;
+		}
+	}
+
+	u_int32_t blk = slot;
+	if (slot == 0 || block_refs(fs, slot) > 1){
+		blk = allocate_data_block(fs);
+		if (blk == FAT_EOC){
+			return -1;
+		}
+		if (data_write(fs, blk, data) == -1 ||
+			map_set(fs, c, lblk, blk) == -1){
+			release_block(fs, blk);
+			return -1;
+		}
+		if (slot != 0){
+			release_block(fs, slot);
+		}
+	} else if (data_write(fs, blk, data) == -1){
+		return -1;
+	}
+
+	if (dedup){
+		dedup_insert(fs, hash, blk);
+	}
+	return 0;
+}
+
+// Helper function, it writes to a mapped file. blkbuf holds the directory
+// block of the file's entry.
+static int mapped_write(struct fs_instance *fs,
+	struct file_descriptor *fd_entry, char *blkbuf, void *buf, size_t count)
+{
+	char *ent = &blkbuf[fd_entry->rootIndex];
+	u_int32_t size = entry_size(ent);
+	struct map_cursor c;
+	if (map_open(fs, &c, entry_first(fs, ent)) == -1){
+		return -1;
+	}
+
+	// Sizes must fit in an int
+	if (count > V2_MAX_FILE_SIZE - fd_entry->offset){
+		count = V2_MAX_FILE_SIZE - fd_entry->offset;
+	}
+
+	size_t pos = fd_entry->offset, done = 0;
+	if (entry_flags(fs, ent) & ENTRY_COMPRESSED){
+		char *data = malloc(CHUNK_SIZE);
+		if (data == NULL){
+			return -1;
+		}
+
+		// Cached chunks of this file are about to change
+		if (fs->zcache.root == c.root){
+			fs->zcache.root = FAT_EOC;
+		}
+
+		while (done < count){
+			u_int32_t ci = pos / CHUNK_SIZE;
+			size_t at = pos % CHUNK_SIZE;
+			size_t n = CHUNK_SIZE - at;
+			if (n > count - done){
+				n = count - done;
+			}
+
+			// Chunks are rewritten whole
+			if (n == CHUNK_SIZE){
+				memset(data, 0, CHUNK_SIZE);
+			} else if (chunk_read(fs, &c, ci, data) == -1){
+				break;
+			}
+			memcpy(data + at, (char *)buf + done, n);
+
+			size_t end = (size_t)ci * CHUNK_SIZE;
+			end = (size > pos + n ? size : pos + n) - end;
+			if (end > CHUNK_SIZE){
+				end = CHUNK_SIZE;
+			}
+			if (chunk_write(fs, &c, ci, data, end) == -1){
+				break;
+			}
+			done += n;
+			pos += n;
+		}
+		free(data);
+	} else {
+		int dedup = entry_flags(fs, ent) & ENTRY_DEDUP;
+		char temp_block[BLOCK_SIZE];
+		while (done < count){
+			u_int32_t lblk = pos / BLOCK_SIZE;
+			size_t at = pos % BLOCK_SIZE;
+			size_t n = BLOCK_SIZE - at;
+			if (n > count - done){
+				n = count - done;
+			}
+
+			u_int32_t slot;
+			if (map_get(fs, &c, lblk, &slot) == -1){
+				break;
+			}
+
+			// Blocks that were never written read as zeros
+			if (slot == 0){
+				memset(temp_block, 0, BLOCK_SIZE);
+			} else if (n < BLOCK_SIZE &&
+				data_read(fs, slot, temp_block) == -1){
+				break;
+			}
+			memcpy(temp_block + at, (char *)buf + done, n);
+
+			if (mapped_store(fs, &c, lblk, slot, temp_block, dedup) == -1){
+				break;
+			}
+			done += n;
+			pos += n;
+		}
+	}
+
+	// The map must be on disk before the entry points to it
+	if (map_flush(fs, &c) == -1){
+		return -1;
+	}
+	entry_set_first(fs, ent, c.root);
+
+	// A write that failed past the end does not leave a hole
+	fd_entry->offset += done;
+	if (done > 0 && fd_entry->offset > size){
+		entry_set_size(ent, fd_entry->offset);
+	}
+	if (write_block(fs, FS_STATS_DIR, fd_entry->rootBlk, blkbuf) == -1){
+		return -1;
+	}
+	return done;
+}
+
+// Helper function, it reads count bytes from a mapped file, whose directory
+// entry is ent. count does not go past the end of the file.
+static int mapped_read(struct fs_instance *fs,
+	struct file_descriptor *fd_entry, char *ent, void *buf, size_t count)
+{
+	struct map_cursor c;
+	if (map_open(fs, &c, entry_first(fs, ent)) == -1){
+		return -1;
+	}
+
+	size_t pos = fd_entry->offset, done = 0;
+	if (entry_flags(fs, ent) & ENTRY_COMPRESSED){
+		if (fs->zcache.data == NULL){
+			fs->zcache.data = malloc(CHUNK_SIZE);
+			fs->zcache.root = FAT_EOC;
+			if (fs->zcache.data == NULL){
+				return -1;
+			}
+		}
+
+		while (done < count){
+			u_int32_t ci = pos / CHUNK_SIZE;
+			size_t at = pos % CHUNK_SIZE;
+			size_t n = CHUNK_SIZE - at;
+			if (n > count - done){
+				n = count - done;
+			}
+
+			// Reading a chunk in small pieces only decompresses it once
+			if (fs->zcache.root != c.root || fs->zcache.chunk != ci){
+				fs->zcache.root = FAT_EOC;
+				if (chunk_read(fs, &c, ci, fs->zcache.data) == -1){
+					break;
+				}
+				fs->zcache.root = c.root;
+				fs->zcache.chunk = ci;
+			}
+			memcpy((char *)buf + done, fs->zcache.data + at, n);
+			done += n;
+			pos += n;
+		}
+	} else {
+		int dedup = entry_flags(fs, ent) & ENTRY_DEDUP;
+		char temp_block[BLOCK_SIZE];
+		while (done < count){
+			u_int32_t lblk = pos / BLOCK_SIZE;
+			size_t at = pos % BLOCK_SIZE;
+			size_t n = BLOCK_SIZE - at;
+			if (n > count - done){
+				n = count - done;
+			}
+
+			u_int32_t slot;
+			if (map_get(fs, &c, lblk, &slot) == -1){
+				break;
+			}
+			if (slot == 0){
+				memset((char *)buf + done, 0, n);
+			} else if (at == 0 && n == BLOCK_SIZE){
+				// Whole blocks are read straight into buf, as many
+				// consecutive blocks at a time as possible
+				size_t run = 1;
+				u_int32_t next;
+				while (run < IO_RUN_MAX && count - done >= (run + 1) * BLOCK_SIZE &&
+					map_get(fs, &c, lblk + run, &next) == 0 && next == slot + run){
+					run++;
+				}
+
+				size_t ok = data_read_run(fs, slot, run, (char *)buf + done);
+				for (size_t i = 0; dedup && i < ok; i++){
+					dedup_insert(fs, block_hash((char *)buf + done + i * BLOCK_SIZE),
+						slot + i);
+				}
+				done += ok * BLOCK_SIZE;
+				pos += ok * BLOCK_SIZE;
+				if (ok < run){
+					break;
+				}
+				continue;
+			} else {
+				if (data_read(fs, slot, temp_block) == -1){
+					break;
+				}
+				memcpy((char *)buf + done, temp_block + at, n);
+
+				// Copies of this file can then share its blocks
+				if (dedup){
+					dedup_insert(fs, block_hash(temp_block), slot);
+				}
+			}
+			done += n;
+			pos += n;
+		}
+	}
+
+	// count does not go past the end, so reading less means an error
+	if (done == 0){
+		return -1;
+	}
+	fd_entry->offset += done;
+	return done;
+}
+
+static int create_locked(struct fs_instance *fs, const char *filename)
+{
+	u_int32_t dir;
+	char name[FS_FILENAME_LEN];
+
+	if (!is_mounted(fs) || path_parent(fs, filename, &dir, name) == -1){
+		return -1;
+	}
+
+	return dir_add_entry(fs, dir, name, 0, FAT_EOC);
+}
+
+static int mkdir_locked(struct fs_instance *fs, const char *path)
+{
+	u_int32_t dir;
+	char name[FS_FILENAME_LEN];
+
+	if (!is_mounted(fs) || fs->version == 1 ||
+		path_parent(fs, path, &dir, name) == -1){
+		return -1;
+	}
+
+	// Older implementations would take directories for files
+	if (set_feature(fs, FEATURE_SUBDIRS) == -1){
+		return -1;
+	}
+
+	// A directory always has at least one block, which also identifies it
+	u_int32_t first = allocate_zeroed_block(fs);
+	if (first == FAT_EOC){
+		return -1;
+	}
+
+	if (dir_add_entry(fs, dir, name, ENTRY_DIR, first) == -1){
+		set_fat_entry(fs, first, 0);
+		return -1;
+	}
+	return 0;
+}
+
+// Helper function, it removes the file or directory path from fs
+static int remove_path(struct fs_instance *fs, const char *path, int is_dir)
+{
+	u_int32_t dir;
+	char name[FS_FILENAME_LEN];
+	struct dentry d;
+
+	if (path_parent(fs, path, &dir, name) == -1 ||
+		dentry_lookup(fs, dir, name, &d) != 0){
+		return -1; // No file with that name
+	}
+
+	if (!(d.flags & ENTRY_DIR) != !is_dir){
+		return -1;
+	}
+
+	char buf[4096];
+	if (read_block(fs, FS_STATS_DIR, d.blk, buf) == -1){
+		return -1;
+	}
+
+	if (is_dir){
+		// Only empty directories can be removed
+		char sub[4096];
+		struct dir_iter it;
+		for (dir_iter_init(fs, &it, d.first, NULL); it.blk != 0;
+			dir_iter_next(fs, &it, sub)){
+			if (read_block(fs, FS_STATS_DIR, it.blk, sub) == -1){
+				return -1;
+			}
+			for (int i = 0; i < ENTRIES_PER_BLK; i++){
+				if (sub[i*32] != '\0'){
+					return -1;
+				}
+			}
+		}
+	} else {
+		for (int j = 0; j < FS_OPEN_MAX_COUNT; j++){
+			if(fs->fds[j].used == 1 && fs->fds[j].rootBlk == d.blk &&
+				fs->fds[j].rootIndex == d.index){
+				return -1; // File is open
+			}
+		}
+	}
+
+	free_file(fs, &buf[d.index]);
+	return dir_remove_entry(fs, dir, name, buf, d.blk, d.index);
+}
+
+static int delete_locked(struct fs_instance *fs, const char *filename)
+{
+	if (!is_mounted(fs)){
+		return -1;
+	}
+
+	return remove_path(fs, filename, 0);
+}
+
+static int rmdir_locked(struct fs_instance *fs, const char *path)
+{
+	if (!is_mounted(fs) || fs->version == 1){
+		return -1;
+	}
+
+	return remove_path(fs, path, 1);
+}
+
+// Helper function, it lists the entries of directory dir
+static int dir_list(struct fs_instance *fs, u_int32_t dir)
+{
+	printf("FS Ls:\n");
+
+	char buf[4096];
+	struct dir_iter it;
+	for (dir_iter_init(fs, &it, dir, NULL); it.blk != 0;
+		dir_iter_next(fs, &it, buf)){
+		if (read_block(fs, FS_STATS_DIR, it.blk, buf) == -1){
+			return -1;
+		}
+
+		for (int i = dir_first_slot(fs, dir); i < ENTRIES_PER_BLK; i++){
+			if (buf[i*32] != '\0' && (u_int8_t)buf[i*32] != INLINE_MARK){
+				int index = i*32;
+				if (entry_flags(fs, &buf[index]) & ENTRY_DIR){
+					printf("dir: ");
+				} else {
+					printf("file: ");
+				}
+				for (int j = 0; j < 16; j++){
+					if (buf[index + j] == '\0'){
+						break;
+					}
+					printf("%c", buf[index + j]);
+				}
+				printf(", size: %u", entry_size(&buf[index]));
+
+				// Empty files are listed with the on-disk end of chain value
+				u_int32_t data_blk = entry_first(fs, &buf[index]);
+				if (fs->version == 1 && data_blk == FAT_EOC){
+					data_blk = 0xFFFF;
+				}
+				printf(", data_blk: %u\n", data_blk);
+			}
+		}
+	}
+	
+	return 0;
+}
+
+static int ls_locked(struct fs_instance *fs)
+{
+	if (!is_mounted(fs)){
+		return -1;
+	}
+
+	return dir_list(fs, ROOT_DIR);
+}
+
+static int lsdir_locked(struct fs_instance *fs, const char *path)
+{
+	u_int32_t dir;
+
+	if (!is_mounted(fs) || path_dir(fs, path, &dir) == -1){
+		return -1;
+	}
+
+	return dir_list(fs, dir);
+}
+
+static int open_locked(struct fs_instance *fs, const char *filename)
+{
+	u_int32_t dir;
+	char name[FS_FILENAME_LEN];
+	struct dentry d;
+
+	if (!is_mounted(fs) || path_parent(fs, filename, &dir, name) == -1 ||
+		dentry_lookup(fs, dir, name, &d) != 0 || (d.flags & ENTRY_DIR)){
+		return -1; // File name not found.
+	}
+
+	for (int j = 0; j < FS_OPEN_MAX_COUNT; j++){
+		if (fs->fds[j].used == 0){
+			fs->fds[j].used = 1;
+			fs->fds[j].offset = 0;
+			fs->fds[j].rootBlk = d.blk;
+			fs->fds[j].rootIndex = d.index;
+			fs->fds[j].advice = FS_ADVICE_NORMAL;
+			fs->fds[j].noreuse = 0;
+			fs->fds[j].readahead = 0;
+			return j;
+		}
+	}
+	return -1; // All file descriptors are used;
+}
+
+static int close_locked(struct fs_instance *fs, int fd)
+{
+	if (!is_mounted(fs) || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fs->fds[fd].used == 0){
+		return -1;
+	}
+
+	fs->fds[fd].used = 0;
+	fs->fds[fd].offset = 0;
+	fs->fds[fd].rootBlk = 0;
+	fs->fds[fd].rootIndex = 0;
+
+	return 0;
+
+}
+
+static int stat_locked(struct fs_instance *fs, int fd)
+{
+	if (!is_mounted(fs) || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fs->fds[fd].used == 0){
+		return -1;
+	}
+
+	char buf[4096];
+	if (read_block(fs, FS_STATS_DIR, fs->fds[fd].rootBlk, buf) == -1){
+		return -1;
+	}
+
+	return entry_size(&buf[fs->fds[fd].rootIndex]);
+}
+
+static int lseek_locked(struct fs_instance *fs, int fd, size_t offset)
+{
+	if (!is_mounted(fs) || fd < 0 || fd >= FS_OPEN_MAX_COUNT || fs->fds[fd].used == 0){
+		return -1;
+	}
+
+	// v2 files may have holes, as long as their size fits in their entry
+	if (fs->version == 1 ? (int)offset > stat_locked(fs, fd) :
+		offset > V2_MAX_FILE_SIZE){
+		return -1;
+	}
+
+	fs->fds[fd].offset = offset;
+	return 0;
+}
+
+static int setattr_locked(struct fs_instance *fs, const char *filename, int attrs)
+{
+	u_int32_t dir;
+	char name[FS_FILENAME_LEN];
+	struct dentry d;
+
+	if (!is_mounted(fs) || fs->version == 1 ||
+		(attrs & ~(FS_ATTR_COMPRESS | FS_ATTR_DEDUP)) ||
+		(attrs == (FS_ATTR_COMPRESS | FS_ATTR_DEDUP)) ||
+		path_parent(fs, filename, &dir, name) == -1 ||
+		dentry_lookup(fs, dir, name, &d) != 0 || (d.flags & ENTRY_DIR)){
+		return -1;
+	}
+
+	char buf[4096];
+	if (read_block(fs, FS_STATS_DIR, d.blk, buf) == -1){
+		return -1;
+	}
+
+	// Attributes decide how the data is laid out, so the file must be empty
+	char *ent = &buf[d.index];
+	if (entry_size(ent) != 0 || entry_first(fs, ent) != FAT_EOC){
+		return -1;
+	}
+
+	u_int8_t flags = entry_flags(fs, ent) &
+		~(ENTRY_INLINE | ENTRY_MAPPED | ENTRY_COMPRESSED | ENTRY_DEDUP);
+	if (attrs & FS_ATTR_COMPRESS){
+		flags |= ENTRY_MAPPED | ENTRY_COMPRESSED;
+		if (set_feature(fs, FEATURE_MAPPED_FILES) == -1){
+			return -1;
+		}
+	}
+	if (attrs & FS_ATTR_DEDUP){
+		flags |= ENTRY_MAPPED | ENTRY_DEDUP;
+		if (set_feature(fs, FEATURE_MAPPED_FILES | FEATURE_SHARED_BLOCKS) == -1){
+			return -1;
+		}
+	}
+	entry_set_flags(fs, ent, flags);
+	return write_block(fs, FS_STATS_DIR, d.blk, buf);
+}
+
+static int getattr_locked(struct fs_instance *fs, const char *filename)
+{
+	u_int32_t dir;
+	char name[FS_FILENAME_LEN];
+	struct dentry d;
+
+	if (!is_mounted(fs) || path_parent(fs, filename, &dir, name) == -1 ||
+		dentry_lookup(fs, dir, name, &d) != 0 || (d.flags & ENTRY_DIR)){
+		return -1;
+	}
+
+	char buf[4096];
+	if (read_block(fs, FS_STATS_DIR, d.blk, buf) == -1){
+		return -1;
+	}
+
+	int attrs = 0;
+	if (entry_flags(fs, &buf[d.index]) & ENTRY_COMPRESSED){
+		attrs |= FS_ATTR_COMPRESS;
+	}
+	if (entry_flags(fs, &buf[d.index]) & ENTRY_DEDUP){
+		attrs |= FS_ATTR_DEDUP;
+	}
+	return attrs;
+}
+
+// Helper function, it returns the index of the first free entry of FAT block
+// i, or the number of entries of the block if there is none
+static u_int32_t fat_blk_find_free(struct fs_instance *fs, u_int32_t i, void *blk)
+{
+	if (fs->version == 1){
+		return fat_find_free(blk, fat_blk_entries(fs, i), 0);
+	}
+	return fat32_find_free(blk, fat_blk_entries(fs, i), 0);
+}
+
+// Helper function, it allocates space for a block, whose FAT entry is set to
+// value
+static u_int32_t find_free_block_as(struct fs_instance *fs, u_int32_t value) {
+	// Nothing to look for, skip reading the FAT
+	if (fs->fat_unknown == 0 && fs->free_blk_count == 0) {
+		return FAT_EOC;
+	}
+
+    for (u_int32_t i = 0; i < fs->fat_blk_count; i++) {
+        // Full FAT block, no need to load it
+        if (fs->fat_free[i] == 0) {
+            continue;
+        }
+
+        void *fat_blk = fat_block(fs, i);
+        if (fat_blk == NULL) {
+            return FAT_EOC; // Failed to read
+		}
+
+        u_int32_t entries = fat_blk_entries(fs, i);
+        u_int32_t j = fat_blk_find_free(fs, i, fat_blk);
+
+        if (j < entries) {
+            if (set_fat_entry(fs, i * fs->fat_per_blk + j, value) == -1) {
+                return FAT_EOC;
+            }
+            return i * fs->fat_per_blk + j;
+        }
+
+        // The count was off, the block is actually full
+        fs->free_blk_count -= fs->fat_free[i];
+        fs->fat_free[i] = 0;
+    }
+    return FAT_EOC; // No free block
+}
+
+// Helper function, it allocates a block like find_free_block_as(), timing it
+// for fs_get_stats()
+static u_int32_t allocate_block_as(struct fs_instance *fs, u_int32_t value) {
+    uint64_t t = stats_begin();
+    u_int32_t blk = find_free_block_as(fs, value);
+    stats_end(t, FS_STATS_ALLOC, blk == FAT_EOC ? -1 : 0, 0);
+    return blk;
+}
+
+// Helper function, it allocates space for the last block of a chain
+static u_int32_t allocate_block(struct fs_instance *fs) {
+    return allocate_block_as(fs, FAT_EOC);
+}
+
+// Helper function, it gets the block after block in its chain, and extends the
+// chain with a new block if block is the last one. Returns FAT_EOC if no block
+// is left.
+static u_int32_t chain_extend(struct fs_instance *fs, u_int32_t block) {
+    uint32_t next = get_next_block(fs, block);
+    if (next == FAT_EOC) {
+        next = allocate_block(fs);
+        if (next != FAT_EOC) {
+            set_fat_entry(fs, block, next);
+        }
+    }
+    return next;
+}
+
+// Helper function, it copies len bytes between data and the inline data of
+// directory entry ent, starting at offset pos of the file
+static void inline_copy(char *ent, size_t pos, void *data, size_t len,
+	int store)
+{
+	size_t done = 0;
+	while (done < len){
+		char *slot = ent + ENTRY_SIZE * (1 + pos / INLINE_SLOT_DATA);
+		size_t at = pos % INLINE_SLOT_DATA;
+		size_t n = INLINE_SLOT_DATA - at;
+		if (n > len - done){
+			n = len - done;
+		}
+
+		if (store){
+			memcpy(slot + 1 + at, (char *)data + done, n);
+		} else {
+			memcpy((char *)data + done, slot + 1 + at, n);
+		}
+		done += n;
+		pos += n;
+	}
+}
+
+// Helper function, it moves the inline data of the file of fd_entry to a data
+// block. blkbuf holds the directory block of the file's entry.
+static int inline_to_blocks(struct fs_instance *fs,
+	struct file_descriptor *fd_entry, char *blkbuf)
+{
+	char *ent = &blkbuf[fd_entry->rootIndex];
+	u_int32_t data_blk = allocate_block(fs);
+	if (data_blk == FAT_EOC){
+		return -1;
+	}
+
+	// Write the data block before updating the entry, so that the file is
+	// never left without its data
+	char data[4096];
+	memset(data, 0, sizeof(data));
+	inline_copy(ent, 0, data, entry_size(ent), 0);
+	if (data_write(fs, data_blk, data) == -1){
+		set_fat_entry(fs, data_blk, 0);
+		return -1;
+	}
+
+	int slots = (u_int8_t)ent[25];
+	memset(ent + ENTRY_SIZE, 0, ENTRY_SIZE * slots);
+	ent[25] = 0;
+	entry_set_flags(fs, ent, entry_flags(fs, ent) & ~ENTRY_INLINE);
+	entry_set_first(fs, ent, data_blk);
+	if (write_block(fs, FS_STATS_DIR, fd_entry->rootBlk, blkbuf) == -1){
+		set_fat_entry(fs, data_blk, 0);
+		return -1;
+	}
+	rdir_slots_taken(fs, fd_entry->rootBlk, -slots);
+	return 0;
+}
+
+// Helper function, it writes to the file of fd_entry if it is small enough to
+// be kept inline. blkbuf holds the directory block of the file's entry.
+// Returns -2 if the data belongs in data blocks, in which case an inline file
+// was first moved to a data block.
+static int inline_write(struct fs_instance *fs,
+	struct file_descriptor *fd_entry, char *blkbuf, void *buf, size_t count)
+{
+	char *ent = &blkbuf[fd_entry->rootIndex];
+	int is_inline = entry_flags(fs, ent) & ENTRY_INLINE;
+
+	// Only empty files can become inline
+	if (!is_inline && (entry_first(fs, ent) != FAT_EOC ||
+		(entry_flags(fs, ent) & ENTRY_MAPPED))){
+		return -2;
+	}
+
+	size_t end = fd_entry->offset + count;
+	int slots = is_inline ? (u_int8_t)ent[25] : 0;
+	int need = (end + INLINE_SLOT_DATA - 1) / INLINE_SLOT_DATA;
+	int first = fd_entry->rootIndex / ENTRY_SIZE + 1;
+
+	// The data must fit in the free slots that follow the entry
+	int fits = end <= INLINE_MAX && first + need <= ENTRIES_PER_BLK;
+	for (int k = slots; fits && k < need; k++){
+		if (blkbuf[(first + k)*32] != '\0'){
+			fits = 0;
+		}
+	}
+
+	if (!fits){
+		if (is_inline && inline_to_blocks(fs, fd_entry, blkbuf) == -1){
+			return 0;
+		}
+		return -2;
+	}
+
+	if (set_feature(fs, FEATURE_INLINE_DATA) == -1){
+		return -1;
+	}
+
+	for (int k = slots; k < need; k++){
+		memset(&blkbuf[(first + k)*32], 0, ENTRY_SIZE);
+		blkbuf[(first + k)*32] = (char)INLINE_MARK;
+	}
+	if (need > slots){
+		ent[25] = need;
+	}
+	entry_set_flags(fs, ent, entry_flags(fs, ent) | ENTRY_INLINE);
+
+	inline_copy(ent, fd_entry->offset, buf, count, 1);
+	if (end > entry_size(ent)){
+		entry_set_size(ent, end);
+	}
+
+	if (write_block(fs, FS_STATS_DIR, fd_entry->rootBlk, blkbuf) == -1){
+		return -1;
+	}
+	if (need > slots){
+		rdir_slots_taken(fs, fd_entry->rootBlk, need - slots);
+	}
+	fd_entry->offset = end;
+	return count;
+}
+
+// Helper function, it implements fs_write_h(), except for writing back the
+// checksums of the blocks that were written
+static int file_write(struct fs_instance *fs, int fd, void *buf, size_t count)
+{
+    if (!is_mounted(fs) || buf == NULL || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fs->fds[fd].used) {
+        return -1;
+	}
+
+	if (count == 0) {
+		return 0;
+	}
+
+    struct file_descriptor *fd_entry = &fs->fds[fd];
+
+    // Load root directory block
+    uint8_t rdir_block[BLOCK_SIZE];
+    if (read_block(fs, FS_STATS_DIR, fd_entry->rootBlk, rdir_block) == -1) {
+        return -1;
+	}
+
+    // Read file size
+    uint32_t size = entry_size((char *)&rdir_block[fd_entry->rootIndex]);
+
+    // Mapped files list their blocks in a map rather than in the FAT
+    if (entry_flags(fs, (char *)&rdir_block[fd_entry->rootIndex]) & ENTRY_MAPPED) {
+        return mapped_write(fs, fd_entry, (char *)rdir_block, buf, count);
+    }
+
+    // Small files of v2 file systems are kept in their directory block
+    if (fs->version != 1) {
+        int ret = inline_write(fs, fd_entry, (char *)rdir_block, buf, count);
+        if (ret != -2) {
+            return ret;
+        }
+    }
+
+    // Writing past the end of the file leaves a hole, which only mapped files
+    // can have
+    if (fs->version != 1 && fd_entry->offset > size) {
+        if (file_to_mapped(fs, (char *)&rdir_block[fd_entry->rootIndex]) == -1 ||
+            write_block(fs, FS_STATS_DIR, fd_entry->rootBlk,
+                rdir_block) == -1) {
+            return 0;
+        }
+        return mapped_write(fs, fd_entry, (char *)rdir_block, buf, count);
+    }
+
+    // Get starting data block
+    uint32_t block = entry_first(fs, (char *)&rdir_block[fd_entry->rootIndex]);
+
+    // If file is empty, allocate first block
+    if (block == FAT_EOC) {
+        block = allocate_block(fs);
+
+		// Failed to allocate
+        if (block == FAT_EOC) {
             return 0;
 		}
-        memcpy(&rdir_block[fd_entry->rootIndex + 20], &block, sizeof(uint16_t));
+        entry_set_first(fs, (char *)&rdir_block[fd_entry->rootIndex], block);
     }
 
     // Traverse to the first writing block
     size_t skip = fd_entry->offset / BLOCK_SIZE;
-    uint16_t prev = 0xFFFF;
+    uint32_t prev = FAT_EOC;
 
     for (size_t i = 0; i <= skip; i++) {
 
 		// When writing past EOF, extend the file
-        if (block == 0xFFFF) {
-            uint16_t new_blk = allocate_block();
+        if (block == FAT_EOC) {
+            uint32_t new_blk = allocate_block(fs);
 
 			// If failed to allocate the next block, write nothing and return
-            if (new_blk == 0xFFFF) {
+            if (new_blk == FAT_EOC) {
                 return 0;
 			}
 
 			// Update the new_block as EOF
-            set_fat_entry(prev, new_blk);
-            set_fat_entry(new_blk, 0xFFFF);
+            set_fat_entry(fs, prev, new_blk);
+            set_fat_entry(fs, new_blk, FAT_EOC);
             block = new_blk;
         }
 
 		// Skip until the first writing block
 		if (i < skip) {
 			prev = block;
-			block = get_next_block(block);
+			block = get_next_block(fs, block);
 		}
     }
 
@@ -470,9 +3479,34 @@ int fs_write(int fd, void *buf, size_t count)
     size_t bytes_written = 0;
     uint8_t temp_block[BLOCK_SIZE];
 
-    while (bytes_written < count && block != 0xFFFF) {
+    while (bytes_written < count && block != FAT_EOC) {
+        // Whole blocks are written straight from buf, as many consecutive
+        // blocks at a time as possible
+        if (offset == 0 && count - bytes_written >= BLOCK_SIZE) {
+            size_t n = 1;
+            uint32_t next = FAT_EOC;
+            while (count - bytes_written > n * BLOCK_SIZE) {
+                next = chain_extend(fs, block + n - 1);
+                if (next != block + n || n == IO_RUN_MAX ||
+                    count - bytes_written < (n + 1) * BLOCK_SIZE) {
+                    break;
+                }
+                n++;
+                next = FAT_EOC;
+            }
+
+            if (data_write_run(fs, block, n, (uint8_t *)buf + bytes_written) == -1) {
+                break;
+            }
+            bytes_written += n * BLOCK_SIZE;
+            block = next;
+            continue;
+        }
+
         if (offset > 0 || count - bytes_written < BLOCK_SIZE) {
-            block_read(infoSuperblock.data_blk + block, temp_block);
+            if (data_read(fs, block, temp_block) == -1) {
+                break;
+            }
 		}
         else {
             memset(temp_block, 0, BLOCK_SIZE);
@@ -483,40 +3517,176 @@ int fs_write(int fd, void *buf, size_t count)
             to_write = count - bytes_written;
 		}
 
-        memcpy(temp_block + offset, (uint8_t *)buf + bytes_written, to_write);
-        block_write(infoSuperblock.data_blk + block, temp_block);
-
-        bytes_written += to_write;
-        offset = 0;
+        memcpy(temp_block + offset, (uint8_t *)buf + bytes_written, to_write);
+        data_write(fs, block, temp_block);
+
+        bytes_written += to_write;
+        offset = 0;
+
+        if (bytes_written < count) {
+            block = chain_extend(fs, block);
+        }
+    }
+
+    fd_entry->offset += bytes_written;
+
+    if (fd_entry->offset > size) {
+        entry_set_size((char *)&rdir_block[fd_entry->rootIndex], fd_entry->offset);
+    }
+
+    write_block(fs, FS_STATS_DIR, fd_entry->rootBlk, rdir_block);
+    return bytes_written;
+}
+
+// What advise_blocks() does with the blocks of a file
+struct advise_op{
+	int prefetch; // Read them into memory
+	int once; // Drop them once read
+	int forget; // Drop the copies held in memory
+	int posix; // Hint passed down to the disk, -1 for none
+};
+
+// Helper function, it applies op to the n data blocks from blk on
+static void advise_run(struct fs_instance *fs, u_int32_t blk, u_int32_t n,
+	const struct advise_op *op)
+{
+	if (n == 0){
+		return;
+	}
+	if (op->prefetch){
+		buf_queue(fs, blk, n, op->once);
+	}
+	if (op->forget){
+		buf_forget(fs, fs->data_blk + blk, n);
+	}
+	// Hints are only hints, the disk may not take them
+	if (op->posix != -1){
+		block_advise_h(fs->disk, fs->data_blk + blk, n, op->posix);
+	}
+}
+
+// Helper function, it applies op to the data blocks holding file blocks first
+// to last - 1 of the file open as f, a run of consecutive blocks at a time
+static int advise_blocks(struct fs_instance *fs, struct file_descriptor *f,
+	u_int32_t first, u_int32_t last, const struct advise_op *op)
+{
+	char buf[BLOCK_SIZE];
+	if (read_block(fs, FS_STATS_DIR, f->rootBlk, buf) == -1){
+		return -1;
+	}
+	char *ent = &buf[f->rootIndex];
+	u_int32_t size = entry_size(ent);
+	u_int32_t end = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	if (last > end){
+		last = end;
+	}
+	if (first >= last || (entry_flags(fs, ent) & ENTRY_INLINE)){
+		return 0;
+	}
+
+	u_int32_t run = 0, n = 0;
+	if (entry_flags(fs, ent) & ENTRY_MAPPED){
+		// Compressed chunks are read whole, whatever their size
+		if (entry_flags(fs, ent) & ENTRY_COMPRESSED){
+			first -= first % CHUNK_BLOCKS;
+			last += (CHUNK_BLOCKS - last % CHUNK_BLOCKS) % CHUNK_BLOCKS;
+		}
+
+		struct map_cursor c;
+		if (map_open(fs, &c, entry_first(fs, ent)) == -1){
+			return -1;
+		}
+		for (u_int32_t lblk = first; lblk < last; lblk++){
+			u_int32_t slot;
+			if (map_get(fs, &c, lblk, &slot) == -1){
+				return -1;
+			}
+			if (slot == 0){
+				continue;
+			}
+			if (n > 0 && MAP_BLK(slot) == run + n && n < IO_RUN_MAX){
+				n++;
+				continue;
+			}
+			advise_run(fs, run, n, op);
+			run = MAP_BLK(slot);
+			n = 1;
+		}
+	} else {
+		u_int32_t blk = entry_first(fs, ent);
+		for (u_int32_t i = 0; i < first && blk != FAT_EOC; i++){
+			blk = get_next_block(fs, blk);
+		}
+		for (u_int32_t lblk = first; lblk < last && blk != FAT_EOC; lblk++){
+			if (n > 0 && blk == run + n && n < IO_RUN_MAX){
+				n++;
+			} else {
+				advise_run(fs, run, n, op);
+				run = blk;
+				n = 1;
+			}
+			blk = get_next_block(fs, blk);
+		}
+	}
+	advise_run(fs, run, n, op);
+	return 0;
+}
+
+// Helper function, it applies the hints of the file open as fd after count
+// bytes were read from it at offset, or written to it
+static void advise_after(struct fs_instance *fs, int fd, size_t offset,
+	size_t count, int read)
+{
+	struct file_descriptor *f = &fs->fds[fd];
+	u_int32_t next = (offset + count) / BLOCK_SIZE;
 
-        if (bytes_written < count) {
-            uint16_t next = get_next_block(block);
-            if (next == 0xFFFF) {
-                next = allocate_block();
-                if (next == 0xFFFF){
-                    break;
-				}
+	// The data read or written is not kept, by libfs or by the disk
+	if (f->noreuse){
+		struct advise_op op = { 0, 0, 1, POSIX_FADV_DONTNEED };
+		advise_blocks(fs, f, offset / BLOCK_SIZE,
+			(offset + count + BLOCK_SIZE - 1) / BLOCK_SIZE, &op);
+	}
 
-                set_fat_entry(block, next);
-                set_fat_entry(next, 0xFFFF);
-            }
-            block = next;
-        }
-    }
+	// Sequential readers read ahead once half of the blocks read ahead
+	// are consumed, so that the prefetch thread reads large runs
+	if (read && f->advice == FS_ADVICE_SEQUENTIAL &&
+		f->readahead < next + READAHEAD_BLOCKS / 2){
+		struct advise_op op = { 1, f->noreuse, 0, -1 };
+		u_int32_t from = f->readahead > next ? f->readahead : next;
+		f->readahead = next + READAHEAD_BLOCKS;
+		advise_blocks(fs, f, from, f->readahead, &op);
+	}
+}
 
-    fd_entry->offset += bytes_written;
+// Helper function, it returns the offset of fd if it is open
+static size_t fd_offset(struct fs_instance *fs, int fd)
+{
+	if (!is_mounted(fs) || fd < 0 || fd >= FS_OPEN_MAX_COUNT ||
+		!fs->fds[fd].used){
+		return 0;
+	}
+	return fs->fds[fd].offset;
+}
 
-    if (fd_entry->offset > size) {
-        memcpy(&rdir_block[fd_entry->rootIndex + 16], &fd_entry->offset, sizeof(uint32_t));
-    }
+// The offset of fd before the call is returned in offset, for traces
+static int write_locked(struct fs_instance *fs, int fd, void *buf, size_t count,
+	size_t *offset)
+{
+	*offset = fd_offset(fs, fd);
 
-    block_write(infoSuperblock.rdir_blk, rdir_block);
-    return bytes_written;
+	int ret = file_write(fs, fd, buf, count);
+	if (ret > 0 && fs->csum_blk_count != 0 && csum_flush(fs) == -1){
+		return -1;
+	}
+	if (ret > 0 && fs->fds[fd].noreuse){
+		advise_after(fs, fd, *offset, ret, 0);
+	}
+	return ret;
 }
 
-int fs_read(int fd, void *buf, size_t count)
+static int file_read(struct fs_instance *fs, int fd, void *buf, size_t count)
 {
-    if (!fs_mounted || buf == NULL || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fds[fd].used) {
+    if (!is_mounted(fs) || buf == NULL || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fs->fds[fd].used) {
         return -1;
 	}
 
@@ -524,17 +3694,16 @@ int fs_read(int fd, void *buf, size_t count)
 		return 0;
 	}
 
-    struct file_descriptor *fd_entry = &fds[fd];
+    struct file_descriptor *fd_entry = &fs->fds[fd];
 
     // Load root directory block
     uint8_t rdir_block[BLOCK_SIZE];
-    if (block_read(infoSuperblock.rdir_blk, rdir_block) == -1) {
+    if (read_block(fs, FS_STATS_DIR, fd_entry->rootBlk, rdir_block) == -1) {
         return -1;
 	}
 
     // Read file size
-    uint32_t size;
-    memcpy(&size, &rdir_block[fd_entry->rootIndex + 16], sizeof(uint32_t));
+    uint32_t size = entry_size((char *)&rdir_block[fd_entry->rootIndex]);
 
 	// Read nothing if it goes beyond EOF
     if (fd_entry->offset >= size) {
@@ -542,8 +3711,7 @@ int fs_read(int fd, void *buf, size_t count)
 	}
 
     // Get starting data block
-    uint16_t block;
-    memcpy(&block, &rdir_block[fd_entry->rootIndex + 20], sizeof(uint16_t));
+    uint32_t block = entry_first(fs, (char *)&rdir_block[fd_entry->rootIndex]);
 
 
 	// Prevent go out of bound
@@ -551,24 +3719,63 @@ int fs_read(int fd, void *buf, size_t count)
         count = size - fd_entry->offset;
 	}
 
+    // Inline files need no other block
+    char *ent = (char *)&rdir_block[fd_entry->rootIndex];
+    if (entry_flags(fs, ent) & ENTRY_INLINE) {
+        inline_copy(ent, fd_entry->offset, buf, count, 0);
+        fd_entry->offset += count;
+        return count;
+    }
+    if (entry_flags(fs, ent) & ENTRY_MAPPED) {
+        return mapped_read(fs, fd_entry, ent, buf, count);
+    }
+
     size_t bytes_read = 0;
     uint8_t temp_block[BLOCK_SIZE];
 
     // Traverse to the first reading block
     size_t skip = fd_entry->offset / BLOCK_SIZE;
-    for (size_t i = 0; i < skip && block != 0xFFFF; i++) {
-        block = get_next_block(block);
+    for (size_t i = 0; i < skip && block != FAT_EOC; i++) {
+        block = get_next_block(fs, block);
     }
 
 	// Nothing to read, return 0
-    if (block == 0xFFFF) {
+    if (block == FAT_EOC) {
         return 0;
 	}
 
     size_t offset = fd_entry->offset % BLOCK_SIZE;
-    while (bytes_read < count && block != 0xFFFF) {
+    while (bytes_read < count && block != FAT_EOC) {
+        // Whole blocks are read straight into buf, as many consecutive blocks
+        // at a time as possible
+        if (offset == 0 && count - bytes_read >= BLOCK_SIZE) {
+            size_t n = 1;
+            uint32_t next = get_next_block(fs, block);
+            while (n < IO_RUN_MAX && next == block + n &&
+                count - bytes_read >= (n + 1) * BLOCK_SIZE) {
+                n++;
+                next = get_next_block(fs, next);
+            }
+
+            size_t done = data_read_run(fs, block, n, (uint8_t *)buf + bytes_read);
+            bytes_read += done * BLOCK_SIZE;
+            if (done < n) {
+                if (bytes_read == 0) {
+                    return -1;
+                }
+                break;
+            }
+            block = next;
+            continue;
+        }
+
 		// Read the correct block to temp_block, in case of having offset != 0
-        block_read(infoSuperblock.data_blk + block, temp_block);
+        if (data_read(fs, block, temp_block) == -1) {
+            if (bytes_read == 0) {
+                return -1;
+            }
+            break;
+        }
         size_t to_read = BLOCK_SIZE - offset;
 
 		// Prevent go out of bound
@@ -580,10 +3787,595 @@ int fs_read(int fd, void *buf, size_t count)
         memcpy((uint8_t *)buf + bytes_read, temp_block + offset, to_read);
         bytes_read += to_read;
         offset = 0; // Offset stays 0 after reading the first block
-        block = get_next_block(block);
+        block = get_next_block(fs, block);
     }
 
 	// Update offset and return the # of bytes read
     fd_entry->offset += bytes_read;
     return bytes_read;
-}
\ No newline at end of file
+}
+
+// The offset of fd before the call is returned in offset, for traces
+static int read_locked(struct fs_instance *fs, int fd, void *buf, size_t count,
+	size_t *offset)
+{
+	*offset = fd_offset(fs, fd);
+
+	int ret = file_read(fs, fd, buf, count);
+	if (ret > 0){
+		advise_after(fs, fd, *offset, ret, 1);
+	}
+	return ret;
+}
+
+static int advise_locked(struct fs_instance *fs, int fd, size_t offset,
+	size_t len, int advice)
+{
+	if (!is_mounted(fs) || fd < 0 || fd >= FS_OPEN_MAX_COUNT || !fs->fds[fd].used){
+		return -1;
+	}
+
+	struct file_descriptor *f = &fs->fds[fd];
+	struct advise_op op = { 0, 0, 0, -1 };
+	switch (advice){
+	case FS_ADVICE_NORMAL:
+		f->advice = advice;
+		f->noreuse = 0;
+		op.posix = POSIX_FADV_NORMAL;
+		break;
+	case FS_ADVICE_SEQUENTIAL:
+		f->advice = advice;
+		f->readahead = 0;
+		op.posix = POSIX_FADV_SEQUENTIAL;
+		break;
+	case FS_ADVICE_RANDOM:
+		f->advice = advice;
+		op.posix = POSIX_FADV_RANDOM;
+		break;
+	case FS_ADVICE_WILLNEED:
+		op.prefetch = 1;
+		op.once = f->noreuse;
+		op.posix = POSIX_FADV_WILLNEED;
+		break;
+	case FS_ADVICE_DONTNEED:
+		op.forget = 1;
+		op.posix = POSIX_FADV_DONTNEED;
+		break;
+	case FS_ADVICE_NOREUSE:
+		f->noreuse = 1;
+		op.posix = POSIX_FADV_NOREUSE;
+		break;
+	default:
+		return -1;
+	}
+
+	// Files are smaller than 4 GiB, and so are their offsets
+	if (offset > UINT32_MAX){
+		return 0;
+	}
+	u_int32_t first = offset / BLOCK_SIZE, last = UINT32_MAX;
+	if (len != 0 && len <= UINT32_MAX - offset){
+		last = (offset + len + BLOCK_SIZE - 1) / BLOCK_SIZE;
+	}
+	advise_blocks(fs, f, first, last, &op);
+	return 0;
+}
+
+static int clone_locked(struct fs_instance *fs, const char *src, const char *dst)
+{
+	u_int32_t dir, dst_dir;
+	char name[FS_FILENAME_LEN], dst_name[FS_FILENAME_LEN];
+	struct dentry d;
+
+	if (!is_mounted(fs) || fs->version == 1 ||
+		path_parent(fs, src, &dir, name) == -1 ||
+		dentry_lookup(fs, dir, name, &d) != 0 || (d.flags & ENTRY_DIR) ||
+		path_parent(fs, dst, &dst_dir, dst_name) == -1){
+		return -1;
+	}
+
+	char buf[4096];
+	if (read_block(fs, FS_STATS_DIR, d.blk, buf) == -1){
+		return -1;
+	}
+
+	char *ent = &buf[d.index];
+	u_int8_t flags = entry_flags(fs, ent);
+	u_int32_t size = entry_size(ent);
+	u_int32_t first = entry_first(fs, ent);
+
+	// Inline data is small enough to be copied
+	if (flags & ENTRY_INLINE){
+		char data[INLINE_MAX];
+		inline_copy(ent, 0, data, size, 0);
+		if (dir_add_entry(fs, dst_dir, dst_name, 0, FAT_EOC) == -1){
+			return -1;
+		}
+
+		int fd = open_locked(fs, dst);
+		size_t offset;
+		int written = fd == -1 ? -1 :
+			write_locked(fs, fd, data, size, &offset);
+		if (fd != -1){
+			close_locked(fs, fd);
+		}
+		if (written != (int)size){
+			remove_path(fs, dst, 0);
+			return -1;
+		}
+		return 0;
+	}
+
+	// Blocks can only be shared through a map, so chained files become
+	// mapped files first
+	if (!(flags & ENTRY_MAPPED) && first != FAT_EOC){
+		if (file_to_mapped(fs, ent) == -1 ||
+			write_block(fs, FS_STATS_DIR, d.blk, buf) == -1){
+			return -1;
+		}
+		flags = entry_flags(fs, ent);
+		first = entry_first(fs, ent);
+	}
+
+	// Both files share the root map block, the rest of the map is only
+	// copied as either of them modifies it
+	if (first != FAT_EOC && (set_feature(fs, FEATURE_SHARED_BLOCKS) == -1 ||
+		block_ref(fs, first) == -1)){
+		return -1;
+	}
+	if (dir_add_entry(fs, dst_dir, dst_name, flags, first) == -1){
+		if (first != FAT_EOC){
+			release_block(fs, first);
+		}
+		return -1;
+	}
+	if (size == 0){
+		return 0;
+	}
+
+	if (dentry_lookup(fs, dst_dir, dst_name, &d) != 0 ||
+		read_block(fs, FS_STATS_DIR, d.blk, buf) == -1){
+		return -1;
+	}
+	entry_set_size(&buf[d.index], size);
+	return write_block(fs, FS_STATS_DIR, d.blk, buf);
+}
+
+/*
+ * Handle-based functions. Calls on a file system are serialized by its lock,
+ * which the functions they are implemented by rely on.
+ */
+
+// Helper function, it takes the lock of fs, if fs is a file system at all
+static void lock_fs(struct fs_instance *fs)
+{
+	if (fs != NULL){
+		pthread_mutex_lock(&fs->lock);
+	}
+}
+
+static void unlock_fs(struct fs_instance *fs)
+{
+	if (fs != NULL){
+		pthread_mutex_unlock(&fs->lock);
+	}
+}
+
+int fs_info_h(fs_handle_t fs)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = info_locked(fs);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_INFO, ret, 0);
+}
+
+int fs_statfs_h(fs_handle_t fs, struct fs_statfs *st)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = statfs_locked(fs, st);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_STATFS, ret, 0);
+}
+
+int fs_create_h(fs_handle_t fs, const char *filename)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = create_locked(fs, filename);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_CREATE, ret, 0);
+}
+
+int fs_delete_h(fs_handle_t fs, const char *filename)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = delete_locked(fs, filename);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_DELETE, ret, 0);
+}
+
+int fs_ls_h(fs_handle_t fs)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = ls_locked(fs);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_LS, ret, 0);
+}
+
+int fs_mkdir_h(fs_handle_t fs, const char *path)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = mkdir_locked(fs, path);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_MKDIR, ret, 0);
+}
+
+int fs_rmdir_h(fs_handle_t fs, const char *path)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = rmdir_locked(fs, path);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_RMDIR, ret, 0);
+}
+
+int fs_lsdir_h(fs_handle_t fs, const char *path)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = lsdir_locked(fs, path);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_LSDIR, ret, 0);
+}
+
+int fs_open_h(fs_handle_t fs, const char *filename)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = open_locked(fs, filename);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_OPEN, ret, 0);
+}
+
+int fs_close_h(fs_handle_t fs, int fd)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = close_locked(fs, fd);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_CLOSE, ret, 0);
+}
+
+int fs_stat_h(fs_handle_t fs, int fd)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = stat_locked(fs, fd);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_STAT, ret, 0);
+}
+
+int fs_lseek_h(fs_handle_t fs, int fd, size_t offset)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = lseek_locked(fs, fd, offset);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_LSEEK, ret, 0);
+}
+
+int fs_setattr_h(fs_handle_t fs, const char *filename, int attrs)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = setattr_locked(fs, filename, attrs);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_SETATTR, ret, 0);
+}
+
+int fs_getattr_h(fs_handle_t fs, const char *filename)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = getattr_locked(fs, filename);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_GETATTR, ret, 0);
+}
+
+int fs_clone_h(fs_handle_t fs, const char *src, const char *dst)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = clone_locked(fs, src, dst);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_CLONE, ret, 0);
+}
+
+int fs_write_h(fs_handle_t fs, int fd, void *buf, size_t count)
+{
+	uint64_t t = stats_begin();
+	size_t offset;
+	lock_fs(fs);
+	int ret = write_locked(fs, fd, buf, count, &offset);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_WRITE, ret, ret > 0 ? ret : 0);
+}
+
+int fs_read_h(fs_handle_t fs, int fd, void *buf, size_t count)
+{
+	uint64_t t = stats_begin();
+	size_t offset;
+	lock_fs(fs);
+	int ret = read_locked(fs, fd, buf, count, &offset);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_READ, ret, ret > 0 ? ret : 0);
+}
+
+int fs_advise_h(fs_handle_t fs, int fd, size_t offset, size_t len, int advice)
+{
+	uint64_t t = stats_begin();
+	lock_fs(fs);
+	int ret = advise_locked(fs, fd, offset, len, advice);
+	unlock_fs(fs);
+	return stats_end(t, FS_STATS_ADVISE, ret, 0);
+}
+
+/*
+ * Functions working on the default instance, whose calls are traced. Calls are
+ * traced before the lock of the instance is released, so that the trace lists
+ * them in the order they ran, and replays them the same way.
+ */
+
+int fs_mkfs(const char *diskname, size_t data_blk_count,
+	const struct fs_mkfs_options *opts)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	int ret = stats_end(st, FS_STATS_MKFS,
+		mkfs_disk(diskname, data_blk_count, opts), 0);
+	if (t){
+		int flags = opts ? opts->version | opts->hashed_dir << 8 |
+			opts->checksums << 9 : 0;
+		trace_end(t, FS_TRACE_MKFS, flags, data_blk_count,
+			opts ? opts->rdir_entry_count : 0, ret, diskname, NULL);
+	}
+	return ret;
+}
+
+int fs_mount(const char *diskname)
+{
+	return fs_mount_ex(diskname, NULL);
+}
+
+int fs_mount_ex(const char *diskname, const struct fs_mount_options *opts)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = mount_instance(&default_fs, diskname, opts);
+	if (t){
+		trace_end(t, FS_TRACE_MOUNT, opts ? opts->lazy : 0,
+			opts ? opts->fat_cache_max : 0, 0, ret, diskname, NULL);
+	}
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_MOUNT, ret, 0);
+}
+
+// Helper function, it traces a call that takes no argument or only a name
+static int traced(uint64_t t, int op, int ret, const char *name)
+{
+	if (t){
+		trace_end(t, op, -1, 0, 0, ret, name, NULL);
+	}
+	return ret;
+}
+
+// Helper function, it traces a call on file descriptor fd
+static int traced_fd(uint64_t t, int op, int fd, size_t offset, size_t size,
+	int ret)
+{
+	if (t){
+		trace_end(t, op, fd, offset, size, ret, NULL, NULL);
+	}
+	return ret;
+}
+
+int fs_umount(void)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_UMOUNT, umount_instance(&default_fs),
+		NULL);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_UMOUNT, ret, 0);
+}
+
+int fs_info(void)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_INFO, info_locked(&default_fs), NULL);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_INFO, ret, 0);
+}
+
+int fs_statfs(struct fs_statfs *stfs)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_STATFS, statfs_locked(&default_fs, stfs),
+		NULL);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_STATFS, ret, 0);
+}
+
+int fs_create(const char *filename)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_CREATE,
+		create_locked(&default_fs, filename), filename);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_CREATE, ret, 0);
+}
+
+int fs_delete(const char *filename)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_DELETE,
+		delete_locked(&default_fs, filename), filename);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_DELETE, ret, 0);
+}
+
+int fs_ls(void)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_LS, ls_locked(&default_fs), NULL);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_LS, ret, 0);
+}
+
+int fs_setattr(const char *filename, int attrs)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = setattr_locked(&default_fs, filename, attrs);
+	if (t){
+		trace_end(t, FS_TRACE_SETATTR, -1, 0, attrs, ret, filename,
+			NULL);
+	}
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_SETATTR, ret, 0);
+}
+
+int fs_getattr(const char *filename)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_GETATTR,
+		getattr_locked(&default_fs, filename), filename);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_GETATTR, ret, 0);
+}
+
+int fs_clone(const char *src, const char *dst)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = clone_locked(&default_fs, src, dst);
+	if (t){
+		trace_end(t, FS_TRACE_CLONE, -1, 0, 0, ret, src ? src : "",
+			dst ? dst : "");
+	}
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_CLONE, ret, 0);
+}
+
+int fs_mkdir(const char *path)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_MKDIR, mkdir_locked(&default_fs, path),
+		path);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_MKDIR, ret, 0);
+}
+
+int fs_rmdir(const char *path)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_RMDIR, rmdir_locked(&default_fs, path),
+		path);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_RMDIR, ret, 0);
+}
+
+int fs_lsdir(const char *path)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_LSDIR, lsdir_locked(&default_fs, path),
+		path);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_LSDIR, ret, 0);
+}
+
+int fs_open(const char *filename)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced(t, FS_TRACE_OPEN, open_locked(&default_fs, filename),
+		filename);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_OPEN, ret, 0);
+}
+
+int fs_close(int fd)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced_fd(t, FS_TRACE_CLOSE, fd, 0, 0,
+		close_locked(&default_fs, fd));
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_CLOSE, ret, 0);
+}
+
+int fs_stat(int fd)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced_fd(t, FS_TRACE_STAT, fd, 0, 0,
+		stat_locked(&default_fs, fd));
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_STAT, ret, 0);
+}
+
+int fs_lseek(int fd, size_t offset)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	lock_fs(&default_fs);
+	int ret = traced_fd(t, FS_TRACE_LSEEK, fd, offset, 0,
+		lseek_locked(&default_fs, fd, offset));
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_LSEEK, ret, 0);
+}
+
+int fs_write(int fd, void *buf, size_t count)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	size_t offset;
+	lock_fs(&default_fs);
+	int ret = write_locked(&default_fs, fd, buf, count, &offset);
+	traced_fd(t, FS_TRACE_WRITE, fd, offset, count, ret);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_WRITE, ret, ret > 0 ? ret : 0);
+}
+
+int fs_read(int fd, void *buf, size_t count)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	size_t offset;
+	lock_fs(&default_fs);
+	int ret = read_locked(&default_fs, fd, buf, count, &offset);
+	traced_fd(t, FS_TRACE_READ, fd, offset, count, ret);
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_READ, ret, ret > 0 ? ret : 0);
+}
+
+int fs_advise(int fd, size_t offset, size_t len, int advice)
+{
+	uint64_t t = trace_begin(), st = stats_begin();
+	int packed = (fd & 0xFFFF) | (advice & 0xFFFF) << 16;
+	lock_fs(&default_fs);
+	int ret = traced_fd(t, FS_TRACE_ADVISE, packed, offset, len,
+		advise_locked(&default_fs, fd, offset, len, advice));
+	unlock_fs(&default_fs);
+	return stats_end(st, FS_STATS_ADVISE, ret, 0);
+}
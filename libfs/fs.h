@@ -6,12 +6,84 @@
 /** Maximum filename length (including the NULL character) */
 #define FS_FILENAME_LEN 16
 
-/** Maximum number of files in the root directory */
+/** Maximum number of files in the root directory of a v1 file system */
 #define FS_FILE_MAX_COUNT 128
 
 /** Maximum number of open files */
 #define FS_OPEN_MAX_COUNT 32
 
+/** File attributes, see fs_setattr() */
+#define FS_ATTR_COMPRESS 0x1	/* Data is compressed */
+#define FS_ATTR_DEDUP 0x2	/* Identical blocks are stored once */
+
+/** File system information, as filled in by fs_statfs() */
+struct fs_statfs {
+	int version;		/* On-disk format version, 1 or 2 */
+	size_t total_blk_count;	/* Total number of blocks on the disk */
+	size_t fat_blk_count;	/* Number of FAT blocks */
+	size_t csum_blk_count;	/* Number of checksum table blocks, 0 without
+				   checksums */
+	size_t rdir_blk;	/* Index of the first root directory block */
+	size_t rdir_blk_count;	/* Number of root directory blocks */
+	size_t rdir_entry_count; /* Number of root directory entries */
+	size_t data_blk;	/* Index of the first data block */
+	size_t data_blk_count;	/* Number of data blocks */
+	size_t fat_free_count;	/* Number of free data blocks */
+	size_t rdir_free_count;	/* Number of free root directory entries */
+	size_t blk_read_count;	/* Number of blocks read since mount */
+	size_t blk_write_count;	/* Number of blocks written since mount */
+};
+
+/** Options for fs_mount_ex() */
+struct fs_mount_options {
+	int lazy;		/* Load FAT blocks on first use, not at mount */
+	size_t fat_cache_max;	/* Max number of FAT blocks kept in memory, or 0
+				   for no limit */
+};
+
+/** Options for fs_mkfs() */
+struct fs_mkfs_options {
+	int version;		/* On-disk format version, 1 or 2 (the default
+				   for 0) */
+	size_t rdir_entry_count; /* Number of root directory entries (v2 only),
+				   or 0 for %FS_FILE_MAX_COUNT */
+	int hashed_dir;		/* Make the root directory a hash table (v2
+				   only) */
+	int checksums;		/* Keep a checksum of every data block (v2
+				   only) */
+};
+
+/**
+ * fs_mkfs - Create a file system
+ * @diskname: Name of the virtual disk file
+ * @data_blk_count: Number of data blocks
+ * @opts: Format options, or NULL for the defaults
+ *
+ * Create virtual disk file @diskname, holding an empty file system with
+ * @data_blk_count data blocks. Version 1 file systems are the ones created by
+ * the reference fs_make tool: they have at most 8192 data blocks and a
+ * single-block root directory of %FS_FILE_MAX_COUNT entries. Version 2 file
+ * systems use 32-bit block numbers and FAT entries, and a root directory of
+ * @opts->rdir_entry_count entries, rounded up to a whole number of blocks. Both
+ * versions can be mounted with fs_mount().
+ *
+ * With @opts->hashed_dir set, the root directory blocks are the buckets of a
+ * hash table on file names, and @opts->rdir_entry_count is the number of files
+ * it is sized for. Buckets that fill up are extended with overflow blocks taken
+ * from the data blocks, so the root directory is only limited by the free
+ * space, and finding a file only reads the blocks of its bucket.
+ *
+ * With @opts->checksums set, a table of CRC32C checksums of the data blocks is
+ * stored between the FAT and the root directory. The checksum of a block is
+ * updated whenever file data is written to it, and checked whenever file data
+ * is read from it: fs_read() fails rather than return corrupted data.
+ *
+ * Return: -1 if @diskname is invalid or cannot be created, or if the file
+ * system would be too large for its version. 0 otherwise.
+ */
+int fs_mkfs(const char *diskname, size_t data_blk_count,
+	    const struct fs_mkfs_options *opts);
+
 /**
  * fs_mount - Mount a file system
  * @diskname: Name of the virtual disk file
@@ -25,6 +97,23 @@
  */
 int fs_mount(const char *diskname);
 
+/**
+ * fs_mount_ex - Mount a file system with options
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults of fs_mount()
+ *
+ * Same as fs_mount(), but with control over how FAT blocks are cached. FAT
+ * blocks are always loaded on first use and kept in memory, at most
+ * @opts->fat_cache_max of them at a time. Unless the file system was cleanly
+ * unmounted, fs_mount() also reads the whole FAT to count free blocks; with
+ * @opts->lazy set, only the superblock and the root directory are read, and
+ * each FAT block is counted when it is first loaded.
+ *
+ * Return: -1 if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. 0 otherwise.
+ */
+int fs_mount_ex(const char *diskname, const struct fs_mount_options *opts);
+
 /**
  * fs_umount - Unmount file system
  *
@@ -45,6 +134,19 @@ int fs_umount(void);
  */
 int fs_info(void);
 
+/**
+ * fs_statfs - Get information about file system
+ * @st: Structure to be filled in
+ *
+ * Fill in @st with the layout and free space of the currently mounted file
+ * system. Free space is tracked in memory while the file system is mounted, so
+ * this function does not perform any disk access, except after a lazy mount
+ * and for hashed root directories, whose blocks are counted on each call.
+ *
+ * Return: -1 if no FS is currently mounted, or if @st is NULL. 0 otherwise.
+ */
+int fs_statfs(struct fs_statfs *st);
+
 /**
  * fs_create - Create a new file
  * @filename: File name
@@ -56,7 +158,7 @@ int fs_info(void);
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if a
  * file named @filename already exists, or if string @filename is too long, or
- * if the root directory already contains %FS_FILE_MAX_COUNT files. 0 otherwise.
+ * if the root directory is full. 0 otherwise.
  */
 int fs_create(const char *filename);
 
@@ -65,7 +167,7 @@ int fs_create(const char *filename);
  * @filename: File name
  *
  * Delete the file named @filename from the root directory of the mounted file
- * system.
+ * system. Directories are deleted with fs_rmdir() instead.
  *
  * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
  * there is no file named @filename to delete, or if file @filename is currently
@@ -82,6 +184,47 @@ int fs_delete(const char *filename);
  */
 int fs_ls(void);
 
+/**
+ * fs_mkdir - Create a directory
+ * @path: Path of the directory
+ *
+ * Create a new and empty directory at @path. On v2 file systems, the file
+ * names given to fs_create(), fs_delete() and fs_open() are paths: their
+ * components are separated by '/' characters, and are each limited to
+ * %FS_FILENAME_LEN characters (including the NULL character). Paths are
+ * relative to the root directory, whether they start with a '/' or not.
+ *
+ * Directory lookups are cached, so resolving the same path again does not
+ * read any directory block.
+ *
+ * Return: -1 if no FS is currently mounted, or if it is a v1 file system, or
+ * if @path is invalid, or if its parent directory does not exist, or if an
+ * entry named @path already exists, or if there is no space left. 0 otherwise.
+ */
+int fs_mkdir(const char *path);
+
+/**
+ * fs_rmdir - Delete a directory
+ * @path: Path of the directory
+ *
+ * Return: -1 if no FS is currently mounted, or if it is a v1 file system, or
+ * if @path is invalid, or if there is no directory at @path, or if that
+ * directory is not empty. 0 otherwise.
+ */
+int fs_rmdir(const char *path);
+
+/**
+ * fs_lsdir - List files in a directory
+ * @path: Path of the directory, "/" for the root directory
+ *
+ * Same as fs_ls(), for any directory. Only the blocks of that directory are
+ * read.
+ *
+ * Return: -1 if no FS is currently mounted, or if there is no directory at
+ * @path. 0 otherwise.
+ */
+int fs_lsdir(const char *path);
+
 /**
  * fs_open - Open a file
  * @filename: File name
@@ -133,12 +276,67 @@ int fs_stat(int fd);
  * descriptor @fd to the argument @offset. To append to a file, one can call
  * fs_lseek(fd, fs_stat(fd));
  *
+ * On v2 file systems, @offset may be past the end of the file. Writing there
+ * leaves a hole between the old end of the file and @offset, which takes no
+ * data block and reads as zeros.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (i.e., out of bounds, or not currently open), or if @offset is larger
- * than the current file size. 0 otherwise.
+ * than the current file size on a v1 file system, or than %INT_MAX on a v2 file
+ * system. 0 otherwise.
  */
 int fs_lseek(int fd, size_t offset);
 
+/**
+ * fs_setattr - Set file attributes
+ * @filename: File name
+ * @attrs: Attributes, a combination of the %FS_ATTR_* flags
+ *
+ * Set the attributes of the empty file named @filename, which decide how its
+ * data is stored. With %FS_ATTR_COMPRESS, data is compressed in chunks of 64
+ * KiB with a built-in LZ codec; chunks that do not compress are stored as is.
+ * Compressed files can still be read and written at any offset, but writing
+ * to a chunk rewrites it whole.
+ *
+ * With %FS_ATTR_DEDUP, each block written to the file is fingerprinted and
+ * looked up among the blocks recently written to or read from deduplicated
+ * files. A block holding the same data is shared rather than written again,
+ * and shared blocks are copied when one of the files modifies them. The index
+ * of fingerprints is kept in memory, so it starts empty at each mount.
+ *
+ * Return: -1 if no FS is currently mounted, or if it is a v1 file system, or
+ * if @filename is invalid, or if there is no file named @filename, or if that
+ * file is not empty, or if @attrs is invalid or combines %FS_ATTR_COMPRESS
+ * with %FS_ATTR_DEDUP. 0 otherwise.
+ */
+int fs_setattr(const char *filename, int attrs);
+
+/**
+ * fs_getattr - Get file attributes
+ * @filename: File name
+ *
+ * Return: -1 if no FS is currently mounted, or if @filename is invalid, or if
+ * there is no file named @filename. Otherwise, the attributes of the file.
+ */
+int fs_getattr(const char *filename);
+
+/**
+ * fs_clone - Clone a file
+ * @src: Name of the file to clone
+ * @dst: Name of the new file
+ *
+ * Create a new file named @dst with the same content and attributes as file
+ * @src, without copying its data: both files share their blocks until either
+ * of them is written to, and blocks are only copied as they are modified. The
+ * blocks of a file that is not mapped yet are first listed in a map, which
+ * costs FAT updates but no data copy.
+ *
+ * Return: -1 if no FS is currently mounted, or if it is a v1 file system, or
+ * if @src or @dst is invalid, or if there is no file named @src, or if an
+ * entry named @dst already exists, or if there is no space left. 0 otherwise.
+ */
+int fs_clone(const char *src, const char *dst);
+
 /**
  * fs_write - Write to a file
  * @fd: File descriptor
@@ -158,6 +356,10 @@ int fs_lseek(int fd, size_t offset);
  * The file offset of the file descriptor is implicitly incremented by the
  * number of bytes that were actually written.
  *
+ * On v2 file systems, files of up to 124 bytes are stored in their directory
+ * block rather than in data blocks, as long as the directory slots that follow
+ * their entry are free. They are moved to a data block as they grow.
+ *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
  * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
  * return the number of bytes actually written.
@@ -180,9 +382,227 @@ int fs_write(int fd, void *buf, size_t count);
  * implicitly incremented by the number of bytes that were actually read.
  *
  * Return: -1 if no FS is currently mounted, or if file descriptor @fd is
- * invalid (out of bounds or not currently open), or if @buf is NULL. Otherwise
- * return the number of bytes actually read.
+ * invalid (out of bounds or not currently open), or if @buf is NULL, or if the
+ * data cannot be read or does not match its checksum. Otherwise return the
+ * number of bytes actually read.
  */
 int fs_read(int fd, void *buf, size_t count);
 
+/** Access pattern hints, see fs_advise() */
+enum fs_advice {
+	FS_ADVICE_NORMAL,	/* No particular pattern, the default */
+	FS_ADVICE_SEQUENTIAL,	/* Read from start to end */
+	FS_ADVICE_RANDOM,	/* Read in no particular order */
+	FS_ADVICE_WILLNEED,	/* Read soon */
+	FS_ADVICE_DONTNEED,	/* Not read again soon */
+	FS_ADVICE_NOREUSE,	/* Read or written once */
+};
+
+/**
+ * fs_advise - Give a hint about how a file will be accessed
+ * @fd: File descriptor
+ * @offset: Offset of the part of the file the hint is about
+ * @len: Length of the part of the file the hint is about, 0 for all of it from
+ *       @offset on
+ * @advice: Hint, see enum fs_advice
+ *
+ * Tell how the data of the file open as file descriptor @fd will be accessed,
+ * so that it can be transferred faster. Hints never change the data read or
+ * written.
+ *
+ * %FS_ADVICE_WILLNEED starts reading the given part of the file into memory in
+ * the background, so that fs_read() can take it from there, and
+ * %FS_ADVICE_DONTNEED drops the copies held in memory. Up to 512 blocks of the
+ * file system are held in memory at a time, blocks that were not read lately
+ * making room for new ones.
+ *
+ * The other hints are about file descriptor @fd as a whole. With
+ * %FS_ADVICE_SEQUENTIAL, reading from @fd reads the next 64 blocks of the file
+ * ahead in the background, until %FS_ADVICE_RANDOM or %FS_ADVICE_NORMAL is
+ * given. With %FS_ADVICE_NOREUSE, until %FS_ADVICE_NORMAL is given, the blocks
+ * read ahead are dropped once they are read, and the data read or written
+ * through @fd is not kept in memory, by the virtual disk either.
+ *
+ * Every hint is also passed down to the virtual disk, for the blocks of the
+ * given part of the file, see block_advise_h().
+ *
+ * Return: -1 if no FS is currently mounted, if file descriptor @fd is invalid
+ * (out of bounds or not currently open), or if @advice is unknown. 0
+ * otherwise.
+ */
+int fs_advise(int fd, size_t offset, size_t len, int advice);
+
+/**
+ * fs_trace_start - Start recording a trace
+ * @path: Name of the trace file to create
+ *
+ * Record every call made to the functions above, from fs_mkfs() to fs_advise(),
+ * in trace file @path: the call and its arguments, the file offset of reads and
+ * writes, the return value, the start time of the call and its duration. The
+ * data read and written is not recorded. See fs_trace.h for the format of trace
+ * files, which test_fs can replay.
+ *
+ * A single trace is recorded at a time. Setting environment variable %FS_TRACE
+ * to the name of a trace file records the calls of the whole process, without
+ * calling this function. Calls to the handle-based functions below are not
+ * recorded.
+ *
+ * Return: -1 if a trace is already being recorded, or if @path cannot be
+ * created. 0 otherwise.
+ */
+int fs_trace_start(const char *path);
+
+/**
+ * fs_trace_stop - Stop recording a trace
+ *
+ * Return: -1 if no trace is being recorded, or if the trace could not be
+ * written in full. 0 otherwise.
+ */
+int fs_trace_stop(void);
+
+/** Calls counted by fs_get_stats() */
+enum fs_stats_call {
+	FS_STATS_MKFS,
+	FS_STATS_MOUNT,
+	FS_STATS_UMOUNT,
+	FS_STATS_INFO,
+	FS_STATS_STATFS,
+	FS_STATS_CREATE,
+	FS_STATS_DELETE,
+	FS_STATS_LS,
+	FS_STATS_MKDIR,
+	FS_STATS_RMDIR,
+	FS_STATS_LSDIR,
+	FS_STATS_OPEN,
+	FS_STATS_CLOSE,
+	FS_STATS_STAT,
+	FS_STATS_LSEEK,
+	FS_STATS_SETATTR,
+	FS_STATS_GETATTR,
+	FS_STATS_CLONE,
+	FS_STATS_WRITE,
+	FS_STATS_READ,
+	FS_STATS_ADVISE,
+	FS_STATS_ALLOC,		/* Allocation of a data block, internal */
+	FS_STATS_CALL_COUNT
+};
+
+/** Kinds of blocks counted by fs_get_stats() */
+enum fs_stats_blk {
+	FS_STATS_SUPER,		/* Superblock */
+	FS_STATS_FAT,		/* FAT blocks */
+	FS_STATS_CSUM,		/* Checksum table blocks */
+	FS_STATS_DIR,		/* Directory blocks, root directory or not */
+	FS_STATS_MAP,		/* Map blocks of mapped files */
+	FS_STATS_DATA,		/* File data */
+	FS_STATS_BLK_COUNT
+};
+
+/** Number of buckets of latency histograms */
+#define FS_STATS_BUCKETS 32
+
+/** Statistics of a kind of call */
+struct fs_call_stats {
+	size_t count;		/* Number of calls */
+	size_t errors;		/* Number of calls that failed */
+	size_t bytes;		/* Number of bytes read or written */
+	size_t ns;		/* Total duration of the calls, in ns */
+	size_t hist[FS_STATS_BUCKETS]; /* Number of calls that took less than
+					  2^i ns, and at least 2^(i-1) ns. The
+					  last bucket also counts longer
+					  calls. */
+};
+
+/** Statistics of the file systems of the process, see fs_get_stats() */
+struct fs_stats {
+	struct fs_call_stats calls[FS_STATS_CALL_COUNT];
+	size_t blk_reads[FS_STATS_BLK_COUNT];
+	size_t blk_writes[FS_STATS_BLK_COUNT];
+};
+
+/**
+ * fs_get_stats - Get runtime statistics
+ * @st: Statistics to fill in
+ *
+ * Fill in @st with statistics of the calls made to the functions above and to
+ * their handle-based counterparts below, on all the file systems of the
+ * process, since the last call to fs_reset_stats() or since the process
+ * started. Calls are timed from the moment they are made, waiting for other
+ * threads included. The blocks read and written by the calls are counted by
+ * kind.
+ *
+ * Threads count their calls on their own, so that keeping statistics costs
+ * little and does not make threads wait for each other.
+ *
+ * Return: -1 if @st is NULL. 0 otherwise.
+ */
+int fs_get_stats(struct fs_stats *st);
+
+/**
+ * fs_reset_stats - Reset runtime statistics
+ *
+ * Start counting the statistics returned by fs_get_stats() from 0 again.
+ */
+void fs_reset_stats(void);
+
+/*
+ * Handle-based interface
+ *
+ * The functions above work on a single file system per process. The functions
+ * below take the file system to work on as a handle instead, so that several
+ * file systems can be mounted at the same time. Each of them behaves like its
+ * counterpart above, with @fs designating the file system; file descriptors
+ * are only valid for the file system they were opened on. The functions above
+ * are equivalent to calling these on a default file system.
+ *
+ * All functions can be called from several threads at once. The calls made on
+ * the same file system run one at a time, and file descriptors are shared by
+ * the threads.
+ */
+
+/** Mounted file system */
+typedef struct fs_instance *fs_handle_t;
+
+/**
+ * fs_mount_h - Mount a file system
+ * @diskname: Name of the virtual disk file
+ * @opts: Mount options, or NULL for the defaults
+ *
+ * Return: NULL if virtual disk file @diskname cannot be opened, or if no valid
+ * file system can be located. Otherwise, a handle to the mounted file system.
+ */
+fs_handle_t fs_mount_h(const char *diskname,
+		       const struct fs_mount_options *opts);
+
+/**
+ * fs_umount_h - Unmount file system
+ * @fs: File system to unmount
+ *
+ * Unmount @fs and close its virtual disk file. @fs cannot be used anymore
+ * afterwards.
+ *
+ * Return: -1 if @fs is NULL, or if the virtual disk cannot be closed. 0
+ * otherwise.
+ */
+int fs_umount_h(fs_handle_t fs);
+
+int fs_info_h(fs_handle_t fs);
+int fs_statfs_h(fs_handle_t fs, struct fs_statfs *st);
+int fs_create_h(fs_handle_t fs, const char *filename);
+int fs_delete_h(fs_handle_t fs, const char *filename);
+int fs_ls_h(fs_handle_t fs);
+int fs_mkdir_h(fs_handle_t fs, const char *path);
+int fs_rmdir_h(fs_handle_t fs, const char *path);
+int fs_lsdir_h(fs_handle_t fs, const char *path);
+int fs_open_h(fs_handle_t fs, const char *filename);
+int fs_close_h(fs_handle_t fs, int fd);
+int fs_stat_h(fs_handle_t fs, int fd);
+int fs_lseek_h(fs_handle_t fs, int fd, size_t offset);
+int fs_setattr_h(fs_handle_t fs, const char *filename, int attrs);
+int fs_getattr_h(fs_handle_t fs, const char *filename);
+int fs_clone_h(fs_handle_t fs, const char *src, const char *dst);
+int fs_write_h(fs_handle_t fs, int fd, void *buf, size_t count);
+int fs_read_h(fs_handle_t fs, int fd, void *buf, size_t count);
+int fs_advise_h(fs_handle_t fs, int fd, size_t offset, size_t len, int advice);
+
 #endif /* _FS_H */
@@ -0,0 +1,86 @@
+#ifndef _FS_TRACE_H
+#define _FS_TRACE_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/*
+ * Trace files
+ *
+ * A trace file starts with struct fs_trace_header, followed by one record per
+ * call made to the file system API, in the order the calls returned. Each
+ * record is a struct fs_trace_record, followed by @name_len bytes of names
+ * (without their NULL character). Fields are in host byte order.
+ */
+
+#define FS_TRACE_SIGNATURE "ECS150TR"
+#define FS_TRACE_VERSION 1
+
+struct fs_trace_header {
+	char signature[8];
+	uint32_t version;
+	uint32_t record_size;	/* sizeof(struct fs_trace_record) */
+} __attribute__((packed));
+
+/** Calls of the file system API, and the record fields they use */
+enum fs_trace_op {
+	FS_TRACE_MKFS = 1,	/* name: disk, offset: data block count,
+				   size: root entry count, fd: version |
+				   hashed_dir << 8 | checksums << 9 */
+	FS_TRACE_MOUNT,		/* name: disk, offset: FAT cache max,
+				   fd: lazy */
+	FS_TRACE_UMOUNT,
+	FS_TRACE_INFO,
+	FS_TRACE_STATFS,
+	FS_TRACE_CREATE,	/* name */
+	FS_TRACE_DELETE,	/* name */
+	FS_TRACE_LS,
+	FS_TRACE_MKDIR,		/* name */
+	FS_TRACE_RMDIR,		/* name */
+	FS_TRACE_LSDIR,		/* name */
+	FS_TRACE_OPEN,		/* name */
+	FS_TRACE_CLOSE,		/* fd */
+	FS_TRACE_STAT,		/* fd */
+	FS_TRACE_LSEEK,		/* fd, offset */
+	FS_TRACE_SETATTR,	/* name, size: attributes */
+	FS_TRACE_GETATTR,	/* name */
+	FS_TRACE_CLONE,		/* name: source '\0' destination */
+	FS_TRACE_WRITE,		/* fd, offset: file offset, size: count */
+	FS_TRACE_READ,		/* fd, offset: file offset, size: count */
+	FS_TRACE_ADVISE,	/* fd: fd & 0xFFFF | advice << 16,
+				   offset, size: len */
+	FS_TRACE_OP_COUNT
+};
+
+struct fs_trace_record {
+	uint64_t time;		/* Start of the call, in ns since the trace
+				   started */
+	uint64_t offset;
+	uint32_t latency;	/* Duration of the call, in ns */
+	uint32_t size;
+	int32_t ret;		/* Return value of the call */
+	int32_t fd;
+	uint16_t name_len;
+	uint8_t op;		/* enum fs_trace_op */
+	uint8_t reserved;
+} __attribute__((packed));
+
+/**
+ * fs_trace_op_name - Get the name of a traced call
+ * @op: Traced call, see enum fs_trace_op
+ *
+ * Return: a static string naming the call, such as "write", or "?" if @op is
+ * unknown.
+ */
+const char *fs_trace_op_name(int op);
+
+/*
+ * Recording, used by the file system API. trace_begin() returns the start time
+ * of the call, or 0 when no trace is being recorded, in which case
+ * trace_end() must not be called.
+ */
+uint64_t trace_begin(void);
+void trace_end(uint64_t start, int op, int fd, uint64_t offset, size_t size,
+	       int ret, const char *name, const char *name2);
+
+#endif /* _FS_TRACE_H */
@@ -0,0 +1,183 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+
+/* Shortest back-reference, shorter repeats are stored as literals */
+#define MIN_MATCH 4
+
+/* Size of the match finder's hash table, as a power of 2 */
+#define HASH_BITS 12
+
+/* Longest distance of a back-reference */
+#define MAX_OFFSET 65535
+
+static uint32_t read32(const uint8_t *p)
+{
+	uint32_t v;
+
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - HASH_BITS);
+}
+
+/*
+ * Write the length @len, whose first 4 bits already went in the token, as
+ * extra bytes of 255 followed by the rest. Return the new output position or
+ * NULL if it does not fit.
+ */
+static uint8_t *put_length(uint8_t *op, uint8_t *oend, size_t len)
+{
+	if (len < 15)
+		return op;
+
+	len -= 15;
+	while (len >= 255) {
+		if (op >= oend)
+			return NULL;
+		*op++ = 255;
+		len -= 255;
+	}
+	if (op >= oend)
+		return NULL;
+	*op++ = (uint8_t)len;
+	return op;
+}
+
+/* Write one token: @lit literals, then a match of @mlen bytes at @off back */
+static uint8_t *put_sequence(uint8_t *op, uint8_t *oend, const uint8_t *lit,
+			     size_t nlit, size_t off, size_t mlen)
+{
+	size_t mcode = mlen ? mlen - MIN_MATCH : 0;
+
+	if (op >= oend)
+		return NULL;
+	*op++ = (uint8_t)((nlit < 15 ? nlit : 15) << 4 | (mcode < 15 ? mcode : 15));
+
+	if (!(op = put_length(op, oend, nlit)))
+		return NULL;
+	if ((size_t)(oend - op) < nlit)
+		return NULL;
+	memcpy(op, lit, nlit);
+	op += nlit;
+
+	/* The last token only has literals */
+	if (!mlen)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = off & 0xFF;
+	*op++ = off >> 8;
+	return put_length(op, oend, mcode);
+}
+
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap)
+{
+	const uint8_t *in = src;
+	uint8_t *op = dst, *oend = op + cap;
+	/* Position + 1 of the last occurrence of each hashed 4-byte sequence */
+	uint32_t table[1 << HASH_BITS];
+	size_t i = 0, anchor = 0;
+
+	if (n > LZ_MAX_INPUT)
+		return 0;
+
+	memset(table, 0, sizeof(table));
+	while (n >= MIN_MATCH && i <= n - MIN_MATCH) {
+		uint32_t seq = read32(in + i);
+		uint32_t h = hash4(seq);
+		size_t ref = table[h];
+		size_t len;
+
+		table[h] = i + 1;
+		if (!ref || i - (ref - 1) > MAX_OFFSET ||
+		    read32(in + ref - 1) != seq) {
+			i++;
+			continue;
+		}
+
+		ref--;
+		len = MIN_MATCH;
+		while (i + len < n && in[ref + len] == in[i + len])
+			len++;
+
+		op = put_sequence(op, oend, in + anchor, i - anchor, i - ref,
+				  len);
+		if (!op)
+			return 0;
+
+		i += len;
+		anchor = i;
+	}
+
+	op = put_sequence(op, oend, in + anchor, n - anchor, 0, 0);
+	if (!op)
+		return 0;
+	return op - (uint8_t *)dst;
+}
+
+/*
+ * Read the rest of a length whose first 4 bits are @len. Return -1 if the
+ * input ends first.
+ */
+static int get_length(const uint8_t **ip, const uint8_t *iend, size_t *len)
+{
+	uint8_t b;
+
+	if (*len < 15)
+		return 0;
+
+	do {
+		if (*ip >= iend)
+			return -1;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+	return 0;
+}
+
+int lz_decompress(const void *src, size_t n, void *dst, size_t cap)
+{
+	const uint8_t *ip = src, *iend = ip + n;
+	uint8_t *out = dst, *op = out, *oend = out + cap;
+
+	while (ip < iend) {
+		uint8_t token = *ip++;
+		size_t nlit = token >> 4, mlen = token & 15, off;
+
+		if (get_length(&ip, iend, &nlit) ||
+		    nlit > (size_t)(iend - ip) || nlit > (size_t)(oend - op))
+			return -1;
+		memcpy(op, ip, nlit);
+		ip += nlit;
+		op += nlit;
+
+		/* The last token only has literals */
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return -1;
+		off = ip[0] | ip[1] << 8;
+		ip += 2;
+		if (get_length(&ip, iend, &mlen))
+			return -1;
+		mlen += MIN_MATCH;
+
+		if (off == 0 || off > (size_t)(op - out) ||
+		    mlen > (size_t)(oend - op))
+			return -1;
+
+		/* Matches may overlap the bytes they produce */
+		for (size_t k = 0; k < mlen; k++)
+			op[k] = op[k - off];
+		op += mlen;
+	}
+
+	return op - out;
+}
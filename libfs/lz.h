@@ -0,0 +1,37 @@
+#ifndef _LZ_H
+#define _LZ_H
+
+#include <stddef.h> /* for size_t definition */
+
+/** Largest input of lz_compress(), so that match offsets fit in 16 bits */
+#define LZ_MAX_INPUT 65536
+
+/**
+ * lz_compress - Compress a buffer
+ * @src: Data to compress
+ * @n: Size of @src in bytes, at most %LZ_MAX_INPUT
+ * @dst: Buffer to be filled with compressed data
+ * @cap: Size of @dst in bytes
+ *
+ * Compress @src with a byte-oriented LZ77 codec: a sequence of tokens, each
+ * made of a run of literal bytes followed by a back-reference of at least 4
+ * bytes into the previous 64 KiB of data.
+ *
+ * Return: the size of the compressed data, or 0 if it does not fit in @cap
+ * bytes.
+ */
+size_t lz_compress(const void *src, size_t n, void *dst, size_t cap);
+
+/**
+ * lz_decompress - Decompress a buffer
+ * @src: Data compressed by lz_compress()
+ * @n: Size of @src in bytes
+ * @dst: Buffer to be filled with decompressed data
+ * @cap: Size of @dst in bytes
+ *
+ * Return: -1 if @src is not valid compressed data, or if it decompresses to
+ * more than @cap bytes. Otherwise, the size of the decompressed data.
+ */
+int lz_decompress(const void *src, size_t n, void *dst, size_t cap);
+
+#endif /* _LZ_H */
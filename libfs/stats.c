@@ -0,0 +1,202 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+#include "fs.h"
+#include "stats.h"
+
+/*
+ * Every thread that makes calls gets its own statistics, which only it updates,
+ * and which are summed up by fs_get_stats(). The statistics of threads that
+ * exit are added to the retired ones. Resetting the statistics records their
+ * current sum, which fs_get_stats() subtracts.
+ */
+
+struct stats_thread {
+	struct fs_stats st;
+	struct stats_thread *next;
+};
+
+/* struct fs_stats is made of counters only */
+#define STATS_COUNTERS (sizeof(struct fs_stats) / sizeof(size_t))
+
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t stats_once = PTHREAD_ONCE_INIT;
+static pthread_key_t stats_key;
+static struct stats_thread *threads;
+static struct fs_stats retired, base;
+
+static __thread struct stats_thread *self;
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*
+ * Calls are timed with the time stamp counter, which takes about half the time
+ * of the clock to read. Its rate is measured against the clock once.
+ */
+#define CALIBRATION_NS 200000
+
+static pthread_once_t calibrate_once = PTHREAD_ONCE_INIT;
+static double ns_per_tick;
+
+static void calibrate(void)
+{
+	uint64_t ns = now_ns(), tsc = __rdtsc(), elapsed;
+
+	while ((elapsed = now_ns() - ns) < CALIBRATION_NS)
+		;
+	ns_per_tick = (double)elapsed / (__rdtsc() - tsc);
+}
+
+uint64_t stats_begin(void)
+{
+	return __rdtsc();
+}
+
+static uint64_t elapsed_ns(uint64_t start)
+{
+	int64_t ticks = __rdtsc() - start;
+
+	pthread_once(&calibrate_once, calibrate);
+	return ticks > 0 ? ticks * ns_per_tick : 0;
+}
+#else
+uint64_t stats_begin(void)
+{
+	return now_ns();
+}
+
+static uint64_t elapsed_ns(uint64_t start)
+{
+	return now_ns() - start;
+}
+#endif
+
+/* Add @count to counter @c, which only the calling thread updates */
+static void add(size_t *c, size_t count)
+{
+	__atomic_store_n(c, *c + count, __ATOMIC_RELAXED);
+}
+
+/* Add the counters of @from to @to */
+static void sum(struct fs_stats *to, struct fs_stats *from)
+{
+	size_t *t = (size_t *)to, *f = (size_t *)from;
+
+	for (size_t i = 0; i < STATS_COUNTERS; i++)
+		t[i] += __atomic_load_n(&f[i], __ATOMIC_RELAXED);
+}
+
+static void thread_exit(void *arg)
+{
+	struct stats_thread *s = arg, **p;
+
+	pthread_mutex_lock(&stats_lock);
+	sum(&retired, &s->st);
+	for (p = &threads; *p != s; p = &(*p)->next)
+		;
+	*p = s->next;
+	pthread_mutex_unlock(&stats_lock);
+	free(s);
+}
+
+static void stats_init(void)
+{
+	pthread_key_create(&stats_key, thread_exit);
+}
+
+/* Statistics of the calling thread, NULL if they cannot be allocated */
+static struct fs_stats *local(void)
+{
+	struct stats_thread *s = self;
+
+	if (s)
+		return &s->st;
+
+	pthread_once(&stats_once, stats_init);
+	if (!(s = calloc(1, sizeof(*s))))
+		return NULL;
+
+	pthread_mutex_lock(&stats_lock);
+	s->next = threads;
+	threads = s;
+	pthread_mutex_unlock(&stats_lock);
+	pthread_setspecific(stats_key, s);
+
+	self = s;
+	return &s->st;
+}
+
+int stats_end(uint64_t start, int call, int ret, size_t bytes)
+{
+	struct fs_stats *st = local();
+	uint64_t ns = elapsed_ns(start);
+	int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+	struct fs_call_stats *c;
+
+	if (!st)
+		return ret;
+
+	c = &st->calls[call];
+	if (bucket >= FS_STATS_BUCKETS)
+		bucket = FS_STATS_BUCKETS - 1;
+	add(&c->count, 1);
+	if (ret == -1)
+		add(&c->errors, 1);
+	add(&c->bytes, bytes);
+	add(&c->ns, ns);
+	add(&c->hist[bucket], 1);
+
+	return ret;
+}
+
+void stats_blocks(int kind, int write, size_t count)
+{
+	struct fs_stats *st = local();
+
+	if (st)
+		add(write ? &st->blk_writes[kind] : &st->blk_reads[kind],
+		    count);
+}
+
+/* Sum of the statistics of all threads, with the lock held */
+static void total(struct fs_stats *st)
+{
+	memcpy(st, &retired, sizeof(*st));
+	for (struct stats_thread *s = threads; s; s = s->next)
+		sum(st, &s->st);
+}
+
+int fs_get_stats(struct fs_stats *st)
+{
+	size_t *t = (size_t *)st, *b = (size_t *)&base;
+
+	if (!st)
+		return -1;
+
+	pthread_mutex_lock(&stats_lock);
+	total(st);
+	for (size_t i = 0; i < STATS_COUNTERS; i++)
+		t[i] -= b[i];
+	pthread_mutex_unlock(&stats_lock);
+
+	return 0;
+}
+
+void fs_reset_stats(void)
+{
+	pthread_mutex_lock(&stats_lock);
+	total(&base);
+	pthread_mutex_unlock(&stats_lock);
+}
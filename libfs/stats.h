@@ -0,0 +1,38 @@
+#ifndef _STATS_H
+#define _STATS_H
+
+#include <stddef.h> /* for size_t definition */
+#include <stdint.h>
+
+/*
+ * Runtime statistics, see fs_get_stats(). Each thread counts in its own
+ * statistics, which are summed up when they are read.
+ */
+
+/**
+ * stats_begin - Start timing a call
+ *
+ * Return: the start time of the call, to pass to stats_end().
+ */
+uint64_t stats_begin(void);
+
+/**
+ * stats_end - Count a call
+ * @start: Start time of the call, as returned by stats_begin()
+ * @call: Kind of call, see enum fs_stats_call
+ * @ret: Return value of the call, -1 standing for an error
+ * @bytes: Number of bytes the call read or wrote
+ *
+ * Return: @ret.
+ */
+int stats_end(uint64_t start, int call, int ret, size_t bytes);
+
+/**
+ * stats_blocks - Count blocks read or written
+ * @kind: Kind of blocks, see enum fs_stats_blk
+ * @write: The blocks were written, not read
+ * @count: Number of blocks
+ */
+void stats_blocks(int kind, int write, size_t count);
+
+#endif /* _STATS_H */
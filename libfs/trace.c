@@ -0,0 +1,183 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "fs.h"
+#include "fs_trace.h"
+
+/*
+ * Trace recording. Records are appended to a buffered stream under a lock, and
+ * calls only check a flag when no trace is being recorded.
+ */
+
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t trace_env_once = PTHREAD_ONCE_INIT;
+static FILE *trace_file;
+/* A trace is being recorded, read without the lock */
+static int tracing;
+/* A record could not be written */
+static int trace_failed;
+static uint64_t trace_start;
+
+static const char *op_names[FS_TRACE_OP_COUNT] = {
+	[FS_TRACE_MKFS] = "mkfs",
+	[FS_TRACE_MOUNT] = "mount",
+	[FS_TRACE_UMOUNT] = "umount",
+	[FS_TRACE_INFO] = "info",
+	[FS_TRACE_STATFS] = "statfs",
+	[FS_TRACE_CREATE] = "create",
+	[FS_TRACE_DELETE] = "delete",
+	[FS_TRACE_LS] = "ls",
+	[FS_TRACE_MKDIR] = "mkdir",
+	[FS_TRACE_RMDIR] = "rmdir",
+	[FS_TRACE_LSDIR] = "lsdir",
+	[FS_TRACE_OPEN] = "open",
+	[FS_TRACE_CLOSE] = "close",
+	[FS_TRACE_STAT] = "stat",
+	[FS_TRACE_LSEEK] = "lseek",
+	[FS_TRACE_SETATTR] = "setattr",
+	[FS_TRACE_GETATTR] = "getattr",
+	[FS_TRACE_CLONE] = "clone",
+	[FS_TRACE_WRITE] = "write",
+	[FS_TRACE_READ] = "read",
+	[FS_TRACE_ADVISE] = "advise",
+};
+
+const char *fs_trace_op_name(int op)
+{
+	if (op <= 0 || op >= FS_TRACE_OP_COUNT)
+		return "?";
+	return op_names[op];
+}
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void trace_exit(void)
+{
+	if (__atomic_load_n(&tracing, __ATOMIC_ACQUIRE))
+		fs_trace_stop();
+}
+
+static int start_trace(const char *path)
+{
+	struct fs_trace_header h = {
+		.signature = FS_TRACE_SIGNATURE,
+		.version = FS_TRACE_VERSION,
+		.record_size = sizeof(struct fs_trace_record),
+	};
+	int ret = -1;
+
+	pthread_mutex_lock(&trace_lock);
+	if (trace_file) {
+		fprintf(stderr, "%s: a trace is already being recorded\n",
+			__func__);
+	} else if (!(trace_file = fopen(path, "wb"))) {
+		perror("fopen");
+	} else if (fwrite(&h, sizeof(h), 1, trace_file) != 1) {
+		perror("fwrite");
+		fclose(trace_file);
+		trace_file = NULL;
+	} else {
+		trace_failed = 0;
+		trace_start = now_ns();
+		__atomic_store_n(&tracing, 1, __ATOMIC_RELEASE);
+		ret = 0;
+	}
+	pthread_mutex_unlock(&trace_lock);
+
+	return ret;
+}
+
+/* Record the whole process if FS_TRACE names a trace file */
+static void trace_env(void)
+{
+	const char *path = getenv("FS_TRACE");
+
+	if (path && *path && start_trace(path) == 0)
+		atexit(trace_exit);
+}
+
+int fs_trace_start(const char *path)
+{
+	/* A trace requested by the environment comes first */
+	pthread_once(&trace_env_once, trace_env);
+	if (!path)
+		return -1;
+
+	return start_trace(path);
+}
+
+int fs_trace_stop(void)
+{
+	int ret = 0;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_file) {
+		pthread_mutex_unlock(&trace_lock);
+		return -1;
+	}
+
+	__atomic_store_n(&tracing, 0, __ATOMIC_RELEASE);
+	if (fclose(trace_file) || trace_failed) {
+		fprintf(stderr, "%s: the trace could not be written\n",
+			__func__);
+		ret = -1;
+	}
+	trace_file = NULL;
+	pthread_mutex_unlock(&trace_lock);
+
+	return ret;
+}
+
+uint64_t trace_begin(void)
+{
+	pthread_once(&trace_env_once, trace_env);
+	if (!__atomic_load_n(&tracing, __ATOMIC_ACQUIRE))
+		return 0;
+
+	return now_ns();
+}
+
+void trace_end(uint64_t start, int op, int fd, uint64_t offset, size_t size,
+	       int ret, const char *name, const char *name2)
+{
+	uint64_t end = now_ns();
+	struct fs_trace_record r = {
+		.offset = offset,
+		.latency = end - start > UINT32_MAX ? UINT32_MAX : end - start,
+		.size = size > UINT32_MAX ? UINT32_MAX : size,
+		.ret = ret,
+		.fd = fd,
+		.op = op,
+	};
+	/* Names that do not fit are cut, and will not be found on replay */
+	size_t max = name2 ? UINT16_MAX / 2 : UINT16_MAX;
+	size_t len = name ? strnlen(name, max) : 0;
+	size_t len2 = name2 ? strnlen(name2, max) : 0;
+
+	r.name_len = name2 ? len + 1 + len2 : len;
+
+	pthread_mutex_lock(&trace_lock);
+	if (!trace_file) {
+		/* The trace was stopped during the call */
+		pthread_mutex_unlock(&trace_lock);
+		return;
+	}
+
+	r.time = start > trace_start ? start - trace_start : 0;
+	if (fwrite(&r, sizeof(r), 1, trace_file) != 1 ||
+	    (len && fwrite(name, 1, len, trace_file) != len))
+		trace_failed = 1;
+	if (name2 && (fputc('\0', trace_file) == EOF ||
+		      (len2 && fwrite(name2, 1, len2, trace_file) != len2)))
+		trace_failed = 1;
+	pthread_mutex_unlock(&trace_lock);
+}